@@ -5,12 +5,15 @@
 #include <glad/gl.h>
 #include <GLFW/glfw3.h>
 #include <string.h>
+#include "heat_omp.h"
+#include "heat_grid.h"
+#include "heat_options.h"
+#include "heat_series.h"
 
-#define N 12          // size of cube (NxNxN)
-#define ALPHA 0.05    // thermal diffusivity
-#define EPSILON 0.01  // stopping condition
-
-typedef float data_type;
+// Defaults of --size, --alpha and --epsilon
+#define DEFAULT_N 12          // size of cube (NxNxN)
+#define DEFAULT_ALPHA 0.05    // thermal diffusivity
+#define DEFAULT_EPSILON 0.01  // stopping condition
 
 // OpenGL globals
 GLFWwindow* window = NULL;
@@ -338,7 +341,7 @@ void renderFullCube(data_type**** all_mats, int part, int num_ranks) {
     glBindVertexArray(full_VAO);
     
     float spacing = 0.5f;
-    float full_size = N + 2;
+    float full_size = 2 * (part - 1);
     float full_offset = (full_size - 1) * spacing / 2.0f;
     
     // Draw cubes from all ranks in their proper positions
@@ -368,10 +371,45 @@ void renderFullCube(data_type**** all_mats, int part, int num_ranks) {
     glfwSwapBuffers(full_window);
 }
 
-void initialize(data_type*** mat, int rank, int size) {
-    int part = ((N+2)/2)+1;
-    
-    // Initialize all to zero
+// A part^3 block stored contiguously, with the usual [i][j][k] pointer
+// tables on top, so faces can be described as MPI subarrays of it
+data_type*** cube_alloc(int part) {
+    data_type*** m = (data_type***)malloc(sizeof(data_type**)*part);
+    data_type** rows = (data_type**)malloc(sizeof(data_type*)*part*part);
+    data_type* cells = (data_type*)malloc(sizeof(data_type)*part*part*part);
+    for (int i = 0; i < part; i++) {
+        m[i] = rows + i*part;
+        for (int j = 0; j < part; j++) {
+            m[i][j] = cells + (i*part + j)*part;
+        }
+    }
+    return m;
+}
+
+void cube_free(data_type*** m) {
+    free(m[0][0]);
+    free(m[0]);
+    free(m);
+}
+
+// The plane at index `at` of one axis of a part^3 block (axis 0 is i, 2 is k)
+MPI_Datatype face_type(int part, int axis, int at) {
+    int sizes[3] = { part, part, part };
+    int subsizes[3] = { part, part, part };
+    int starts[3] = { 0, 0, 0 };
+    MPI_Datatype t;
+    
+    subsizes[axis] = 1;
+    starts[axis] = at;
+    MPI_Type_create_subarray(3, sizes, subsizes, starts, MPI_ORDER_C, MPI_DATA_TYPE, &t);
+    MPI_Type_commit(&t);
+    return t;
+}
+
+void initialize(data_type*** mat, int part, int rank, int size) {
+    // Initialize all to zero; each thread first-touches the planes it will
+    // update, using the same static schedule as the stencil loop
+    OMP(parallel for schedule(static))
     for (int i = 0; i < part; i++) {
         for (int j = 0; j < part; j++) {
             for (int k = 0; k < part; k++) {
@@ -398,6 +436,7 @@ void initialize(data_type*** mat, int rank, int size) {
 }
 
 void copy(data_type*** og, data_type*** cpy, int size){
+    OMP(parallel for schedule(static))
     for(int i = 0; i < size; i++){
         for(int j = 0; j < size; j++){
             for(int k = 0; k < size; k++){
@@ -407,8 +446,28 @@ void copy(data_type*** og, data_type*** cpy, int size){
     }
 }
 
-void simulation(data_type*** mat, int rank, int size, int visualize) {
-    int part = ((N + 2)/2) + 1;
+// Creates the snapshot series of the cube, with the blocks laid out the way
+// the full cube window shows them: two abreast along k, rows of two along
+// j. Blocks share their boundary planes with the block before them, which
+// writes them.
+int series_create_cube(series_t* s, const char* path, int part, int rank, int size, const problem_t* prob,
+                       MPI_Datatype* mem) {
+    int row = rank / 2, col = rank % 2;
+    int cols = size > 1 ? 2 : 1, rows = (size + 1) / 2;
+    int dims[3] = { part, rows * (part - 1) + 1, cols * (part - 1) + 1 };
+    int sizes[3] = { part, part, part };
+    int start[3] = { 0, row > 0, col > 0 };
+    int sub[3] = { part, part - start[1], part - start[2] };
+    int at[3] = { 0, row * (part - 1) + start[1], col * (part - 1) + start[2] };
+
+    MPI_Type_create_subarray(3, sizes, sub, start, MPI_ORDER_C, MPI_DATA_TYPE, mem);
+    MPI_Type_commit(mem);
+    return series_create(s, path, MPI_COMM_WORLD, 3, dims, sub, at, prob->alpha, prob->epsilon, 0, 0);
+}
+
+void simulation(data_type*** mat, int part, int rank, int size, int visualize, const problem_t* prob,
+                const char* series_path, int series_every) {
+    const float alpha = (float)prob->alpha;
     
     // Calculate neighbor ranks for 2x2x2 decomposition
     int layer = (rank % 4) / 2;  // z direction: 0 or 1
@@ -430,29 +489,71 @@ void simulation(data_type*** mat, int rank, int size, int visualize) {
     int neigh_zp = (layer == 0 && size > 4) ? rank + 2 : -1; // z+
     int neigh_zm = (layer == 1 && size > 4) ? rank - 2 : -1; // z-
     
-    data_type*** old = (data_type***)malloc(sizeof(data_type**)*part);
-    for (int i = 0; i < part; i++) {
-        old[i] = (data_type**)malloc(sizeof(data_type*)*part);
-        for (int j = 0; j < part; j++) {
-            old[i][j] = (data_type*)malloc(sizeof(data_type)*part);
-        }
+    // Ping-pong buffers: each iteration reads cur and writes next, then the
+    // pointers are swapped. Both start as full copies so boundary faces stay
+    // valid in either buffer; ghost cells are received into cur before use.
+    data_type*** spare = cube_alloc(part);
+    
+    copy(mat, spare, part);
+    data_type*** cur = mat;
+    data_type*** next = spare;
+    
+    // Every face is a subarray type on the block itself, so the messages
+    // go straight from and into the grid with no packing buffers: the last
+    // owned plane is sent and the ghost plane beyond it received
+    int neigh[6] = { neigh_xp, neigh_xm, neigh_yp, neigh_ym, neigh_zp, neigh_zm };
+    int axis[6] = { 2, 2, 0, 0, 2, 2 };
+    int send_at[6] = { part-2, 1, part-2, 1, part-2, 1 };
+    int recv_at[6] = { part-1, 0, part-1, 0, part-1, 0 };
+    MPI_Datatype send_face[6], recv_face[6];
+    for (int f = 0; f < 6; f++) {
+        send_face[f] = face_type(part, axis[f], send_at[f]);
+        recv_face[f] = face_type(part, axis[f], recv_at[f]);
     }
     
-    copy(mat, old, part);
-    
-    // Buffers for boundary exchange
-    data_type *send_buf = (data_type*)malloc(part * part * sizeof(data_type));
-    data_type *recv_buf = (data_type*)malloc(part * part * sizeof(data_type));
-    MPI_Request requests[12];
+    // Faces and neighbours never change, so the messages of each buffer are
+    // set up once as persistent requests and only restarted every
+    // iteration. Face f is sent with tag f and its opposite arrives with
+    // tag f^1.
+    data_type*** buffers[2] = { mat, spare };
+    MPI_Request requests[2][12];
     MPI_Status statuses[12];
+    int req_count = 0;
+    for (int b = 0; b < 2; b++) {
+        req_count = 0;
+        for (int f = 0; f < 6; f++) {
+            if (neigh[f] >= 0) {
+                MPI_Send_init(&buffers[b][0][0][0], 1, send_face[f], neigh[f], f, MPI_COMM_WORLD, &requests[b][req_count++]);
+                MPI_Recv_init(&buffers[b][0][0][0], 1, recv_face[f], neigh[f], f ^ 1, MPI_COMM_WORLD, &requests[b][req_count++]);
+            }
+        }
+    }
+    
+    // The evolution goes to one series file, starting with the initial field
+    series_t series;
+    MPI_Datatype cube;
+    int snapshots = series_path != NULL;
+    if (snapshots && series_create_cube(&series, series_path, part, rank, size, prob, &cube) != 0) {
+        if (rank == 0) {
+            fprintf(stderr, "Cannot write snapshot series '%s'\n", series_path);
+        }
+        MPI_Type_free(&cube);
+        snapshots = 0;
+    }
+    if (snapshots) {
+        series_append(&series, &mat[0][0][0], cube, 0, 0);
+    }
     
-    float global_eps = EPSILON + 1;
+    float global_eps = prob->epsilon + 1;
+    float max_eps = 0.0;
     int iteration = 0;
     int done = 0;
+    int capped = 0;
+    int running = !visualize || !glfwWindowShouldClose(window);
     
     if (rank == 0) {
-        printf("\nStarting simulation with %d ranks...\n", size);
-        printf("Grid size: %dx%dx%d\n", N, N, N);
+        printf("\nStarting simulation with %d ranks, %d threads each...\n", size, omp_get_max_threads());
+        printf("Grid size: %dx%dx%d\n", prob->n, prob->n, prob->n);
         printf("Each rank has: %dx%dx%d cells\n", part, part, part);
         printf("Rank %d neighbors: x+=%d x-=%d y+=%d y-=%d z+=%d z-=%d\n\n", 
                rank, neigh_xp, neigh_xm, neigh_yp, neigh_ym, neigh_zp, neigh_zm);
@@ -460,237 +561,122 @@ void simulation(data_type*** mat, int rank, int size, int visualize) {
     
     MPI_Barrier(MPI_COMM_WORLD);
     
-    while (!done && (!visualize || !glfwWindowShouldClose(window))) {
-        int req_count = 0;
-        
-        // ===== NON-BLOCKING BOUNDARY EXCHANGE =====
-        
-        // X+ direction (send right face, recv from right)
-        if (neigh_xp >= 0) {
-            for (int i = 0; i < part; i++) {
-                for (int j = 0; j < part; j++) {
-                    send_buf[i * part + j] = mat[i][j][part-2];
-                }
-            }
-            MPI_Isend(send_buf, part*part, MPI_FLOAT, neigh_xp, 0, MPI_COMM_WORLD, &requests[req_count++]);
-            MPI_Irecv(recv_buf, part*part, MPI_FLOAT, neigh_xp, 1, MPI_COMM_WORLD, &requests[req_count++]);
-        }
-        
-        // X- direction (send left face, recv from left)
-        if (neigh_xm >= 0) {
-            for (int i = 0; i < part; i++) {
-                for (int j = 0; j < part; j++) {
-                    send_buf[i * part + j] = mat[i][j][1];
-                }
-            }
-            MPI_Isend(send_buf, part*part, MPI_FLOAT, neigh_xm, 1, MPI_COMM_WORLD, &requests[req_count++]);
-            MPI_Irecv(recv_buf, part*part, MPI_FLOAT, neigh_xm, 0, MPI_COMM_WORLD, &requests[req_count++]);
-        }
-        
-        // Y+ direction (send top face, recv from top)
-        if (neigh_yp >= 0) {
-            for (int i = 0; i < part; i++) {
-                for (int k = 0; k < part; k++) {
-                    send_buf[i * part + k] = mat[part-2][i][k];
-                }
-            }
-            MPI_Isend(send_buf, part*part, MPI_FLOAT, neigh_yp, 2, MPI_COMM_WORLD, &requests[req_count++]);
-            MPI_Irecv(recv_buf, part*part, MPI_FLOAT, neigh_yp, 3, MPI_COMM_WORLD, &requests[req_count++]);
-        }
-        
-        // Y- direction (send bottom face, recv from bottom)
-        if (neigh_ym >= 0) {
-            for (int i = 0; i < part; i++) {
-                for (int k = 0; k < part; k++) {
-                    send_buf[i * part + k] = mat[1][i][k];
-                }
-            }
-            MPI_Isend(send_buf, part*part, MPI_FLOAT, neigh_ym, 3, MPI_COMM_WORLD, &requests[req_count++]);
-            MPI_Irecv(recv_buf, part*part, MPI_FLOAT, neigh_ym, 2, MPI_COMM_WORLD, &requests[req_count++]);
-        }
-        
-        // Z+ direction (send back face, recv from back)
-        if (neigh_zp >= 0) {
-            for (int i = 0; i < part; i++) {
-                for (int j = 0; j < part; j++) {
-                    send_buf[i * part + j] = mat[i][j][part-2];
-                }
-            }
-            MPI_Isend(send_buf, part*part, MPI_FLOAT, neigh_zp, 4, MPI_COMM_WORLD, &requests[req_count++]);
-            MPI_Irecv(recv_buf, part*part, MPI_FLOAT, neigh_zp, 5, MPI_COMM_WORLD, &requests[req_count++]);
-        }
-        
-        // Z- direction (send front face, recv from front)
-        if (neigh_zm >= 0) {
-            for (int i = 0; i < part; i++) {
-                for (int j = 0; j < part; j++) {
-                    send_buf[i * part + j] = mat[i][j][1];
-                }
-            }
-            MPI_Isend(send_buf, part*part, MPI_FLOAT, neigh_zm, 5, MPI_COMM_WORLD, &requests[req_count++]);
-            MPI_Irecv(recv_buf, part*part, MPI_FLOAT, neigh_zm, 4, MPI_COMM_WORLD, &requests[req_count++]);
-        }
-        
-        // Wait for all communications to complete
-        if (req_count > 0) {
-            MPI_Waitall(req_count, requests, statuses);
-        }
-        
-        // Update ghost cells with received data
-        req_count = 0;
-        if (neigh_xp >= 0) {
-            // Skip - already received, now unpack
-            for (int i = 0; i < part; i++) {
-                for (int j = 0; j < part; j++) {
-                    mat[i][j][part-1] = recv_buf[i * part + j];
-                }
-            }
-            req_count += 2;
-        }
-        if (neigh_xm >= 0) {
-            for (int i = 0; i < part; i++) {
-                for (int j = 0; j < part; j++) {
-                    mat[i][j][0] = recv_buf[i * part + j];
-                }
-            }
-            req_count += 2;
-        }
-        if (neigh_yp >= 0) {
-            for (int i = 0; i < part; i++) {
-                for (int k = 0; k < part; k++) {
-                    mat[part-1][i][k] = recv_buf[i * part + k];
-                }
-            }
-            req_count += 2;
-        }
-        if (neigh_ym >= 0) {
-            for (int i = 0; i < part; i++) {
-                for (int k = 0; k < part; k++) {
-                    mat[0][i][k] = recv_buf[i * part + k];
-                }
-            }
-            req_count += 2;
-        }
-        if (neigh_zp >= 0) {
-            for (int i = 0; i < part; i++) {
-                for (int j = 0; j < part; j++) {
-                    mat[i][j][part-1] = recv_buf[i * part + j];
-                }
-            }
-            req_count += 2;
-        }
-        if (neigh_zm >= 0) {
-            for (int i = 0; i < part; i++) {
-                for (int j = 0; j < part; j++) {
-                    mat[i][j][0] = recv_buf[i * part + j];
+    // One parallel region for the whole run: the threads share the
+    // stencil, the master thread makes every MPI and
+    // OpenGL call. cur, next and the loop flag only change on the master,
+    // between barriers.
+    OMP(parallel)
+    {
+        while (running) {
+            // ===== NON-BLOCKING BOUNDARY EXCHANGE =====
+            
+            OMP(master)
+            {
+                // Restart the face messages of cur and wait for all of them
+                if (req_count > 0) {
+                    MPI_Request* req = requests[cur == mat ? 0 : 1];
+                    MPI_Startall(req_count, req);
+                    MPI_Waitall(req_count, req, statuses);
                 }
+                max_eps = 0.0;
             }
-            req_count += 2;
-        }
-        
-        // ===== COMPUTE HEAT DIFFUSION =====
-        float max_eps = 0.0;
-        
-        for (int i = 1; i < part-1; i++) {
-            for (int j = 1; j < part-1; j++) {
-                for (int k = 1; k < part-1; k++) {
-                    float delta = ALPHA * (
-                        old[i+1][j][k] + old[i-1][j][k] +
-                        old[i][j+1][k] + old[i][j-1][k] +
-                        old[i][j][k+1] + old[i][j][k-1] -
-                        6 * old[i][j][k]
-                    );
-                    
-                    mat[i][j][k] += delta;
-                    float eps = fabsf(delta / (mat[i][j][k] + 0.001f));
-                    if (eps > max_eps) max_eps = eps;
+            OMP(barrier)
+            
+            // ===== COMPUTE HEAT DIFFUSION =====
+            OMP(for schedule(static) reduction(max:max_eps))
+            for (int i = 1; i < part-1; i++) {
+                for (int j = 1; j < part-1; j++) {
+                    for (int k = 1; k < part-1; k++) {
+                        float delta = alpha * (
+                            cur[i+1][j][k] + cur[i-1][j][k] +
+                            cur[i][j+1][k] + cur[i][j-1][k] +
+                            cur[i][j][k+1] + cur[i][j][k-1] -
+                            6 * cur[i][j][k]
+                        );
+                        
+                        next[i][j][k] = cur[i][j][k] + delta;
+                        float eps = fabsf(delta / (next[i][j][k] + 0.001f));
+                        if (eps > max_eps) max_eps = eps;
+                    }
                 }
             }
-        }
-        
-        copy(mat, old, part);
-        MPI_Allreduce(&max_eps, &global_eps, 1, MPI_FLOAT, MPI_MAX, MPI_COMM_WORLD);
-        
-        if (global_eps <= EPSILON) done = 1;
-        
-        // Visualize
-        if (visualize && (done || iteration % 2 == 0)) {
-            processInput(window);
-            renderCubes(mat, part, window, 0, camera_angle_x, camera_angle_y, camera_distance);
             
-            // Collect and render full cube on rank 0
-            if (rank == 0) {
-                // Allocate storage for all ranks' data
-                data_type**** all_mats = (data_type****)malloc(sizeof(data_type***) * size);
-                all_mats[0] = mat;  // Rank 0's own data
+            OMP(master)
+            {
+                data_type*** tmp = cur;
+                cur = next;
+                next = tmp;
+                MPI_Allreduce(&max_eps, &global_eps, 1, MPI_FLOAT, MPI_MAX, MPI_COMM_WORLD);
                 
-                // Receive from other ranks
-                for (int r = 1; r < size; r++) {
-                    all_mats[r] = (data_type***)malloc(sizeof(data_type**)*part);
-                    for (int i = 0; i < part; i++) {
-                        all_mats[r][i] = (data_type**)malloc(sizeof(data_type*)*part);
-                        for (int j = 0; j < part; j++) {
-                            all_mats[r][i][j] = (data_type*)malloc(sizeof(data_type)*part);
-                        }
-                    }
-                    
-                    // Receive flattened data
-                    data_type* recv_buffer = (data_type*)malloc(part*part*part*sizeof(data_type));
-                    MPI_Recv(recv_buffer, part*part*part, MPI_FLOAT, r, 99, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-                    
-                    // Unflatten
-                    for (int i = 0; i < part; i++) {
-                        for (int j = 0; j < part; j++) {
-                            for (int k = 0; k < part; k++) {
-                                all_mats[r][i][j][k] = recv_buffer[i*part*part + j*part + k];
-                            }
-                        }
-                    }
-                    free(recv_buffer);
-                }
+                if (global_eps <= prob->epsilon) done = 1;
                 
-                // Render full cube
-                processInput(full_window);
-                renderFullCube(all_mats, part, size);
+                // Visualize
+                if (visualize && (done || iteration % 2 == 0)) {
+                    processInput(window);
+                    renderCubes(cur, part, window, 0, camera_angle_x, camera_angle_y, camera_distance);
+            
+                    // Collect and render full cube on rank 0
+                    if (rank == 0) {
+                        // Allocate storage for all ranks' data
+                        data_type**** all_mats = (data_type****)malloc(sizeof(data_type***) * size);
+                        all_mats[0] = cur;  // Rank 0's own data
                 
-                // Free received data
-                for (int r = 1; r < size; r++) {
-                    for (int i = 0; i < part; i++) {
-                        for (int j = 0; j < part; j++) {
-                            free(all_mats[r][i][j]);
+                        // Receive from other ranks
+                        for (int r = 1; r < size; r++) {
+                            all_mats[r] = cube_alloc(part);
+                            MPI_Recv(&all_mats[r][0][0][0], part*part*part, MPI_FLOAT, r, 99, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
                         }
-                        free(all_mats[r][i]);
-                    }
-                    free(all_mats[r]);
-                }
-                free(all_mats);
                 
-            } else {
-                // Send data to rank 0
-                data_type* send_buffer = (data_type*)malloc(part*part*part*sizeof(data_type));
-                for (int i = 0; i < part; i++) {
-                    for (int j = 0; j < part; j++) {
-                        for (int k = 0; k < part; k++) {
-                            send_buffer[i*part*part + j*part + k] = mat[i][j][k];
+                        // Render full cube
+                        processInput(full_window);
+                        renderFullCube(all_mats, part, size);
+                
+                        // Free received data
+                        for (int r = 1; r < size; r++) {
+                            cube_free(all_mats[r]);
                         }
+                        free(all_mats);
+                
+                    } else {
+                        // Send data to rank 0
+                        MPI_Send(&cur[0][0][0], part*part*part, MPI_FLOAT, 0, 99, MPI_COMM_WORLD);
                     }
-                }
-                MPI_Send(send_buffer, part*part*part, MPI_FLOAT, 0, 99, MPI_COMM_WORLD);
-                free(send_buffer);
-            }
             
-            glfwPollEvents();
+                    glfwPollEvents();
             
-            if (rank == 0 && iteration % 100 == 0) {
-                printf("Iteration %d, eps: %.6f\n", iteration, global_eps);
+                    if (rank == 0 && iteration % 100 == 0) {
+                        printf("Iteration %d, eps: %.6f\n", iteration, global_eps);
+                    }
+                }
+        
+                iteration++;
+                if (snapshots && (iteration % series_every == 0 || done)) {
+                    series_append(&series, &cur[0][0][0], cube, iteration, iteration * prob->alpha);
+                }
+                MPI_Barrier(MPI_COMM_WORLD);
+                capped = prob->max_iter > 0 && iteration >= prob->max_iter;
+                running = !done && !capped && (!visualize || !glfwWindowShouldClose(window));
             }
+            OMP(barrier)
         }
-        
-        iteration++;
-        MPI_Barrier(MPI_COMM_WORLD);
     }
     
-    if (rank == 0) {
+    // The caller owns mat, so copy the latest field back once if the last
+    // swap left it in the spare buffer
+    if (cur != mat) {
+        copy(cur, mat, part);
+    }
+    if (snapshots) {
+        if (iteration % series_every != 0 && !done) {
+            series_append(&series, &mat[0][0][0], cube, iteration, iteration * prob->alpha);
+        }
+        series_close(&series);
+        MPI_Type_free(&cube);
+    }
+    
+    if (rank == 0 && capped && !done) {
+        printf("\nStopped at the limit of %d iterations before converging\n", iteration);
+    } else if (rank == 0) {
         printf("\n✓ Simulation converged after %d iterations!\n", iteration);
         printf("Final epsilon: %.6f\n\n", global_eps);
         printf("Controls:\n");
@@ -711,51 +697,19 @@ void simulation(data_type*** mat, int rank, int size, int visualize) {
                 all_mats[0] = mat;
                 
                 for (int r = 1; r < size; r++) {
-                    all_mats[r] = (data_type***)malloc(sizeof(data_type**)*part);
-                    for (int i = 0; i < part; i++) {
-                        all_mats[r][i] = (data_type**)malloc(sizeof(data_type*)*part);
-                        for (int j = 0; j < part; j++) {
-                            all_mats[r][i][j] = (data_type*)malloc(sizeof(data_type)*part);
-                        }
-                    }
-                    
-                    data_type* recv_buffer = (data_type*)malloc(part*part*part*sizeof(data_type));
-                    MPI_Recv(recv_buffer, part*part*part, MPI_FLOAT, r, 99, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-                    
-                    for (int i = 0; i < part; i++) {
-                        for (int j = 0; j < part; j++) {
-                            for (int k = 0; k < part; k++) {
-                                all_mats[r][i][j][k] = recv_buffer[i*part*part + j*part + k];
-                            }
-                        }
-                    }
-                    free(recv_buffer);
+                    all_mats[r] = cube_alloc(part);
+                    MPI_Recv(&all_mats[r][0][0][0], part*part*part, MPI_FLOAT, r, 99, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
                 }
                 
                 processInput(full_window);
                 renderFullCube(all_mats, part, size);
                 
                 for (int r = 1; r < size; r++) {
-                    for (int i = 0; i < part; i++) {
-                        for (int j = 0; j < part; j++) {
-                            free(all_mats[r][i][j]);
-                        }
-                        free(all_mats[r][i]);
-                    }
-                    free(all_mats[r]);
+                    cube_free(all_mats[r]);
                 }
                 free(all_mats);
             } else {
-                data_type* send_buffer = (data_type*)malloc(part*part*part*sizeof(data_type));
-                for (int i = 0; i < part; i++) {
-                    for (int j = 0; j < part; j++) {
-                        for (int k = 0; k < part; k++) {
-                            send_buffer[i*part*part + j*part + k] = mat[i][j][k];
-                        }
-                    }
-                }
-                MPI_Send(send_buffer, part*part*part, MPI_FLOAT, 0, 99, MPI_COMM_WORLD);
-                free(send_buffer);
+                MPI_Send(&mat[0][0][0], part*part*part, MPI_FLOAT, 0, 99, MPI_COMM_WORLD);
             }
             
             glfwPollEvents();
@@ -768,37 +722,85 @@ void simulation(data_type*** mat, int rank, int size, int visualize) {
     }
     
     // Cleanup
-    free(send_buf);
-    free(recv_buf);
-    for (int i = 0; i < part; i++) {
-        for (int j = 0; j < part; j++) {
-            free(old[i][j]);
+    for (int b = 0; b < 2; b++) {
+        for (int r = 0; r < req_count; r++) {
+            MPI_Request_free(&requests[b][r]);
         }
-        free(old[i]);
     }
-    free(old);
+    for (int f = 0; f < 6; f++) {
+        MPI_Type_free(&send_face[f]);
+        MPI_Type_free(&recv_face[f]);
+    }
+    cube_free(spare);
 }
 
 int main(int argc, char** argv) {
-    MPI_Init(&argc, &argv);
+    // Only the master thread of each rank talks to MPI
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
 
     int world_rank, world_size;
     MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
     MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+    if (provided < MPI_THREAD_FUNNELED) {
+        if (world_rank == 0 && omp_get_max_threads() > 1) {
+            fprintf(stderr, "MPI library lacks MPI_THREAD_FUNNELED, running one thread per rank\n");
+        }
+        omp_set_num_threads(1);
+    }
 
-    int visualize = (argc > 1 && strcmp(argv[1], "--visualize") == 0);
-
-    int part = ((N + 2)/2) + 1;
-    
-    data_type ***mat = (data_type***)malloc(sizeof(data_type**)*part);
-    for (int i = 0; i < part; i++) {
-        mat[i] = (data_type**)malloc(sizeof(data_type*)*part);
-        for (int j = 0; j < part; j++) {
-            mat[i][j] = (data_type*)malloc(sizeof(data_type)*part);
+    // The cube is split in halves along each decomposed axis, so it needs
+    // an even size; explicit steps are stable up to a diffusivity of 1/6
+    const problem_t defaults = { DEFAULT_N, DEFAULT_ALPHA, DEFAULT_EPSILON, 0 };
+    problem_t prob = defaults;
+    int visualize = 0;
+    const char* series_path = NULL;
+    int series_every = 100;
+    int bad = options_expand(&argc, &argv, world_rank) != 0;
+    for (int i = 1; i < argc && !bad; i++) {
+        if (strcmp(argv[i], "--visualize") == 0) {
+            visualize = 1;
+        } else if (strcmp(argv[i], "--series") == 0 && i + 1 < argc) {
+            series_path = argv[++i];
+        } else if (strcmp(argv[i], "--series-every") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            series_every = atoi(argv[++i]);
+        } else if (!problem_option(argc, argv, &i, &prob)) {
+            if (world_rank == 0) {
+                fprintf(stderr, "Unknown or incomplete option '%s'\n", argv[i]);
+                fprintf(stderr, "Usage: %s [options]\n"
+                        "  --visualize        show the cube while it is computed\n"
+                        "  --series FILE      record the evolution in snapshot series FILE\n"
+                        "  --series-every K   one frame every K iterations (default 100)\n", argv[0]);
+                problem_usage(&defaults);
+            }
+            bad = 1;
+        }
+    }
+    if (!bad && (prob.n % 2 != 0 || prob.alpha > 1.0 / 6)) {
+        if (world_rank == 0) {
+            fprintf(stderr, "Need an even cube size and a diffusivity of at most 1/6 (got %d, %g)\n",
+                    prob.n, prob.alpha);
         }
+        bad = 1;
     }
+    // The neighbours below are those of a 2x2 grid of blocks (the z and y
+    // steps of a 2x2x2 grid would collide)
+    if (!bad && world_size != 4) {
+        if (world_rank == 0) {
+            fprintf(stderr, "The 3D demo runs on exactly 4 processes (got %d)\n", world_size);
+        }
+        bad = 1;
+    }
+    if (bad) {
+        MPI_Finalize();
+        return 1;
+    }
+
+    int part = prob.n / 2 + 2;
+    
+    data_type ***mat = cube_alloc(part);
     
-    initialize(mat, world_rank, world_size);
+    initialize(mat, part, world_rank, world_size);
     
     if (visualize) {
         if (initOpenGL(world_rank) == 0) {
@@ -808,7 +810,7 @@ int main(int argc, char** argv) {
         }
     }
     
-    simulation(mat, world_rank, world_size, visualize);
+    simulation(mat, part, world_rank, world_size, visualize, &prob, series_path, series_every);
     
     if (visualize) {
         glDeleteVertexArrays(1, &VAO);
@@ -817,13 +819,7 @@ int main(int argc, char** argv) {
         glfwTerminate();
     }
     
-    for (int i = 0; i < part; i++) {
-        for (int j = 0; j < part; j++) {
-            free(mat[i][j]);
-        }
-        free(mat[i]);
-    }
-    free(mat);
+    cube_free(mat);
 
     MPI_Finalize();
     return 0;
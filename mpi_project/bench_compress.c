@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "heat_grid.h"
+#include "heat_stencil.h"
+#include "heat_compress.h"
+
+// Single-process benchmark for the lossless field compression of
+// heat_compress.h. For every sheet size N it lets a hot left edge diffuse
+// for a number of time steps, then times compressing and decompressing the
+// whole sheet, frame included, the way a rank packs its share for a
+// checkpoint or snapshot. It reports the compression ratio, bits per value
+// and the throughput of both directions in MB/s of uncompressed values,
+// and checks that the decoded sheet is bitwise the original or, with
+// --lossy E, that no decoded value is more than E off. Built with -fopenmp,
+// the tiles are shared by OMP_NUM_THREADS threads.
+//
+// Usage: bench_compress [--steps S] [--lossy E] [N ...]
+
+#define MIN_SECONDS 0.25
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// The kind of field the solver writes: a hot left edge and steps explicit
+// time steps of diffusion into the sheet
+static void evolve(grid_t *a, grid_t *b, int n, int steps) {
+    stencil_kernel_t k = stencil_select("auto");
+
+    grid_fill(a, 0.);
+    for (int i = 0; i < n + 2; i++) {
+        GRID(a, i, 0) = 100.;
+    }
+    grid_copy(a, b);
+    OMP(parallel)
+    {
+        grid_t *cur = a, *next = b;
+        for (int s = 0; s < steps; s++) {
+            stencil_apply(&k, cur, next, 1, n + 1, 1, n + 1, 0.125f);
+            grid_t *t = cur;
+            cur = next;
+            next = t;
+        }
+    }
+    if (steps % 2) {
+        grid_copy(b, a);
+    }
+}
+
+// Returns MB/s of uncompressed values for repeated compression (decode = 0)
+// or decompression of g into out
+static double run(compress_t *c, const grid_t *g, data_type *out, int decode) {
+    long reps = 0;
+    double start = now(), elapsed = 0;
+    int done = 0;
+
+    OMP(parallel)
+    while (!done) {
+        for (int r = 0; r < 4; r++) {
+            if (decode) {
+                compress_decode(c->out, out, c->sub[1]);
+            } else {
+                compress_share(c, g);
+            }
+        }
+        OMP(master)
+        {
+            reps += 4;
+            elapsed = now() - start;
+            done = elapsed >= MIN_SECONDS;
+        }
+        OMP(barrier)
+    }
+    return (double)sizeof(data_type) * c->sub[0] * c->sub[1] * reps / elapsed / 1e6;
+}
+
+int main(int argc, char **argv) {
+    int default_sizes[] = { 256, 1024, 4096 };
+    int sizes[64], nsizes = 0;
+    int steps = 1000;
+    double bound = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--steps") == 0 && i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+            steps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lossy") == 0 && i + 1 < argc && atof(argv[i + 1]) > 0) {
+            bound = atof(argv[++i]);
+        } else if (nsizes < 64 && atoi(argv[i]) > 0) {
+            sizes[nsizes++] = atoi(argv[i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--steps S] [--lossy E] [N ...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (nsizes == 0) {
+        nsizes = sizeof(default_sizes) / sizeof(default_sizes[0]);
+        memcpy(sizes, default_sizes, sizeof(default_sizes));
+    }
+
+    printf("%d time steps, tiles of %d rows, %d threads, ", steps, COMPRESS_TILE_ROWS, omp_get_max_threads());
+    if (bound > 0) {
+        printf("every value within %g\n", bound);
+    } else {
+        printf("lossless\n");
+    }
+    printf("%8s %8s %10s %15s %15s %10s %6s\n", "N", "ratio", "bits/value", "compress MB/s", "decompress MB/s",
+           "max error", "check");
+
+    for (int s = 0; s < nsizes; s++) {
+        int n = sizes[s];
+        int sub[2] = { n + 2, n + 2 }, start[2] = { 0, 0 };
+        grid_t a, b;
+        compress_t c;
+        if (grid_alloc(&a, n + 2, n + 2, 1) != 0 || grid_alloc(&b, n + 2, n + 2, 1) != 0 ||
+            compress_init(&c, sub, start, start, bound) != 0) {
+            return 1;
+        }
+        data_type *out = (data_type *)malloc(sizeof(data_type) * sub[0] * sub[1]);
+
+        evolve(&a, &b, n, steps);
+        double mb_in = run(&c, &a, out, 0);
+        double mb_out = run(&c, &a, out, 1);
+
+        int exact = 1;
+        double error = 0;
+        for (int i = 0; i < sub[0]; i++) {
+            exact = exact && memcmp(GRID_ROW(&a, i), out + (size_t)i * sub[1], sizeof(data_type) * sub[1]) == 0;
+            for (int j = 0; j < sub[1]; j++) {
+                double e = fabs((double)GRID(&a, i, j) - out[(size_t)i * sub[1] + j]);
+                error = e > error ? e : error;
+            }
+        }
+        double raw = (double)sizeof(data_type) * sub[0] * sub[1];
+        printf("%8d %8.2f %10.2f %15.1f %15.1f %10.3g %6s\n", n, raw / c.bytes, 8. * c.bytes / (sub[0] * sub[1]),
+               mb_in, mb_out, error, (bound > 0 ? error <= bound : exact) ? "yes" : "NO");
+
+        free(out);
+        compress_free(&c);
+        grid_free(&a);
+        grid_free(&b);
+    }
+    return 0;
+}
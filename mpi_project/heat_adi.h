@@ -0,0 +1,264 @@
+#ifndef HEAT_ADI_H
+#define HEAT_ADI_H
+
+#include <math.h>
+#include <stdlib.h>
+#include <mpi.h>
+#include "heat_grid.h"
+#include "heat_halo.h"
+#include "heat_decomp.h"
+#include "heat_stencil.h"
+
+// Peaceman-Rachford ADI time steps, the alternating direction form of
+// Crank-Nicolson. A step of size alpha (the same alpha as the explicit
+// update, diffusivity * dt / h^2) is two half steps, each implicit along
+// one axis and explicit along the other:
+//
+//   (1 - b Dxx) v    = (1 + b Dyy) u     along the rows
+//   (1 - b Dyy) u'   = (1 + b Dxx) v     along the columns, b = alpha / 2
+//
+// The scheme is unconditionally stable, so alpha is not limited to 0.25.
+//
+// Each half step solves one tridiagonal system per line of the sheet, and
+// the lines run across the ranks of a process row or column. They are
+// solved with the Thomas algorithm, pipelined over those ranks: the
+// elimination goes down the line rank by rank and the substitution comes
+// back up. Lines travel in batches of ADI_BATCH, so a rank eliminates one
+// batch while its downstream neighbour is busy with the previous one. Only
+// one value per line crosses a rank boundary each way. The coefficients
+// are the same for every line, so each rank computes the multipliers of
+// its own stretch once, from the start of the line. The elimination runs
+// in the same order for any decomposition, so the result does not depend
+// on the rank or thread count.
+//
+// Physical boundaries stay fixed (Dirichlet). The frames of the work grids
+// hold those values, or the values received from upstream.
+
+#define ADI_BATCH 32  // lines per pipeline message
+
+enum { ADI_TAG_ROWS_FWD = 20, ADI_TAG_ROWS_BWD, ADI_TAG_COLS_FWD, ADI_TAG_COLS_BWD };
+
+typedef struct {
+    halo_t *h;                  // exchange for grids shaped like the sheet's block
+    int up, down, left, right;  // neighbours along the lines
+    MPI_Comm comm;
+    data_type b;                // alpha / 2
+    data_type *mx, *cx;         // multipliers along the rows, by local column
+    data_type *my, *cy;         // and along the columns, by local row
+    grid_t v;                   // result of the first half step
+    grid_t d;                   // right-hand sides, eliminated in place
+    MPI_Datatype seg[2];        // column stretch of a full and of the last batch
+    MPI_Request *req;           // one per batch
+} adi_t;
+
+// Thomas multipliers of (-b, 1 + 2b, -b) for the unknowns first ..
+// first + count - 1 of a line (1-based): m[k] = 1 / (pivot) and c[k] = -b m[k]
+// for local index k = 1 .. count. The frame value before the line is the
+// known unknown 0, with c = 0.
+static inline void adi_coefficients(double b, int first, int count, data_type *m, data_type *c) {
+    double cprev = 0;
+
+    for (int g = 1; g < first + count; g++) {
+        double mg = 1 / (1 + 2 * b + b * cprev);
+        cprev = -b * mg;
+        if (g >= first) {
+            m[g - first + 1] = (data_type)mg;
+            c[g - first + 1] = (data_type)cprev;
+        }
+    }
+}
+
+// First half step: one system per owned row of d, solved into the rows of
+// out. Team function.
+static inline void adi_solve_rows(adi_t *a, grid_t *out) {
+    grid_t *d = &a->d;
+    int rows = d->rows, cols = d->cols;
+    int batches = (rows - 2 + ADI_BATCH - 1) / ADI_BATCH;
+    const data_type b = a->b;
+
+    for (int k = 0; k < batches; k++) {
+        int i0 = 1 + k * ADI_BATCH, i1 = i0 + ADI_BATCH < rows - 1 ? i0 + ADI_BATCH : rows - 1;
+        MPI_Datatype seg = a->seg[i1 - i0 < ADI_BATCH];
+        OMP(master)
+        MPI_Recv(&GRID(d, i0, 0), 1, seg, a->left, ADI_TAG_ROWS_FWD, a->comm, MPI_STATUS_IGNORE);
+        OMP(barrier)
+        OMP(for schedule(static))
+        for (int i = i0; i < i1; i++) {
+            data_type *row = GRID_ROW(d, i);
+            for (int j = 1; j < cols - 1; j++) {
+                row[j] = (row[j] + b * row[j - 1]) * a->mx[j];
+            }
+        }
+        OMP(master)
+        MPI_Isend(&GRID(d, i0, cols - 2), 1, seg, a->right, ADI_TAG_ROWS_FWD, a->comm, &a->req[k]);
+    }
+    OMP(master)
+    MPI_Waitall(batches, a->req, MPI_STATUSES_IGNORE);
+
+    for (int k = 0; k < batches; k++) {
+        int i0 = 1 + k * ADI_BATCH, i1 = i0 + ADI_BATCH < rows - 1 ? i0 + ADI_BATCH : rows - 1;
+        MPI_Datatype seg = a->seg[i1 - i0 < ADI_BATCH];
+        OMP(master)
+        MPI_Recv(&GRID(out, i0, cols - 1), 1, seg, a->right, ADI_TAG_ROWS_BWD, a->comm,
+                 MPI_STATUS_IGNORE);
+        OMP(barrier)
+        OMP(for schedule(static))
+        for (int i = i0; i < i1; i++) {
+            const data_type *row = GRID_ROW(d, i);
+            data_type *x = GRID_ROW(out, i);
+            for (int j = cols - 2; j >= 1; j--) {
+                x[j] = row[j] - a->cx[j] * x[j + 1];
+            }
+        }
+        OMP(master)
+        MPI_Isend(&GRID(out, i0, 1), 1, seg, a->left, ADI_TAG_ROWS_BWD, a->comm, &a->req[k]);
+    }
+    OMP(master)
+    MPI_Waitall(batches, a->req, MPI_STATUSES_IGNORE);
+    OMP(barrier)
+}
+
+// Second half step: one system per owned column of d, solved into out in
+// place. Every thread takes a slice of the columns of a batch and walks it
+// down row by row, so the recurrences of neighbouring columns vectorize.
+// Team function; returns this thread's largest relative change of out.
+static inline data_type adi_solve_cols(adi_t *a, grid_t *out) {
+    grid_t *d = &a->d;
+    int rows = d->rows, cols = d->cols;
+    int batches = (cols - 2 + ADI_BATCH - 1) / ADI_BATCH;
+    const data_type b = a->b;
+    data_type max_eps = 0;
+
+    for (int k = 0; k < batches; k++) {
+        int j0 = 1 + k * ADI_BATCH, j1 = j0 + ADI_BATCH < cols - 1 ? j0 + ADI_BATCH : cols - 1;
+        int ja, jb;
+        team_split(j0, j1, GRID_ALIGN_ELEMS, &ja, &jb);
+        OMP(master)
+        MPI_Recv(&GRID(d, 0, j0), j1 - j0, MPI_DATA_TYPE, a->up, ADI_TAG_COLS_FWD, a->comm,
+                 MPI_STATUS_IGNORE);
+        OMP(barrier)
+        for (int i = 1; i < rows - 1; i++) {
+            const data_type *prev = GRID_ROW(d, i - 1);
+            data_type *row = GRID_ROW(d, i);
+            for (int j = ja; j < jb; j++) {
+                row[j] = (row[j] + b * prev[j]) * a->my[i];
+            }
+        }
+        OMP(barrier)
+        OMP(master)
+        MPI_Isend(&GRID(d, rows - 2, j0), j1 - j0, MPI_DATA_TYPE, a->down, ADI_TAG_COLS_FWD,
+                  a->comm, &a->req[k]);
+    }
+    OMP(master)
+    MPI_Waitall(batches, a->req, MPI_STATUSES_IGNORE);
+
+    for (int k = 0; k < batches; k++) {
+        int j0 = 1 + k * ADI_BATCH, j1 = j0 + ADI_BATCH < cols - 1 ? j0 + ADI_BATCH : cols - 1;
+        int ja, jb;
+        team_split(j0, j1, GRID_ALIGN_ELEMS, &ja, &jb);
+        OMP(master)
+        MPI_Recv(&GRID(out, rows - 1, j0), j1 - j0, MPI_DATA_TYPE, a->down, ADI_TAG_COLS_BWD,
+                 a->comm, MPI_STATUS_IGNORE);
+        OMP(barrier)
+        for (int i = rows - 2; i >= 1; i--) {
+            const data_type *row = GRID_ROW(d, i), *below = GRID_ROW(out, i + 1);
+            data_type *x = GRID_ROW(out, i);
+            for (int j = ja; j < jb; j++) {
+                data_type value = row[j] - a->cy[i] * below[j];
+                data_type delta = value - x[j];
+                data_type eps = fabsf(delta / (value == 0 ? STENCIL_ZERO_GUARD : value));
+                x[j] = value;
+                if (eps > max_eps) {
+                    max_eps = eps;
+                }
+            }
+        }
+        OMP(barrier)
+        OMP(master)
+        MPI_Isend(&GRID(out, 1, j0), j1 - j0, MPI_DATA_TYPE, a->up, ADI_TAG_COLS_BWD, a->comm,
+                  &a->req[k]);
+    }
+    OMP(master)
+    MPI_Waitall(batches, a->req, MPI_STATUSES_IGNORE);
+    OMP(barrier)
+    return max_eps;
+}
+
+// One full time step of the sheet u, in place. Team function; returns the
+// largest relative change over the team.
+static inline data_type adi_step(adi_t *a, grid_t *u) {
+    grid_t *v = &a->v, *d = &a->d;
+    int rows = u->rows, cols = u->cols;
+    const data_type b = a->b;
+
+    // Explicit along the columns, implicit along the rows
+    halo_exchange(a->h, u);
+    OMP(for schedule(static))
+    for (int i = 1; i < rows - 1; i++) {
+        const data_type *up = GRID_ROW(u, i - 1), *mid = GRID_ROW(u, i), *down = GRID_ROW(u, i + 1);
+        data_type *rhs = GRID_ROW(d, i);
+        for (int j = 1; j < cols - 1; j++) {
+            rhs[j] = mid[j] + b * (up[j] - 2 * mid[j] + down[j]);
+        }
+    }
+    adi_solve_rows(a, v);
+
+    // And the other way round
+    halo_exchange(a->h, v);
+    OMP(for schedule(static))
+    for (int i = 1; i < rows - 1; i++) {
+        const data_type *mid = GRID_ROW(v, i);
+        data_type *rhs = GRID_ROW(d, i);
+        for (int j = 1; j < cols - 1; j++) {
+            rhs[j] = mid[j] + b * (mid[j - 1] - 2 * mid[j] + mid[j + 1]);
+        }
+    }
+    return team_max(adi_solve_cols(a, u));
+}
+
+// Serial from here on
+
+// u is the sheet's block with its one-cell frame, h its halo exchange
+static inline void adi_init(adi_t *a, const decomp_t *dec, halo_t *h, const grid_t *u, double alpha) {
+    int rows = u->rows, cols = u->cols;
+    int batches = (rows > cols ? rows : cols) / ADI_BATCH + 1;
+    int last = (rows - 2) % ADI_BATCH;
+
+    a->h = h;
+    a->up = dec->up;
+    a->down = dec->down;
+    a->left = dec->left;
+    a->right = dec->right;
+    a->comm = dec->comm;
+    a->b = (data_type)(alpha / 2);
+    a->mx = (data_type *)malloc(cols * sizeof(data_type));
+    a->cx = (data_type *)malloc(cols * sizeof(data_type));
+    a->my = (data_type *)malloc(rows * sizeof(data_type));
+    a->cy = (data_type *)malloc(rows * sizeof(data_type));
+    adi_coefficients(alpha / 2, dec->col0, cols - 2, a->mx, a->cx);
+    adi_coefficients(alpha / 2, dec->row0, rows - 2, a->my, a->cy);
+
+    // The frames start with the physical boundary values
+    grid_alloc(&a->v, rows, cols, 1);
+    grid_alloc(&a->d, rows, cols, 1);
+    grid_copy(u, &a->v);
+    grid_copy(u, &a->d);
+
+    a->seg[0] = halo_block_type(ADI_BATCH, 1, u->ld);
+    a->seg[1] = halo_block_type(last > 0 ? last : ADI_BATCH, 1, u->ld);
+    a->req = (MPI_Request *)malloc(batches * sizeof(MPI_Request));
+}
+
+static inline void adi_free(adi_t *a) {
+    MPI_Type_free(&a->seg[0]);
+    MPI_Type_free(&a->seg[1]);
+    grid_free(&a->v);
+    grid_free(&a->d);
+    free(a->mx);
+    free(a->cx);
+    free(a->my);
+    free(a->cy);
+    free(a->req);
+}
+
+#endif
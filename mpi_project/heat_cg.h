@@ -0,0 +1,390 @@
+#ifndef HEAT_CG_H
+#define HEAT_CG_H
+
+#include <math.h>
+#include <mpi.h>
+#include "heat_grid.h"
+#include "heat_halo.h"
+#include "heat_decomp.h"
+#include "heat_stencil.h"
+#include "heat_mg.h"
+
+// Preconditioned conjugate gradients for the steady state (Laplace
+// equation) of the sheet. The 5-point operator is applied matrix-free to
+// vectors shaped like the sheet's block, whose physical frame stays zero;
+// the boundary values only enter through the first residual. Dot products
+// are accumulated in double, per thread and then in thread order, and
+// travel over the ranks in one reduction together with the largest
+// relative change of the solution, so no separate convergence check is
+// needed.
+//
+// Plain CG has two global reductions per iteration on its critical path.
+// Pipelined CG (Ghysels and Vanroose) rearranges the recurrences so that a
+// single MPI_Iallreduce carries both dot products and travels while the
+// preconditioner and the operator are applied to the next vector, at the
+// cost of five more vectors. Its convergence test lags one iteration. Its
+// recurrences drift away from the true residual faster, which in single
+// precision can break the iteration down near the attainable accuracy
+// (a step that is not positive); it then restarts from the true residual.
+//
+// The preconditioner is the identity, block Jacobi (symmetric red-black
+// Gauss-Seidel sweeps on each rank's block alone) or one multigrid
+// V-cycle. The V-cycle is not exactly symmetric, so plain CG then uses the
+// flexible (Polak-Ribiere) beta, which tolerates that.
+
+#define CG_BJ_SWEEPS 2  // red-black sweep pairs of block Jacobi, each way
+
+enum { CG_PLAIN, CG_PIPELINED };
+enum { CG_PC_NONE, CG_PC_BJACOBI, CG_PC_MG };
+
+// r residual, u = M r, p direction, s = A p; pipelined CG also keeps
+// w = A u, m = M w, n = A m, q = M s and z = A q
+enum { CG_R, CG_U, CG_P, CG_S, CG_W, CG_M, CG_N, CG_Q, CG_Z, CG_VECS };
+
+// One reduction: dot products summed, the change (last) maximised
+enum { CG_RED = 3 };
+
+typedef struct {
+    int variant;           // CG_PLAIN or CG_PIPELINED
+    int precond;           // CG_PC_*
+    MPI_Comm comm;
+    halo_t *h;             // exchange for grids shaped like the vectors
+    grid_t v[CG_VECS];
+    mg_t mg;               // V-cycle preconditioner
+    int iteration;         // since the last (re)start, -1 before the first
+    double gamma, alpha;   // (r, u) and the step of the previous iteration
+    double beta;
+    data_type eps;         // this rank's largest change in the last update
+    double red[CG_RED], sum[CG_RED];
+    team_slot_t *partial;  // scratch of team_sum
+    MPI_Datatype red_type;
+    MPI_Op red_op;
+    MPI_Request req;
+} cg_t;
+
+static inline void cg_reduce(void *in, void *inout, int *len, MPI_Datatype *type) {
+    const double *a = (const double*)in;
+    double *b = (double*)inout;
+
+    (void)type;
+    for (int n = 0; n < *len; n++, a += CG_RED, b += CG_RED) {
+        for (int k = 0; k < CG_RED - 1; k++) {
+            b[k] += a[k];
+        }
+        b[CG_RED - 1] = a[CG_RED - 1] > b[CG_RED - 1] ? a[CG_RED - 1] : b[CG_RED - 1];
+    }
+}
+
+// Team functions from here on, except where noted
+
+// out = A g on [i0, i1) x [j0, j1); returns the thread's share of (g, A g)
+static inline double cg_stencil(const grid_t *g, grid_t *out, int i0, int i1, int j0, int j1) {
+    double dot = 0;
+
+    OMP(for schedule(static) nowait)
+    for (int i = i0; i < i1; i++) {
+        const data_type *up = GRID_ROW(g, i - 1), *mid = GRID_ROW(g, i), *down = GRID_ROW(g, i + 1);
+        data_type *dst = GRID_ROW(out, i);
+        for (int j = j0; j < j1; j++) {
+            dst[j] = 4 * mid[j] - up[j] - down[j] - mid[j - 1] - mid[j + 1];
+            dot += (double)mid[j] * dst[j];
+        }
+    }
+    return dot;
+}
+
+// out = A g on the owned cells. The halo of g travels while the cells that
+// do not read it are computed. Returns the thread's share of (g, A g).
+static inline double cg_apply(cg_t *c, grid_t *g, grid_t *out) {
+    int rows = g->rows, cols = g->cols;
+    double dot;
+
+    halo_start(c->h, g);
+    dot = cg_stencil(g, out, 2, rows - 2, 2, cols - 2);
+    halo_finish(c->h, g);
+    dot += cg_stencil(g, out, 1, 2, 1, cols - 1);
+    if (rows - 2 > 1) {
+        dot += cg_stencil(g, out, rows - 2, rows - 1, 1, cols - 1);
+    }
+    dot += cg_stencil(g, out, 2, rows - 2, 1, 2);
+    if (cols - 2 > 1) {
+        dot += cg_stencil(g, out, 2, rows - 2, cols - 2, cols - 1);
+    }
+    OMP(barrier)
+    return dot;
+}
+
+// The thread's share of (a, b) over the owned cells
+static inline double cg_dot(const grid_t *a, const grid_t *b) {
+    double dot = 0;
+
+    OMP(for schedule(static) nowait)
+    for (int i = 1; i < a->rows - 1; i++) {
+        for (int j = 1; j < a->cols - 1; j++) {
+            dot += (double)GRID(a, i, j) * GRID(b, i, j);
+        }
+    }
+    return dot;
+}
+
+// Gauss-Seidel on the cells of one colour of out for A out = in, with
+// zeros outside the block
+static inline void cg_bj_sweep(const grid_t *in, grid_t *out, int color) {
+    OMP(for schedule(static))
+    for (int i = 1; i < out->rows - 1; i++) {
+        for (int j = 1 + ((i + 1 + color) & 1); j < out->cols - 1; j += 2) {
+            GRID(out, i, j) = 0.25f * (GRID(in, i, j) + GRID(out, i - 1, j) + GRID(out, i + 1, j)
+                                       + GRID(out, i, j - 1) + GRID(out, i, j + 1));
+        }
+    }
+}
+
+// out = M in. Block Jacobi sweeps red, black, ... and back in the mirrored
+// order, so M is symmetric.
+static inline void cg_precondition(cg_t *c, const grid_t *in, grid_t *out) {
+    if (c->precond == CG_PC_MG) {
+        mg_precondition(&c->mg, in, out);
+    } else if (c->precond == CG_PC_BJACOBI) {
+        grid_fill(out, 0);
+        for (int s = 0; s < 2 * CG_BJ_SWEEPS; s++) {
+            cg_bj_sweep(in, out, s & 1);
+        }
+        for (int s = 1; s < 2 * CG_BJ_SWEEPS; s++) {
+            cg_bj_sweep(in, out, (s & 1) ^ 1);
+        }
+    } else {
+        grid_copy(in, out);
+    }
+}
+
+// Sums red over the threads and ranks into c->sum; blocking
+static inline void cg_allreduce(cg_t *c, double *red) {
+    team_sum(red, CG_RED - 1, c->partial);
+    red[CG_RED - 1] = team_max(red[CG_RED - 1]);
+    OMP(master)
+    {
+        memcpy(c->red, red, sizeof c->red);
+        MPI_Allreduce(c->red, c->sum, 1, c->red_type, c->red_op, c->comm);
+    }
+    OMP(barrier)
+}
+
+// r = b - A x, with the boundary values b taken from the frame of x, and
+// u = M r
+static inline void cg_residual(cg_t *c, grid_t *x) {
+    grid_t *v = c->v;
+
+    halo_start(c->h, x);
+    halo_finish(c->h, x);
+    OMP(for schedule(static))
+    for (int i = 1; i < x->rows - 1; i++) {
+        for (int j = 1; j < x->cols - 1; j++) {
+            GRID(&v[CG_R], i, j) = GRID(x, i - 1, j) + GRID(x, i + 1, j) + GRID(x, i, j - 1)
+                                 + GRID(x, i, j + 1) - 4 * GRID(x, i, j);
+        }
+    }
+    cg_precondition(c, &v[CG_R], &v[CG_U]);
+}
+
+// The vectors plain CG starts from; pipelined CG sets up its own at every
+// (re)start
+static inline void cg_start(cg_t *c, grid_t *x) {
+    grid_t *v = c->v;
+    double red[CG_RED] = { 0, 0, 0 };
+
+    // Every thread has seen the iteration count before it changes
+    OMP(barrier)
+    if (c->variant == CG_PLAIN) {
+        cg_residual(c, x);
+        grid_copy(&v[CG_U], &v[CG_P]);
+        red[0] = cg_dot(&v[CG_R], &v[CG_U]);
+        cg_allreduce(c, red);
+        OMP(master)
+        c->gamma = c->sum[0];
+    }
+    OMP(master)
+    {
+        c->iteration = 0;
+        c->eps = 1;
+    }
+    OMP(barrier)
+}
+
+// x += alpha p, r -= alpha s; returns the thread's largest relative change
+static inline data_type cg_update(cg_t *c, grid_t *x, double alpha) {
+    grid_t *v = c->v;
+    data_type max_eps = 0;
+
+    OMP(for schedule(static))
+    for (int i = 1; i < x->rows - 1; i++) {
+        for (int j = 1; j < x->cols - 1; j++) {
+            data_type delta = (data_type)alpha * GRID(&v[CG_P], i, j);
+            data_type value = GRID(x, i, j) + delta;
+            data_type eps = fabsf(delta / (value == 0 ? STENCIL_ZERO_GUARD : value));
+            GRID(x, i, j) = value;
+            GRID(&v[CG_R], i, j) -= (data_type)alpha * GRID(&v[CG_S], i, j);
+            if (eps > max_eps) {
+                max_eps = eps;
+            }
+        }
+    }
+    return max_eps;
+}
+
+static inline data_type cg_plain(cg_t *c, grid_t *x) {
+    grid_t *v = c->v;
+    double red[CG_RED] = { 0, 0, 0 }, beta;
+    data_type eps;
+
+    red[0] = cg_apply(c, &v[CG_P], &v[CG_S]);
+    cg_allreduce(c, red);
+    OMP(master)
+    c->alpha = c->gamma / c->sum[0];
+    OMP(barrier)
+
+    eps = cg_update(c, x, c->alpha);
+    cg_precondition(c, &v[CG_R], &v[CG_U]);
+    red[0] = cg_dot(&v[CG_R], &v[CG_U]);
+    red[1] = c->precond == CG_PC_MG ? cg_dot(&v[CG_S], &v[CG_U]) : 0;
+    red[2] = eps;
+    cg_allreduce(c, red);
+
+    // r_new - r_old = -alpha s, so the flexible beta needs (s, u) only
+    beta = c->precond == CG_PC_MG ? -c->alpha * c->sum[1] / c->gamma : c->sum[0] / c->gamma;
+    OMP(for schedule(static))
+    for (int i = 1; i < x->rows - 1; i++) {
+        for (int j = 1; j < x->cols - 1; j++) {
+            GRID(&v[CG_P], i, j) = GRID(&v[CG_U], i, j) + (data_type)beta * GRID(&v[CG_P], i, j);
+        }
+    }
+    eps = (data_type)c->sum[2];
+    OMP(master)
+    c->gamma = c->sum[0];
+    OMP(barrier)
+    return eps;
+}
+
+static inline data_type cg_pipelined(cg_t *c, grid_t *x) {
+    grid_t *v = c->v;
+    double red[CG_RED];
+    data_type eps;
+
+    if (c->iteration == 0) {
+        cg_residual(c, x);
+        cg_apply(c, &v[CG_U], &v[CG_W]);
+    }
+
+    red[0] = cg_dot(&v[CG_R], &v[CG_U]);
+    red[1] = cg_dot(&v[CG_W], &v[CG_U]);
+    red[2] = c->eps;
+    team_sum(red, CG_RED - 1, c->partial);
+    OMP(master)
+    {
+        memcpy(c->red, red, sizeof c->red);
+        MPI_Iallreduce(c->red, c->sum, 1, c->red_type, c->red_op, c->comm, &c->req);
+    }
+
+    // In flight: m = M w, n = A m
+    cg_precondition(c, &v[CG_W], &v[CG_M]);
+    cg_apply(c, &v[CG_M], &v[CG_N]);
+
+    OMP(master)
+    {
+        MPI_Wait(&c->req, MPI_STATUS_IGNORE);
+        double gamma = c->sum[0], delta = c->sum[1];
+        c->beta = c->iteration > 0 ? gamma / c->gamma : 0;
+        delta -= c->iteration > 0 ? c->beta * gamma / c->alpha : 0;
+        if (gamma > 0 && delta > 0) {
+            c->alpha = gamma / delta;
+            c->gamma = gamma;
+            c->iteration++;
+        } else {
+            c->alpha = c->beta = 0;
+            c->iteration = 0;
+        }
+    }
+    OMP(barrier)
+
+    eps = (data_type)c->sum[2];
+    data_type b = (data_type)c->beta, a = (data_type)c->alpha, max_eps = 0;
+    OMP(for schedule(static))
+    for (int i = 1; i < x->rows - 1; i++) {
+        for (int j = 1; j < x->cols - 1; j++) {
+            data_type z = GRID(&v[CG_N], i, j) + b * GRID(&v[CG_Z], i, j);
+            data_type q = GRID(&v[CG_M], i, j) + b * GRID(&v[CG_Q], i, j);
+            data_type s = GRID(&v[CG_W], i, j) + b * GRID(&v[CG_S], i, j);
+            data_type p = GRID(&v[CG_U], i, j) + b * GRID(&v[CG_P], i, j);
+            data_type value = GRID(x, i, j) + a * p;
+            data_type e = fabsf(a * p / (value == 0 ? STENCIL_ZERO_GUARD : value));
+            GRID(&v[CG_Z], i, j) = z;
+            GRID(&v[CG_Q], i, j) = q;
+            GRID(&v[CG_S], i, j) = s;
+            GRID(&v[CG_P], i, j) = p;
+            GRID(x, i, j) = value;
+            GRID(&v[CG_R], i, j) -= a * s;
+            GRID(&v[CG_U], i, j) -= a * q;
+            GRID(&v[CG_W], i, j) -= a * z;
+            if (e > max_eps) {
+                max_eps = e;
+            }
+        }
+    }
+    // A restart step changes nothing and says nothing about convergence
+    max_eps = team_max(max_eps);
+    OMP(master)
+    if (a != 0) {
+        c->eps = max_eps;
+    }
+    OMP(barrier)
+    return eps;
+}
+
+// One iteration on the sheet x, which must be the same grid every time;
+// returns the largest relative change over all ranks, for pipelined CG that
+// of the previous iteration
+static inline data_type cg_iteration(cg_t *c, grid_t *x) {
+    if (c->iteration < 0) {
+        cg_start(c, x);
+    }
+    return c->variant == CG_PLAIN ? cg_plain(c, x) : cg_pipelined(c, x);
+}
+
+// Serial from here on
+
+// h is the sheet's halo exchange; its blocks have one-cell frames
+static inline void cg_init(cg_t *c, const decomp_t *dec, int nrows, int ncols, halo_t *h,
+                           int variant, int precond, int smoother) {
+    memset(c, 0, sizeof *c);
+    c->iteration = -1;
+    c->variant = variant;
+    c->precond = precond;
+    c->comm = dec->comm;
+    c->h = h;
+    for (int k = 0; k < (variant == CG_PIPELINED ? CG_VECS : CG_W); k++) {
+        grid_alloc(&c->v[k], dec->rows + 2, dec->cols + 2, 1);
+        grid_fill(&c->v[k], 0);
+    }
+    if (precond == CG_PC_MG) {
+        mg_setup(&c->mg, dec, nrows, ncols, NULL, NULL, NULL, NULL, smoother, 0);
+    }
+    c->partial = team_sum_alloc();
+    MPI_Type_contiguous(CG_RED, MPI_DOUBLE, &c->red_type);
+    MPI_Type_commit(&c->red_type);
+    MPI_Op_create(cg_reduce, 1, &c->red_op);
+}
+
+static inline void cg_free(cg_t *c) {
+    for (int k = 0; k < CG_VECS; k++) {
+        if (c->v[k].data != NULL) {
+            grid_free(&c->v[k]);
+        }
+    }
+    if (c->precond == CG_PC_MG) {
+        mg_free(&c->mg);
+    }
+    free(c->partial);
+    MPI_Op_free(&c->red_op);
+    MPI_Type_free(&c->red_type);
+}
+
+#endif
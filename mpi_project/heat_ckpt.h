@@ -0,0 +1,321 @@
+#ifndef HEAT_CKPT_H
+#define HEAT_CKPT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <mpi.h>
+#include "heat_grid.h"
+#include "heat_decomp.h"
+#include "heat_io.h"
+#include "heat_compress.h"
+
+// Checkpoints of a running solver, and restarts from them.
+//
+// A checkpoint is a field file (heat_io.h) with the solver state after the
+// field: the iteration and the latest known global changes. The field is
+// stored for the whole sheet, so a restart reads any process grid's blocks
+// out of it, whatever grid wrote it.
+//
+// Writing does not hold up the solver. The block is copied aside, or
+// compressed into a section (heat_compress.h), by the whole team, and the
+// ranks post non-blocking collective writes of it, which complete while
+// the solver goes on (every poll drives them). The write is finished, and
+// the file closed, at the next checkpoint or at the end of the run. It goes
+// to PATH.part first and is renamed to PATH once complete, so PATH always
+// holds a whole checkpoint. Only the master thread calls these, except
+// ckpt_pack.
+
+#define CKPT_MAGIC "HEATCKP"
+#define CKPT_HISTORY 32  // global changes kept in a checkpoint
+
+// Solver state besides the field
+typedef struct {
+    char magic[8];                // CKPT_MAGIC
+    int64_t iteration;            // iterations done
+    int32_t count;                // entries of the history in use
+    int32_t reserved;
+    int64_t step[CKPT_HISTORY];   // iterations done when each global change
+    double eps[CKPT_HISTORY];     // was known, and that change, oldest first
+} ckpt_state_t;
+
+static inline void ckpt_state_init(ckpt_state_t *s) {
+    memset(s, 0, sizeof(*s));
+    memcpy(s->magic, CKPT_MAGIC, sizeof(CKPT_MAGIC));
+}
+
+// Appends the global change known after step iterations, dropping the
+// oldest entry when the history is full
+static inline void ckpt_record(ckpt_state_t *s, int step, double eps) {
+    if (s->count > 0 && s->step[s->count - 1] == step) {
+        return;
+    }
+    if (s->count == CKPT_HISTORY) {
+        memmove(s->step, s->step + 1, sizeof(s->step[0]) * (CKPT_HISTORY - 1));
+        memmove(s->eps, s->eps + 1, sizeof(s->eps[0]) * (CKPT_HISTORY - 1));
+        s->count--;
+    }
+    s->step[s->count] = step;
+    s->eps[s->count] = eps;
+    s->count++;
+}
+
+static inline MPI_Offset ckpt_state_offset(const io_header_t *h) {
+    return IO_HEADER_BYTES + (MPI_Offset)io_field_bytes(h);
+}
+
+typedef struct {
+    const decomp_t *dec;
+    int n;
+    char path[4096], part[4096 + 8];
+    int compressed;          // the field is written as a compressed section
+    grid_t copy;             // the block as it was when the write started,
+    compress_t pack;         // or its share compressed
+    uint64_t *head;          // count and table of the section
+    io_header_t header;      // and what goes with it, kept until the
+    ckpt_state_t state;      // writes complete
+    MPI_File f;
+    MPI_Request req[4];      // field, header, state and table
+    int active;              // a write is in flight
+    int failed;
+} ckpt_t;
+
+// Checkpoints of the n x n sheet that the ranks of dec hold in blocks of
+// rows x cols cells, frame included, go to path, compressed or not
+static inline int ckpt_init(ckpt_t *c, const char *path, const decomp_t *dec, int n, int rows, int cols,
+                            int compressed) {
+    int sub[2], start[2], at[2];
+
+    c->dec = dec;
+    c->n = n;
+    snprintf(c->path, sizeof(c->path), "%s", path);
+    snprintf(c->part, sizeof(c->part), "%s.part", path);
+    c->compressed = compressed;
+    c->head = NULL;
+    c->active = 0;
+    c->failed = 0;
+    if (compressed) {
+        decomp_share(dec, n, n, dec->rank, sub, start, at);
+        return compress_init(&c->pack, sub, start, at, 0);
+    }
+    return grid_alloc(&c->copy, rows, cols, 1);
+}
+
+// Drives the write in flight
+static inline void ckpt_poll(ckpt_t *c) {
+    int done;
+
+    if (c->active) {
+        MPI_Testall(4, c->req, &done, MPI_STATUSES_IGNORE);
+    }
+}
+
+// Completes the write in flight, if any (collective); returns 0 if there
+// was none or it succeeded on every rank, -1 on every rank otherwise
+static inline int ckpt_finish(ckpt_t *c) {
+    int failed, any;
+
+    if (!c->active) {
+        return 0;
+    }
+    failed = c->failed | MPI_Waitall(4, c->req, MPI_STATUSES_IGNORE);
+    failed |= MPI_File_close(&c->f);
+    failed = failed != MPI_SUCCESS;
+    MPI_Allreduce(&failed, &any, 1, MPI_INT, MPI_LOR, c->dec->comm);
+    if (!any && c->dec->rank == 0 && rename(c->part, c->path) != 0) {
+        any = 1;
+    }
+    MPI_Bcast(&any, 1, MPI_INT, 0, c->dec->comm);
+    c->active = 0;
+    if (any && c->dec->rank == 0) {
+        fprintf(stderr, "Cannot write checkpoint '%s'\n", c->path);
+    }
+    return any ? -1 : 0;
+}
+
+// Team function: sets block, any halo width, aside for the next write. The
+// previous write must be finished first.
+static inline void ckpt_pack(ckpt_t *c, const grid_t *block) {
+    if (c->compressed) {
+        compress_share(&c->pack, block);
+        return;
+    }
+    OMP(for schedule(static))
+    for (int i = 0; i < block->rows; i++) {
+        memcpy(GRID_ROW(&c->copy, i), GRID_ROW(block, i), sizeof(data_type) * block->cols);
+    }
+}
+
+// Starts writing the block set aside by ckpt_pack with header h and solver
+// state s (collective). Returns -1 if the write cannot start.
+static inline int ckpt_start(ckpt_t *c, const io_header_t *h, const ckpt_state_t *s) {
+    const decomp_t *dec = c->dec;
+    int sub[2], start[2], at[2], dims[2] = { c->n + 2, c->n + 2 };
+    uint64_t head_bytes = 0, mine = 0;
+    MPI_Datatype mem, view;
+
+    c->header = *h;
+    c->state = *s;
+    if (c->compressed) {
+        free(c->head);
+        c->head = compress_table(dec->comm, &c->pack, &head_bytes, &c->header.field_bytes, &mine);
+        c->header.compressed = 1;
+    }
+    h = &c->header;
+    if (MPI_File_open(dec->comm, c->part, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &c->f) !=
+        MPI_SUCCESS) {
+        if (dec->rank == 0) {
+            fprintf(stderr, "Cannot write checkpoint '%s'\n", c->part);
+        }
+        return -1;
+    }
+    c->failed = MPI_File_set_size(c->f, ckpt_state_offset(h) + sizeof(ckpt_state_t));
+    c->req[1] = c->req[2] = c->req[3] = MPI_REQUEST_NULL;
+    if (dec->rank == 0) {
+        c->failed |= MPI_File_iwrite_at(c->f, 0, &c->header, IO_HEADER_BYTES, MPI_BYTE, &c->req[1]);
+        c->failed |= MPI_File_iwrite_at(c->f, ckpt_state_offset(h), &c->state, sizeof(ckpt_state_t),
+                                        MPI_BYTE, &c->req[2]);
+        if (c->compressed) {
+            c->failed |= MPI_File_iwrite_at(c->f, IO_HEADER_BYTES, c->head, (int)head_bytes, MPI_BYTE,
+                                            &c->req[3]);
+        }
+    }
+    if (c->compressed) {
+        c->failed |= MPI_File_iwrite_at_all(c->f, IO_HEADER_BYTES + (MPI_Offset)mine, c->pack.out,
+                                            (int)c->pack.bytes, MPI_BYTE, &c->req[0]);
+        c->active = 1;
+        return 0;
+    }
+
+    decomp_share(dec, c->n, c->n, dec->rank, sub, start, at);
+    mem = grid_subarray_type(&c->copy, sub, start);
+    MPI_Type_create_subarray(2, dims, sub, at, MPI_ORDER_C, MPI_DATA_TYPE, &view);
+    MPI_Type_commit(&view);
+    c->failed |= MPI_File_set_view(c->f, IO_HEADER_BYTES, MPI_DATA_TYPE, view, "native", MPI_INFO_NULL);
+    c->failed |= MPI_File_iwrite_all(c->f, c->copy.data, 1, mem, &c->req[0]);
+    MPI_Type_free(&mem);
+    MPI_Type_free(&view);
+    c->active = 1;
+    return 0;
+}
+
+static inline int ckpt_free(ckpt_t *c) {
+    int err = ckpt_finish(c);
+
+    if (c->compressed) {
+        compress_free(&c->pack);
+    } else {
+        grid_free(&c->copy);
+    }
+    free(c->head);
+    return err;
+}
+
+// Reads the header and solver state of checkpoint path (collective);
+// returns 0 on success, -1 on every rank (after printing why on rank 0)
+// otherwise
+static inline int ckpt_read_state(const char *path, MPI_Comm comm, io_header_t *h, ckpt_state_t *s) {
+    int rank;
+    MPI_File f;
+    const char *why = NULL;
+
+    MPI_Comm_rank(comm, &rank);
+    if (MPI_File_open(comm, path, MPI_MODE_RDONLY, MPI_INFO_NULL, &f) != MPI_SUCCESS) {
+        why = "cannot be read";
+    } else {
+        memset(h, 0, sizeof(*h));
+        memset(s, 0, sizeof(*s));
+        MPI_File_read_at_all(f, 0, h, IO_HEADER_BYTES, MPI_BYTE, MPI_STATUS_IGNORE);
+        if (memcmp(h->magic, IO_MAGIC, sizeof(IO_MAGIC)) != 0 || h->version != IO_VERSION ||
+            h->byte_order != IO_BYTE_ORDER || h->value_bytes != sizeof(data_type) || h->ndims != 2 ||
+            h->dims[0] != h->dims[1] || h->dims[0] < 3) {
+            why = "is not a checkpoint of a sheet of this solver's values";
+        } else {
+            MPI_File_read_at_all(f, ckpt_state_offset(h), s, sizeof(*s), MPI_BYTE, MPI_STATUS_IGNORE);
+            if (memcmp(s->magic, CKPT_MAGIC, sizeof(CKPT_MAGIC)) != 0 || s->count < 0 ||
+                s->count > CKPT_HISTORY) {
+                why = "has no solver state";
+            }
+        }
+        MPI_File_close(&f);
+    }
+    if (why != NULL && rank == 0) {
+        fprintf(stderr, "Checkpoint '%s' %s\n", path, why);
+    }
+    return why == NULL ? 0 : -1;
+}
+
+// Reads the block, frame included, whose first cell in the sheet is at out
+// of the compressed section of f (collective): every rank decodes the
+// streams of the writer's shares that overlap its block
+static inline int ckpt_read_section(MPI_File f, const int at[2], grid_t *block) {
+    uint64_t count = 0;
+    int failed = MPI_File_read_at_all(f, IO_HEADER_BYTES, &count, 1, MPI_UINT64_T, MPI_STATUS_IGNORE);
+
+    if (failed != MPI_SUCCESS || count == 0 || count > (1u << 24)) {
+        return -1;
+    }
+    uint64_t *head = (uint64_t *)malloc(compress_head_bytes(count));
+    const compress_entry_t *e = (const compress_entry_t *)(head + 1);
+    failed = MPI_File_read_at_all(f, IO_HEADER_BYTES, head, (int)compress_head_bytes(count), MPI_BYTE,
+                                  MPI_STATUS_IGNORE);
+    for (uint64_t k = 0; k < count && failed == MPI_SUCCESS; k++) {
+        int lo[2], hi[2], size[2] = { block->rows, block->cols };
+        for (int a = 0; a < 2; a++) {
+            lo[a] = e[k].at[a] > at[a] ? e[k].at[a] : at[a];
+            hi[a] = e[k].at[a] + e[k].sub[a] < at[a] + size[a] ? e[k].at[a] + e[k].sub[a] : at[a] + size[a];
+        }
+        if (lo[0] >= hi[0] || lo[1] >= hi[1]) {
+            continue;
+        }
+        uint64_t *stream = (uint64_t *)malloc(e[k].bytes);
+        data_type *share = (data_type *)malloc(sizeof(data_type) * e[k].sub[0] * e[k].sub[1]);
+        failed = MPI_File_read_at(f, IO_HEADER_BYTES + (MPI_Offset)e[k].offset, stream, (int)e[k].bytes,
+                                  MPI_BYTE, MPI_STATUS_IGNORE);
+        if (failed == MPI_SUCCESS) {
+            OMP(parallel)
+            compress_decode(stream, share, e[k].sub[1]);
+            for (int i = lo[0]; i < hi[0]; i++) {
+                memcpy(&GRID(block, i - at[0], lo[1] - at[1]),
+                       share + (size_t)(i - e[k].at[0]) * e[k].sub[1] + (lo[1] - e[k].at[1]),
+                       sizeof(data_type) * (hi[1] - lo[1]));
+            }
+        }
+        free(stream);
+        free(share);
+    }
+    free(head);
+    return failed == MPI_SUCCESS ? 0 : -1;
+}
+
+// Reads this rank's block of the sheet, frame included, out of checkpoint
+// path with header h (collective); returns 0 on success, -1 otherwise
+static inline int ckpt_read_block(const char *path, const io_header_t *h, const decomp_t *dec, grid_t *block) {
+    int n = (int)h->dims[0] - 2;
+    int sub[2] = { block->rows, block->cols }, start[2] = { 0, 0 };
+    int at[2] = { dec->row0 - 1, dec->col0 - 1 }, dims[2] = { n + 2, n + 2 };
+    int failed, any;
+    MPI_File f;
+    MPI_Datatype mem, view;
+
+    if (MPI_File_open(dec->comm, path, MPI_MODE_RDONLY, MPI_INFO_NULL, &f) != MPI_SUCCESS) {
+        return -1;
+    }
+    if (h->compressed) {
+        failed = ckpt_read_section(f, at, block) != 0;
+    } else {
+        mem = grid_subarray_type(block, sub, start);
+        MPI_Type_create_subarray(2, dims, sub, at, MPI_ORDER_C, MPI_DATA_TYPE, &view);
+        MPI_Type_commit(&view);
+        failed = MPI_File_set_view(f, IO_HEADER_BYTES, MPI_DATA_TYPE, view, "native", MPI_INFO_NULL);
+        failed |= MPI_File_read_at_all(f, 0, block->data, 1, mem, MPI_STATUS_IGNORE);
+        MPI_Type_free(&mem);
+        MPI_Type_free(&view);
+    }
+    failed |= MPI_File_close(&f);
+    failed = failed != MPI_SUCCESS;
+    MPI_Allreduce(&failed, &any, 1, MPI_INT, MPI_LOR, dec->comm);
+    return any ? -1 : 0;
+}
+
+#endif
@@ -0,0 +1,543 @@
+#ifndef HEAT_COMPRESS_H
+#define HEAT_COMPRESS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <mpi.h>
+#include "heat_grid.h"
+
+// Compression of fields for snapshots, checkpoints and field files, either
+// lossless or with every value within a given absolute error.
+//
+// Lossless: every value is predicted from its neighbours above and to the
+// left with the Lorenzo predictor, up + left - upleft (left alone on the
+// first row of a tile, up alone on the first column). The bit patterns of
+// the value and its prediction are XORed; on a smooth field the two agree
+// in sign, exponent and leading mantissa bits, so the XOR starts with a run
+// of zeros. It is stored as
+//
+//   0                          the prediction is exact
+//   1, 5 bits lz, 31-lz bits   lz leading zeros, then the XOR without its
+//                              leading one
+//
+// Error-bounded (SZ style), with bound E: every value is predicted the same
+// way, but from the values as the decoder will see them, and the error of
+// the prediction is rounded to a multiple q of 2E, so the decoded value is
+// within E. A q of magnitude below COMPRESS_RADIUS becomes the symbol
+// q + COMPRESS_RADIUS; any other value, or one that rounding would take
+// past E, is stored exactly behind symbol 0. On a smooth field the symbols
+// crowd around COMPRESS_RADIUS, and each tile codes them with a Huffman
+// code of its own: the number of symbols used, each with its code length
+// (13 and 5 bits), then the codes, least significant bit first.
+//
+// A rank's share of the field is cut into bands of COMPRESS_TILE_ROWS rows
+// that are coded independently, so the threads of the team compress and
+// decompress them in parallel. The stream of a share is a compress_stream_t
+// header, the size of every tile in 64-bit words, and the tiles.
+//
+// A section holds the streams of all ranks: a count, one compress_entry_t
+// per rank saying where its share lies in the field and where its stream
+// lies in the section, and the streams. Streams and entries are multiples
+// of 8 bytes.
+
+#define COMPRESS_TILE_ROWS 32
+#define COMPRESS_RADIUS 4096    // symbols of the error-bounded codec: 2 * COMPRESS_RADIUS
+#define COMPRESS_MAX_CODE 24    // longest Huffman code
+
+enum { COMPRESS_LOSSLESS, COMPRESS_BOUNDED };
+
+typedef char compress_float_check[sizeof(data_type) == sizeof(uint32_t) ? 1 : -1];
+
+typedef struct {
+    uint32_t rows, cols;    // of the share
+    uint32_t tile_rows;     // COMPRESS_TILE_ROWS when written
+    uint32_t tiles;
+    uint32_t codec;         // COMPRESS_LOSSLESS or COMPRESS_BOUNDED
+    uint32_t reserved;
+    double bound;           // largest error of a value, 0 if lossless
+} compress_stream_t;
+
+typedef struct {
+    int32_t at[2];          // first cell of the share in the field
+    int32_t sub[2];         // and its extent
+    uint64_t offset;        // of the stream from the start of the section
+    uint64_t bytes;
+} compress_entry_t;
+
+typedef struct {
+    int sub[2];             // extent of the share
+    int start[2];           // its first cell in the block
+    int at[2];              // and in the field
+    double bound;           // largest error of a value, 0 if lossless
+    int tiles;
+    size_t tile_words;      // room for the worst case of a tile
+    uint64_t *scratch;      // tile t at t * tile_words
+    uint64_t *words;        // used by each tile
+    uint64_t *out;          // the stream
+    size_t bytes;           // of the stream
+} compress_t;
+
+static inline data_type compress_predict(data_type up, data_type left, data_type upleft) {
+    return up + left - upleft;
+}
+
+static inline uint32_t compress_bits_of(data_type v) {
+    uint32_t u;
+
+    memcpy(&u, &v, sizeof(u));
+    return u;
+}
+
+static inline data_type compress_value_of(uint32_t u) {
+    data_type v;
+
+    memcpy(&v, &u, sizeof(v));
+    return v;
+}
+
+// Bit writer and reader, least significant bit first, n <= 32 bits a time
+
+typedef struct {
+    uint64_t *p, acc;
+    int n;
+} compress_writer_t;
+
+static inline void compress_put(compress_writer_t *w, uint64_t v, int n) {
+    w->acc |= v << w->n;
+    w->n += n;
+    if (w->n >= 64) {
+        *w->p++ = w->acc;
+        w->n -= 64;
+        w->acc = w->n > 0 ? v >> (n - w->n) : 0;
+    }
+}
+
+typedef struct {
+    const uint64_t *p;
+    uint64_t acc;
+    int n;
+} compress_reader_t;
+
+static inline uint32_t compress_get(compress_reader_t *r, int n) {
+    uint64_t v;
+
+    if (r->n >= n) {
+        v = r->acc;
+        r->acc >>= n;
+        r->n -= n;
+    } else {
+        uint64_t w = *r->p++;
+        v = r->acc | (w << r->n);
+        r->acc = w >> (n - r->n);
+        r->n = 64 - (n - r->n);
+    }
+    return (uint32_t)(v & ((1ull << n) - 1));
+}
+
+// Codes rows x cols values (row stride ld) into out; returns the words used
+static inline size_t compress_tile(const data_type *x, ptrdiff_t ld, int rows, int cols, uint64_t *out) {
+    compress_writer_t w = { out, 0, 0 };
+
+    for (int i = 0; i < rows; i++) {
+        const data_type *row = x + i * ld, *above = row - ld;
+        for (int j = 0; j < cols; j++) {
+            data_type pred = i == 0 ? (j > 0 ? row[j - 1] : 0)
+                           : j == 0 ? above[0] : compress_predict(above[j], row[j - 1], above[j - 1]);
+            uint32_t r = compress_bits_of(row[j]) ^ compress_bits_of(pred);
+            if (r == 0) {
+                compress_put(&w, 0, 1);
+                continue;
+            }
+            int lz = __builtin_clz(r), nb = 31 - lz;
+            compress_put(&w, 1 | (uint64_t)lz << 1, 6);
+            if (nb > 0) {
+                compress_put(&w, r & ((1u << nb) - 1), nb);
+            }
+        }
+    }
+    if (w.n > 0) {
+        *w.p++ = w.acc;
+    }
+    return (size_t)(w.p - out);
+}
+
+static inline void compress_untile(const uint64_t *in, data_type *x, ptrdiff_t ld, int rows, int cols) {
+    compress_reader_t rd = { in, 0, 0 };
+
+    for (int i = 0; i < rows; i++) {
+        data_type *row = x + i * ld;
+        const data_type *above = row - ld;
+        for (int j = 0; j < cols; j++) {
+            data_type pred = i == 0 ? (j > 0 ? row[j - 1] : 0)
+                           : j == 0 ? above[0] : compress_predict(above[j], row[j - 1], above[j - 1]);
+            uint32_t r = 0;
+            if (compress_get(&rd, 1)) {
+                int nb = 31 - (int)compress_get(&rd, 5);
+                r = (1u << nb) | (nb > 0 ? compress_get(&rd, nb) : 0);
+            }
+            row[j] = compress_value_of(compress_bits_of(pred) ^ r);
+        }
+    }
+}
+
+// Sets the lengths of a Huffman code, at most COMPRESS_MAX_CODE bits, for
+// the n symbols with nonzero counts of count; len of the others is 0
+static inline void compress_huffman(const uint32_t *count, int n, uint8_t *len) {
+    int m = 0, *sym = (int *)malloc(sizeof(int) * n);
+    int *parent = (int *)malloc(sizeof(int) * 2 * n);
+    uint64_t *w = (uint64_t *)malloc(sizeof(uint64_t) * 2 * n);
+    uint32_t *c = (uint32_t *)malloc(sizeof(uint32_t) * n);
+
+    memcpy(c, count, sizeof(uint32_t) * n);
+    memset(len, 0, n);
+    for (int k = 0; k < n; k++) {
+        if (c[k] > 0) {
+            sym[m++] = k;
+        }
+    }
+    if (m == 1) {
+        len[sym[0]] = 1;
+    }
+    for (int longest = COMPRESS_MAX_CODE + 1; m > 1 && longest > COMPRESS_MAX_CODE;) {
+        // Leaves by count (insertion sort, mostly in order already), then
+        // the inner nodes, which come out in order: two-queue construction
+        for (int k = 1; k < m; k++) {
+            int s = sym[k], l = k;
+            while (l > 0 && c[sym[l - 1]] > c[s]) {
+                sym[l] = sym[l - 1];
+                l--;
+            }
+            sym[l] = s;
+        }
+        for (int k = 0; k < m; k++) {
+            w[k] = c[sym[k]];
+        }
+        for (int node = m, leaf = 0, inner = m; node < 2 * m - 1; node++) {
+            int pick[2];
+            for (int p = 0; p < 2; p++) {
+                pick[p] = leaf < m && (inner >= node || w[leaf] <= w[inner]) ? leaf++ : inner++;
+                parent[pick[p]] = node;
+            }
+            w[node] = w[pick[0]] + w[pick[1]];
+        }
+        // Depths, root last; reuse w for them
+        longest = 0;
+        w[2 * m - 2] = 0;
+        for (int k = 2 * m - 3; k >= 0; k--) {
+            w[k] = w[parent[k]] + 1;
+            if (k < m) {
+                len[sym[k]] = (uint8_t)w[k];
+                longest = (int)w[k] > longest ? (int)w[k] : longest;
+            }
+        }
+        // Too deep: flatten the counts and build again
+        for (int k = 0; k < m; k++) {
+            c[sym[k]] = (c[sym[k]] >> 1) | 1;
+        }
+    }
+    free(sym);
+    free(parent);
+    free(w);
+    free(c);
+}
+
+// Canonical codes for the lengths len of n symbols, bit-reversed so the
+// least-significant-first writer puts out their first bit first
+static inline void compress_codes(const uint8_t *len, int n, uint32_t *code) {
+    uint32_t count[COMPRESS_MAX_CODE + 1] = { 0 }, next[COMPRESS_MAX_CODE + 1];
+
+    for (int k = 0; k < n; k++) {
+        count[len[k]]++;
+    }
+    next[0] = 0;
+    count[0] = 0;
+    for (int l = 1; l <= COMPRESS_MAX_CODE; l++) {
+        next[l] = (next[l - 1] + count[l - 1]) << 1;
+    }
+    for (int k = 0; k < n; k++) {
+        int l = len[k];
+        if (l > 0) {
+            uint32_t c = next[l]++, r = 0;
+            for (int b = 0; b < l; b++) {
+                r |= ((c >> b) & 1u) << (l - 1 - b);
+            }
+            code[k] = r;
+        }
+    }
+}
+
+// Decoded value of a value x predicted as pred, with bound E; sets *sym to
+// its symbol, 0 if it has to be stored exactly (then x itself is returned)
+static inline data_type compress_quantize(data_type x, data_type pred, double bound, int *sym) {
+    double step = 2 * bound, q = floor(((double)x - pred) * (1 / step) + 0.5);
+
+    if (fabs(q) < COMPRESS_RADIUS) {
+        data_type r = (data_type)((double)pred + q * step);
+        if (fabs((double)r - x) <= bound) {
+            *sym = (int)q + COMPRESS_RADIUS;
+            return r;
+        }
+    }
+    *sym = 0;
+    return x;
+}
+
+// Error-bounded counterpart of compress_tile
+static inline size_t compress_tile_bounded(const data_type *x, ptrdiff_t ld, int rows, int cols, double bound,
+                                           uint64_t *out) {
+    enum { N = 2 * COMPRESS_RADIUS };
+    uint16_t *sym = (uint16_t *)malloc(sizeof(uint16_t) * rows * cols);
+    data_type *rec = (data_type *)malloc(sizeof(data_type) * 2 * cols);
+    uint32_t *count = (uint32_t *)calloc(N, sizeof(uint32_t)), *code = (uint32_t *)malloc(sizeof(uint32_t) * N);
+    uint8_t *len = (uint8_t *)malloc(N);
+    compress_writer_t w = { out, 0, 0 };
+
+    // Symbols, predicted from the values as decoded
+    for (int i = 0; i < rows; i++) {
+        const data_type *row = x + i * ld;
+        data_type *now = rec + (i % 2) * cols, *above = rec + ((i + 1) % 2) * cols;
+        for (int j = 0; j < cols; j++) {
+            data_type pred = i == 0 ? (j > 0 ? now[j - 1] : 0)
+                           : j == 0 ? above[0] : compress_predict(above[j], now[j - 1], above[j - 1]);
+            int s;
+            now[j] = compress_quantize(row[j], pred, bound, &s);
+            sym[i * cols + j] = (uint16_t)s;
+            count[s]++;
+        }
+    }
+
+    compress_huffman(count, N, len);
+    compress_codes(len, N, code);
+    int used = 0;
+    for (int s = 0; s < N; s++) {
+        used += len[s] > 0;
+    }
+    compress_put(&w, used, 14);
+    for (int s = 0; s < N; s++) {
+        if (len[s] > 0) {
+            compress_put(&w, s | (uint64_t)len[s] << 13, 18);
+        }
+    }
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < cols; j++) {
+            int s = sym[i * cols + j];
+            compress_put(&w, code[s], len[s]);
+            if (s == 0) {
+                compress_put(&w, compress_bits_of(x[i * ld + j]), 32);
+            }
+        }
+    }
+    if (w.n > 0) {
+        *w.p++ = w.acc;
+    }
+    free(sym);
+    free(rec);
+    free(count);
+    free(code);
+    free(len);
+    return (size_t)(w.p - out);
+}
+
+static inline void compress_untile_bounded(const uint64_t *in, data_type *x, ptrdiff_t ld, int rows, int cols,
+                                           double bound) {
+    enum { N = 2 * COMPRESS_RADIUS };
+    compress_reader_t r = { in, 0, 0 };
+    int used = (int)compress_get(&r, 14);
+    int count[COMPRESS_MAX_CODE + 1] = { 0 };
+    uint16_t *sym = (uint16_t *)malloc(sizeof(uint16_t) * (used > 0 ? used : 1));
+    uint8_t *len = (uint8_t *)calloc(N, 1);
+
+    for (int k = 0; k < used; k++) {
+        uint32_t e = compress_get(&r, 18);
+        len[e & (N - 1)] = (uint8_t)(e >> 13);
+        count[e >> 13]++;
+    }
+    // Symbols by code length, then value: the canonical order
+    int offset[COMPRESS_MAX_CODE + 1];
+    offset[1] = 0;
+    for (int l = 1; l < COMPRESS_MAX_CODE; l++) {
+        offset[l + 1] = offset[l] + count[l];
+    }
+    for (int s = 0; s < N; s++) {
+        if (len[s] > 0) {
+            sym[offset[len[s]]++] = (uint16_t)s;
+        }
+    }
+
+    for (int i = 0; i < rows; i++) {
+        data_type *row = x + i * ld;
+        const data_type *above = row - ld;
+        for (int j = 0; j < cols; j++) {
+            data_type pred = i == 0 ? (j > 0 ? row[j - 1] : 0)
+                           : j == 0 ? above[0] : compress_predict(above[j], row[j - 1], above[j - 1]);
+            int code = 0, first = 0, index = 0, s = 0;
+            for (int l = 1; l <= COMPRESS_MAX_CODE; l++) {
+                code |= (int)compress_get(&r, 1);
+                if (code - first < count[l]) {
+                    s = sym[index + code - first];
+                    break;
+                }
+                index += count[l];
+                first = (first + count[l]) << 1;
+                code <<= 1;
+            }
+            if (s == 0) {
+                row[j] = compress_value_of(compress_get(&r, 32));
+            } else {
+                row[j] = (data_type)((double)pred + (double)(s - COMPRESS_RADIUS) * (2 * bound));
+            }
+        }
+    }
+    free(sym);
+    free(len);
+}
+
+// Serial: room to compress the sub cells from start on of a block, which
+// go to the cells from at on of the field; losslessly for a bound of 0,
+// otherwise with every value within bound
+static inline int compress_init(compress_t *c, const int sub[2], const int start[2], const int at[2],
+                                double bound) {
+    for (int k = 0; k < 2; k++) {
+        c->sub[k] = sub[k];
+        c->start[k] = start[k];
+        c->at[k] = at[k];
+    }
+    c->bound = bound;
+    c->tiles = (sub[0] + COMPRESS_TILE_ROWS - 1) / COMPRESS_TILE_ROWS;
+    c->tile_words = bound > 0
+                  ? ((size_t)COMPRESS_TILE_ROWS * sub[1] * (COMPRESS_MAX_CODE + 32) + 14 +
+                     2 * COMPRESS_RADIUS * 18 + 63) / 64 + 1
+                  : ((size_t)COMPRESS_TILE_ROWS * sub[1] * 37 + 63) / 64 + 1;
+    c->scratch = (uint64_t *)malloc(c->tiles * c->tile_words * sizeof(uint64_t));
+    c->words = (uint64_t *)malloc(c->tiles * sizeof(uint64_t));
+    c->out = (uint64_t *)malloc(sizeof(compress_stream_t) + c->tiles * (c->tile_words + 1) * sizeof(uint64_t));
+    c->bytes = 0;
+    return c->scratch && c->words && c->out ? 0 : -1;
+}
+
+static inline void compress_free(compress_t *c) {
+    free(c->scratch);
+    free(c->words);
+    free(c->out);
+}
+
+// Team function: compresses the share of block g into c->out. The threads
+// code the tiles into scratch, then pack them behind each other.
+static inline void compress_share(compress_t *c, const grid_t *g) {
+    compress_stream_t *h = (compress_stream_t *)c->out;
+    uint64_t *sizes = (uint64_t *)(h + 1), *data = sizes + c->tiles;
+
+    OMP(for schedule(dynamic))
+    for (int t = 0; t < c->tiles; t++) {
+        int i0 = t * COMPRESS_TILE_ROWS;
+        int rows = c->sub[0] - i0 < COMPRESS_TILE_ROWS ? c->sub[0] - i0 : COMPRESS_TILE_ROWS;
+        const data_type *x = &GRID(g, c->start[0] + i0, c->start[1]);
+        uint64_t *out = c->scratch + t * c->tile_words;
+        c->words[t] = c->bound > 0 ? compress_tile_bounded(x, g->ld, rows, c->sub[1], c->bound, out)
+                                   : compress_tile(x, g->ld, rows, c->sub[1], out);
+    }
+    OMP(single)
+    {
+        h->rows = c->sub[0];
+        h->cols = c->sub[1];
+        h->tile_rows = COMPRESS_TILE_ROWS;
+        h->tiles = c->tiles;
+        h->codec = c->bound > 0 ? COMPRESS_BOUNDED : COMPRESS_LOSSLESS;
+        h->reserved = 0;
+        h->bound = c->bound;
+        size_t total = 0;
+        for (int t = 0; t < c->tiles; t++) {
+            sizes[t] = c->words[t];
+            total += c->words[t];
+        }
+        c->bytes = sizeof(*h) + (c->tiles + total) * sizeof(uint64_t);
+    }
+    OMP(for schedule(dynamic))
+    for (int t = 0; t < c->tiles; t++) {
+        size_t off = 0;
+        for (int u = 0; u < t; u++) {
+            off += c->words[u];
+        }
+        memcpy(data + off, c->scratch + t * c->tile_words, c->words[t] * sizeof(uint64_t));
+    }
+}
+
+// Team function: decodes a stream into out, row stride ld
+static inline void compress_decode(const void *stream, data_type *out, ptrdiff_t ld) {
+    const compress_stream_t *h = (const compress_stream_t *)stream;
+    const uint64_t *sizes = (const uint64_t *)(h + 1), *data = sizes + h->tiles;
+
+    OMP(for schedule(dynamic))
+    for (uint32_t t = 0; t < h->tiles; t++) {
+        size_t off = 0;
+        for (uint32_t u = 0; u < t; u++) {
+            off += sizes[u];
+        }
+        uint32_t i0 = t * h->tile_rows;
+        int rows = h->rows - i0 < h->tile_rows ? h->rows - i0 : h->tile_rows;
+        if (h->codec == COMPRESS_BOUNDED) {
+            compress_untile_bounded(data + off, out + i0 * ld, ld, rows, h->cols, h->bound);
+        } else {
+            compress_untile(data + off, out + i0 * ld, ld, rows, h->cols);
+        }
+    }
+}
+
+// Team function: decodes a whole section into a field of cols columns
+static inline void compress_decode_section(const void *section, data_type *field, uint64_t cols) {
+    uint64_t count = *(const uint64_t *)section;
+    const compress_entry_t *e = (const compress_entry_t *)((const uint64_t *)section + 1);
+
+    for (uint64_t k = 0; k < count; k++) {
+        compress_decode((const char *)section + e[k].offset, field + e[k].at[0] * cols + e[k].at[1], cols);
+    }
+}
+
+// Largest error of the values of a section, 0 if it is lossless
+static inline double compress_section_bound(const void *section) {
+    const compress_entry_t *e = (const compress_entry_t *)((const uint64_t *)section + 1);
+
+    return ((const compress_stream_t *)((const char *)section + e[0].offset))->bound;
+}
+
+// Bytes of the count and table of a section of count streams
+static inline uint64_t compress_head_bytes(uint64_t count) {
+    return sizeof(uint64_t) + count * sizeof(compress_entry_t);
+}
+
+// Collects the streams of the ranks of comm into the head of a section
+// (collective, master thread). Returns the head (count and table, to be
+// freed) and sets the bytes of the head and of the whole section, and the
+// offset of this rank's stream.
+static inline uint64_t *compress_table(MPI_Comm comm, const compress_t *c, uint64_t *head_bytes,
+                                       uint64_t *section_bytes, uint64_t *mine) {
+    int rank, size;
+    compress_entry_t me;
+
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    *head_bytes = compress_head_bytes(size);
+    uint64_t *head = (uint64_t *)malloc(*head_bytes);
+    compress_entry_t *table = (compress_entry_t *)(head + 1);
+
+    memset(&me, 0, sizeof(me));
+    for (int k = 0; k < 2; k++) {
+        me.at[k] = c->at[k];
+        me.sub[k] = c->sub[k];
+    }
+    me.bytes = c->bytes;
+    MPI_Allgather(&me, sizeof(me), MPI_BYTE, table, sizeof(me), MPI_BYTE, comm);
+    head[0] = size;
+    uint64_t offset = *head_bytes;
+    for (int r = 0; r < size; r++) {
+        table[r].offset = offset;
+        offset += table[r].bytes;
+    }
+    *section_bytes = offset;
+    *mine = table[rank].offset;
+    return head;
+}
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef HEAT_CONVERGE_H
+#define HEAT_CONVERGE_H
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+#include "heat_grid.h"
+
+// Reduced-frequency, non-blocking convergence check.
+// Instead of an MPI_Allreduce after every step, each rank records its
+// per-step largest change in a window. Every `interval` steps the window is
+// reduced with MPI_Iallreduce, which travels while the next step (or block
+// of steps) is computed and is completed after it. The run therefore stops
+// at most interval + block steps after the first converged step, and since
+// the whole window is reduced, that step and the overshoot are known
+// exactly. All ranks complete the same reductions after the same steps, so
+// they always stop together. Only the master thread calls these.
+
+#define CONVERGE_MAX_INTERVAL 64  // longest gap between checks when adaptive
+
+typedef struct {
+    MPI_Comm comm;
+    data_type threshold;
+    int adaptive;            // pick the interval from the rate of decay
+    int interval;            // steps between checks
+    int capacity;            // window length
+    data_type *local;        // per-step changes since the last check
+    data_type *send;         // window being reduced
+    data_type *global;       // its reduction
+    int count;               // steps in local
+    int first;               // iteration of local[0]
+    int pending;             // steps in the reduction in flight, 0 if none
+    int pending_first;       // iteration of send[0]
+    MPI_Request req;
+    int checks;              // reductions completed
+    int converged_at;        // first step at or below the threshold, or -1
+    data_type eps;           // latest known global change
+    int last_step;           // and the step it belongs to
+} converge_t;
+
+// every > 0 checks every that many steps, every < 0 adapts the interval;
+// block is the largest number of steps pushed at once
+static inline int converge_init(converge_t *c, MPI_Comm comm, data_type threshold, int every, int block) {
+    c->comm = comm;
+    c->threshold = threshold;
+    c->adaptive = every < 0;
+    c->interval = every < 0 ? 1 : every;
+    c->capacity = (every < 0 ? CONVERGE_MAX_INTERVAL : every) + block;
+    c->local = (data_type*)malloc(sizeof(data_type) * 3 * c->capacity);
+    c->send = c->local + c->capacity;
+    c->global = c->send + c->capacity;
+    c->count = 0;
+    c->first = 0;
+    c->pending = 0;
+    c->pending_first = 0;
+    c->req = MPI_REQUEST_NULL;
+    c->checks = 0;
+    c->converged_at = -1;
+    c->eps = threshold + 1;
+    c->last_step = -1;
+    return c->local ? 0 : -1;
+}
+
+// Next interval: half the steps the decay since the previous check predicts
+// are left, so checks thin out far from convergence and tighten near it
+static inline void converge_adapt(converge_t *c, data_type prev, int prev_step) {
+    int interval = 1;
+
+    if (prev > c->eps && c->eps > c->threshold && c->last_step > prev_step) {
+        double rate = log((double)c->eps / prev) / (c->last_step - prev_step);
+        double left = log((double)c->threshold / c->eps) / rate;
+        interval = left / 2 > CONVERGE_MAX_INTERVAL ? CONVERGE_MAX_INTERVAL : (int)(left / 2);
+    }
+    c->interval = interval > 1 ? interval : 1;
+}
+
+// Completes the reduction in flight, if any
+static inline void converge_complete(converge_t *c) {
+    data_type prev = c->eps;
+    int prev_step = c->last_step;
+
+    if (c->pending == 0) {
+        return;
+    }
+    MPI_Wait(&c->req, MPI_STATUS_IGNORE);
+    c->checks++;
+    for (int s = 0; s < c->pending && c->converged_at < 0; s++) {
+        if (c->global[s] <= c->threshold) {
+            c->converged_at = c->pending_first + s;
+        }
+    }
+    c->eps = c->global[c->pending - 1];
+    c->last_step = c->pending_first + c->pending - 1;
+    c->pending = 0;
+    if (c->adaptive) {
+        converge_adapt(c, prev, prev_step);
+    }
+}
+
+// Records the local changes of steps iteration .. iteration+n-1, completes
+// the check posted after the previous push and posts a new one once the
+// interval is full. Returns 1 when the run has converged.
+static inline int converge_push(converge_t *c, int iteration, const data_type *eps, int n) {
+    if (c->count == 0) {
+        c->first = iteration;
+    }
+    memcpy(c->local + c->count, eps, sizeof(data_type) * n);
+    c->count += n;
+
+    converge_complete(c);
+    if (c->converged_at < 0 && c->count >= c->interval) {
+        memcpy(c->send, c->local, sizeof(data_type) * c->count);
+        c->pending = c->count;
+        c->pending_first = c->first;
+        c->count = 0;
+        MPI_Iallreduce(c->send, c->global, c->pending, MPI_DATA_TYPE, MPI_MAX, c->comm, &c->req);
+    }
+    return c->converged_at >= 0;
+}
+
+static inline void converge_free(converge_t *c) {
+    converge_complete(c);
+    free(c->local);
+}
+
+// Prints on rank 0 of comm how the run stopped after `iterations` steps
+static inline void converge_report(const converge_t *c, int iterations) {
+    int rank;
+
+    MPI_Comm_rank(c->comm, &rank);
+    if (rank != 0) {
+        return;
+    }
+    if (c->converged_at < 0) {
+        printf("Stopped after %d iterations before converging (%d convergence checks)\n",
+               iterations, c->checks);
+    } else {
+        printf("Converged at iteration %d, stopped after %d: %d steps overshoot, %d convergence checks\n",
+               c->converged_at + 1, iterations, iterations - c->converged_at - 1, c->checks);
+    }
+}
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef HEAT_DECOMP_H
+#define HEAT_DECOMP_H
+
+#include <mpi.h>
+
+// Block decomposition of an nrows x ncols sheet over a 2D Cartesian process
+// grid. Dimension 0 runs down the rows, dimension 1 across the columns. When
+// a size does not divide evenly, the first size % dims ranks of a dimension
+// get one extra row or column.
+typedef struct {
+    MPI_Comm comm;              // Cartesian communicator, may reorder ranks
+    int rank, size;             // in comm
+    int dims[2], coords[2];
+    int rows, cols;             // owned cells, without the frame
+    int row0, col0;             // sheet index of the first owned cell (1-based,
+                                // row/column 0 is the physical boundary)
+    int up, down, left, right;  // neighbours, MPI_PROC_NULL on physical sides
+} decomp_t;
+
+// Number of cells and first sheet index of part coord out of parts
+static inline void decomp_extent(int n, int parts, int coord, int *count, int *first) {
+    int base = n / parts, extra = n % parts;
+
+    *count = base + (coord < extra);
+    *first = 1 + coord * base + (coord < extra ? coord : extra);
+}
+
+// Owned block of any rank of the decomposition, e.g. for gathering
+static inline void decomp_block(const decomp_t *d, int nrows, int ncols, int rank,
+                                int *rows, int *cols, int *row0, int *col0) {
+    int coords[2];
+
+    MPI_Cart_coords(d->comm, rank, 2, coords);
+    decomp_extent(nrows, d->dims[0], coords[0], rows, row0);
+    decomp_extent(ncols, d->dims[1], coords[1], cols, col0);
+}
+
+// The cells a block contributes to the whole sheet, frame included: its
+// owned cells plus only those frame cells that lie on the physical
+// boundary, as the other frame cells belong to the neighbours. sub is their
+// extent, start their first cell in the block and at that cell in the
+// sheet (0-based, so with the frame at 0).
+static inline void decomp_share(const decomp_t *d, int nrows, int ncols, int rank,
+                                int sub[2], int start[2], int at[2]) {
+    int rows, cols, row0, col0, coords[2];
+
+    decomp_block(d, nrows, ncols, rank, &rows, &cols, &row0, &col0);
+    MPI_Cart_coords(d->comm, rank, 2, coords);
+    start[0] = coords[0] == 0 ? 0 : 1;
+    start[1] = coords[1] == 0 ? 0 : 1;
+    sub[0] = (coords[0] == d->dims[0] - 1 ? rows + 2 : rows + 1) - start[0];
+    sub[1] = (coords[1] == d->dims[1] - 1 ? cols + 2 : cols + 1) - start[1];
+    at[0] = row0 - 1 + start[0];
+    at[1] = col0 - 1 + start[1];
+}
+
+// Lets MPI pick a balanced process grid for the ranks of comm (collective)
+static inline void decomp_create(decomp_t *d, MPI_Comm comm, int nrows, int ncols) {
+    int size, periods[2] = { 0, 0 };
+
+    MPI_Comm_size(comm, &size);
+    d->dims[0] = d->dims[1] = 0;
+    MPI_Dims_create(size, 2, d->dims);
+    MPI_Cart_create(comm, 2, d->dims, periods, 1, &d->comm);
+    MPI_Comm_rank(d->comm, &d->rank);
+    MPI_Comm_size(d->comm, &d->size);
+    MPI_Cart_coords(d->comm, d->rank, 2, d->coords);
+    MPI_Cart_shift(d->comm, 0, 1, &d->up, &d->down);
+    MPI_Cart_shift(d->comm, 1, 1, &d->left, &d->right);
+    decomp_extent(nrows, d->dims[0], d->coords[0], &d->rows, &d->row0);
+    decomp_extent(ncols, d->dims[1], d->coords[1], &d->cols, &d->col0);
+}
+
+static inline void decomp_free(decomp_t *d) {
+    MPI_Comm_free(&d->comm);
+}
+
+#endif
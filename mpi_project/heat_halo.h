@@ -0,0 +1,236 @@
+#ifndef HEAT_HALO_H
+#define HEAT_HALO_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+#include "heat_grid.h"
+
+// Halo exchange between the four neighbours of a block.
+// The owned cells of a grid are rows/cols 1..n-2; a halo of depth d is the
+// d rows/columns just outside them, i.e. starting at the frame (index 0 or
+// n-1) and running outwards. Neighbours on physical boundaries are
+// MPI_PROC_NULL and their side of the frame is left untouched.
+//
+// Every message is described by a derived datatype on the grid itself, so
+// rows leave and arrive with no copy and strided columns are gathered by
+// the MPI library. The types bake in the row stride, so all grids passed to
+// one halo_t must have the shape and layout of the one given to halo_init.
+typedef struct {
+    MPI_Comm comm;
+    int up, down, left, right;  // neighbour ranks
+    int depth;
+    MPI_Datatype row;           // one owned row
+    MPI_Datatype col;           // one owned column
+    MPI_Datatype side_cols;     // depth columns over all rows, frame included
+    MPI_Datatype side_rows;     // depth rows widened by the column halos
+    MPI_Request req[8];         // messages of a split exchange in flight
+    MPI_Request *active;        // req, or the persistent set in use
+    MPI_Request persist[2][8];  // persistent split exchanges of two grids
+    const data_type *bound[2];  // data of the grids they were set up for
+} halo_t;
+
+// Time the master thread spends in halo exchanges, in seconds
+typedef struct {
+    double post;     // posting the messages
+    double overlap;  // interior work done while the messages were in flight
+    double wait;     // blocked until the messages completed
+} halo_stats_t;
+
+enum { HALO_TAG_UP = 10, HALO_TAG_DOWN, HALO_TAG_LEFT, HALO_TAG_RIGHT };
+
+// count rows of len cells, ld apart
+static inline MPI_Datatype halo_block_type(int count, int len, int ld) {
+    MPI_Datatype t;
+
+    MPI_Type_vector(count, len, ld, MPI_DATA_TYPE, &t);
+    MPI_Type_commit(&t);
+    return t;
+}
+
+// Sets up the exchange of halos of the given depth (<= g->halo) for grids
+// shaped like g
+static inline int halo_init(halo_t *h, MPI_Comm comm, int up, int down, int left, int right,
+                            const grid_t *g, int depth) {
+    int rows = g->rows, cols = g->cols, ld = g->ld;
+
+    h->comm = comm;
+    h->up = up;
+    h->down = down;
+    h->left = left;
+    h->right = right;
+    h->depth = depth;
+    h->row = halo_block_type(1, cols - 2, ld);
+    h->col = halo_block_type(rows - 2, 1, ld);
+    h->side_cols = halo_block_type(rows, depth, ld);
+    h->side_rows = halo_block_type(depth, cols - 2 + 2 * depth, ld);
+    h->active = h->req;
+    h->bound[0] = h->bound[1] = NULL;
+    return 0;
+}
+
+static inline void halo_free(halo_t *h) {
+    for (int set = 0; set < 2; set++) {
+        if (h->bound[set] != NULL) {
+            for (int r = 0; r < 8; r++) {
+                MPI_Request_free(&h->persist[set][r]);
+            }
+        }
+    }
+    MPI_Type_free(&h->row);
+    MPI_Type_free(&h->col);
+    MPI_Type_free(&h->side_cols);
+    MPI_Type_free(&h->side_rows);
+}
+
+// Fills the halo of g. Columns go first, then rows including the freshly
+// received columns, so the corner blocks needed by multi-step updates arrive
+// from the diagonal neighbours via the sides. Team function; the master
+// thread communicates while the others wait.
+static inline void halo_exchange(halo_t *h, grid_t *g) {
+    int rows = g->rows, cols = g->cols, d = h->depth;
+
+    OMP(master)
+    {
+        // Owned edge columns travel left and right, together with the frame
+        // rows so physical boundary values also reach the corner halos
+        MPI_Sendrecv(&GRID(g, 0, 1), 1, h->side_cols, h->left, HALO_TAG_LEFT,
+                     &GRID(g, 0, cols - 1), 1, h->side_cols, h->right, HALO_TAG_LEFT,
+                     h->comm, MPI_STATUS_IGNORE);
+        MPI_Sendrecv(&GRID(g, 0, cols - 1 - d), 1, h->side_cols, h->right, HALO_TAG_RIGHT,
+                     &GRID(g, 0, 1 - d), 1, h->side_cols, h->left, HALO_TAG_RIGHT,
+                     h->comm, MPI_STATUS_IGNORE);
+
+        // Owned edge rows, widened by the column halos, travel up and down
+        MPI_Sendrecv(&GRID(g, 1, 1 - d), 1, h->side_rows, h->up, HALO_TAG_UP,
+                     &GRID(g, rows - 1, 1 - d), 1, h->side_rows, h->down, HALO_TAG_UP,
+                     h->comm, MPI_STATUS_IGNORE);
+        MPI_Sendrecv(&GRID(g, rows - 1 - d, 1 - d), 1, h->side_rows, h->down, HALO_TAG_DOWN,
+                     &GRID(g, 1 - d, 1 - d), 1, h->side_rows, h->up, HALO_TAG_DOWN,
+                     h->comm, MPI_STATUS_IGNORE);
+    }
+    OMP(barrier)
+}
+
+// MPI_Irecv/MPI_Recv_init and MPI_Isend/MPI_Send_init share their signatures
+typedef int (*halo_recv_fn)(void *, int, MPI_Datatype, int, int, MPI_Comm, MPI_Request *);
+typedef int (*halo_send_fn)(const void *, int, MPI_Datatype, int, int, MPI_Comm, MPI_Request *);
+
+// The eight messages of a split exchange on g: receives into req[0..3],
+// sends from req[4..7], all straight from and into the grid
+static inline void halo_split_requests(halo_t *h, grid_t *g, MPI_Request *req,
+                                       halo_recv_fn recv, halo_send_fn send) {
+    int rows = g->rows, cols = g->cols;
+
+    recv(&GRID(g, 0, 1), 1, h->row, h->up, HALO_TAG_DOWN, h->comm, &req[0]);
+    recv(&GRID(g, rows - 1, 1), 1, h->row, h->down, HALO_TAG_UP, h->comm, &req[1]);
+    recv(&GRID(g, 1, 0), 1, h->col, h->left, HALO_TAG_RIGHT, h->comm, &req[2]);
+    recv(&GRID(g, 1, cols - 1), 1, h->col, h->right, HALO_TAG_LEFT, h->comm, &req[3]);
+    send(&GRID(g, 1, 1), 1, h->row, h->up, HALO_TAG_UP, h->comm, &req[4]);
+    send(&GRID(g, rows - 2, 1), 1, h->row, h->down, HALO_TAG_DOWN, h->comm, &req[5]);
+    send(&GRID(g, 1, 1), 1, h->col, h->left, HALO_TAG_LEFT, h->comm, &req[6]);
+    send(&GRID(g, 1, cols - 2), 1, h->col, h->right, HALO_TAG_RIGHT, h->comm, &req[7]);
+}
+
+// Sets up the split exchange of the two ping-pong grids (g1 may be NULL)
+// once as persistent requests (MPI_Send_init/MPI_Recv_init), so every step
+// only has to MPI_Startall them.
+static inline void halo_persist(halo_t *h, grid_t *g0, grid_t *g1) {
+    grid_t *g[2] = { g0, g1 };
+
+    for (int set = 0; set < 2 && g[set] != NULL; set++) {
+        halo_split_requests(h, g[set], h->persist[set], MPI_Recv_init, MPI_Send_init);
+        h->bound[set] = g[set]->data;
+    }
+}
+
+// Split depth-1 exchange: halo_start posts every message and returns, so the
+// cells that do not touch the halo can be updated while the data is in
+// flight; halo_finish waits for it. The 5-point stencil needs no corners,
+// so all four sides travel at once. Grids set up with halo_persist restart
+// their persistent requests, others post fresh ones. Team functions.
+static inline void halo_start(halo_t *h, grid_t *g) {
+    int set = g->data == h->bound[0] ? 0 : g->data == h->bound[1] ? 1 : -1;
+
+    OMP(master)
+    {
+        if (set >= 0) {
+            h->active = h->persist[set];
+            MPI_Startall(8, h->active);
+        } else {
+            h->active = h->req;
+            halo_split_requests(h, g, h->req, MPI_Irecv, MPI_Isend);
+        }
+    }
+}
+
+static inline void halo_finish(halo_t *h, grid_t *g) {
+    (void)g;
+    OMP(master)
+    MPI_Waitall(8, h->active, MPI_STATUSES_IGNORE);
+    OMP(barrier)
+}
+
+// Seconds since *stamp, which is moved on to now
+static inline double halo_lap(double *stamp) {
+    double now = MPI_Wtime(), dt = now - *stamp;
+
+    *stamp = now;
+    return dt;
+}
+
+// Prints on rank 0 of comm how the exchange time splits up, as the largest
+// value over the ranks, and how much of the time the messages were in
+// flight was covered by interior work (lowest and average over the ranks)
+static inline void halo_stats_print(const halo_stats_t *st, MPI_Comm comm) {
+    int rank, size;
+    double in[3] = { st->post, st->overlap, st->wait }, max[3];
+    double window = st->overlap + st->wait;
+    double hidden = window > 0 ? st->overlap / window : 0, min_hidden, sum_hidden;
+
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    MPI_Reduce(in, max, 3, MPI_DOUBLE, MPI_MAX, 0, comm);
+    MPI_Reduce(&hidden, &min_hidden, 1, MPI_DOUBLE, MPI_MIN, 0, comm);
+    MPI_Reduce(&hidden, &sum_hidden, 1, MPI_DOUBLE, MPI_SUM, 0, comm);
+    if (rank == 0) {
+        printf("Halo exchange: %.3f ms posting, %.3f ms overlapped with interior work, "
+               "%.3f ms exposed waiting (max over ranks)\n",
+               1e3 * max[0], 1e3 * max[1], 1e3 * max[2]);
+        printf("Communication time hidden: %.0f%% average, %.0f%% worst rank\n",
+               100 * sum_hidden / size, 100 * min_hidden);
+    }
+}
+
+// Copies the physical boundary lines, including the parts lying in the
+// halos of the other sides, from src to dst. The stencil never writes them,
+// so after an exchange into src this keeps the second ping-pong buffer's
+// boundary consistent for multi-step updates. Team function.
+static inline void halo_copy_frame(const halo_t *h, const grid_t *src, grid_t *dst, int depth) {
+    int rows = src->rows, cols = src->cols;
+    int i0 = h->up != MPI_PROC_NULL ? 1 - depth : 0;
+    int i1 = h->down != MPI_PROC_NULL ? rows - 1 + depth : rows;
+    int j0 = h->left != MPI_PROC_NULL ? 1 - depth : 0;
+    int j1 = h->right != MPI_PROC_NULL ? cols - 1 + depth : cols;
+
+    OMP(for schedule(static))
+    for (int i = i0; i < i1; i++) {
+        if (h->left == MPI_PROC_NULL) {
+            GRID(dst, i, 0) = GRID(src, i, 0);
+        }
+        if (h->right == MPI_PROC_NULL) {
+            GRID(dst, i, cols - 1) = GRID(src, i, cols - 1);
+        }
+    }
+    OMP(single)
+    {
+        if (h->up == MPI_PROC_NULL) {
+            memcpy(&GRID(dst, 0, j0), &GRID(src, 0, j0), sizeof(data_type) * (j1 - j0));
+        }
+        if (h->down == MPI_PROC_NULL) {
+            memcpy(&GRID(dst, rows - 1, j0), &GRID(src, rows - 1, j0), sizeof(data_type) * (j1 - j0));
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,223 @@
+#ifndef HEAT_IO_H
+#define HEAT_IO_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <mpi.h>
+#include "heat_grid.h"
+#include "heat_decomp.h"
+#include "heat_compress.h"
+
+// Binary field files. A file is an IO_HEADER_BYTES header followed by the
+// whole field, frame included, as one row-major array of the writer's
+// data_type in the writer's byte order. The ranks write a file together:
+// each one sets a file view of its share of the field and writes straight
+// from its block, so no rank ever holds more than its own block. Readers
+// map the file and use the values in place.
+//
+// A file may hold the field compressed instead (heat_compress.h): the
+// header says so, how many bytes the compressed section takes and, for
+// error-bounded compression, how far a value may be off. Each rank then
+// compresses its share and writes its stream at its offset in the section.
+
+#define IO_MAGIC "HEATFLD"
+#define IO_VERSION 1
+#define IO_HEADER_BYTES 128
+#define IO_BYTE_ORDER 0x01020304u
+
+typedef struct {
+    char magic[8];          // IO_MAGIC
+    uint32_t version;       // IO_VERSION
+    uint32_t byte_order;    // IO_BYTE_ORDER as the writer stores it
+    uint32_t value_bytes;   // 4 for float values, 8 for double
+    uint32_t ndims;         // 2 for a sheet, 3 for a cube
+    uint64_t dims[3];       // cells along each axis, frame included, slowest
+                            // first; 1 past ndims
+    int64_t iteration;      // iterations done when the field was written
+    double alpha;           // diffusivity
+    double epsilon;         // convergence threshold
+    double time;            // simulated time in h^2 / D, 0 for steady solvers
+    uint32_t compressed;    // 1 if the field is a compressed section
+    uint32_t reserved0;     // zero
+    uint64_t field_bytes;   // bytes of the compressed section
+    double error_bound;     // largest error of a value, 0 if lossless
+    char reserved[24];      // zero
+} io_header_t;
+
+typedef char io_header_size_check[sizeof(io_header_t) == IO_HEADER_BYTES ? 1 : -1];
+
+// Header of a field of ndims axes of dims cells, with the run's details
+// left zero
+static inline io_header_t io_header(int ndims, const int *dims) {
+    io_header_t h;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, IO_MAGIC, sizeof(IO_MAGIC));
+    h.version = IO_VERSION;
+    h.byte_order = IO_BYTE_ORDER;
+    h.value_bytes = sizeof(data_type);
+    h.ndims = ndims;
+    for (int k = 0; k < 3; k++) {
+        h.dims[k] = k < ndims ? (uint64_t)dims[k] : 1;
+    }
+    return h;
+}
+
+static inline uint64_t io_cells(const io_header_t *h) {
+    return h->dims[0] * h->dims[1] * h->dims[2];
+}
+
+// Bytes the field takes in the file
+static inline uint64_t io_field_bytes(const io_header_t *h) {
+    return h->compressed ? h->field_bytes : io_cells(h) * h->value_bytes;
+}
+
+// Writes a field that the ranks of comm hold in pieces to path (collective).
+// Each rank's piece is the sub cells from start on of its buffer, an array
+// of sizes cells, and goes to the cells from at on of the field. Returns 0
+// on success on every rank, -1 on every rank otherwise.
+static inline int io_write(const char *path, MPI_Comm comm, const io_header_t *h, const void *buf,
+                           const int *sizes, const int *sub, const int *start, const int *at) {
+    int rank, dims[3], failed = 0, any;
+    MPI_File f;
+    MPI_Datatype mem, view;
+
+    MPI_Comm_rank(comm, &rank);
+    if (MPI_File_open(comm, path, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &f) != MPI_SUCCESS) {
+        return -1;
+    }
+    for (int k = 0; k < 3; k++) {
+        dims[k] = (int)h->dims[k];
+    }
+    // Cut off whatever an older, larger file had beyond the field
+    failed |= MPI_File_set_size(f, IO_HEADER_BYTES + (MPI_Offset)io_cells(h) * h->value_bytes);
+    if (rank == 0) {
+        failed |= MPI_File_write_at(f, 0, h, IO_HEADER_BYTES, MPI_BYTE, MPI_STATUS_IGNORE);
+    }
+
+    MPI_Type_create_subarray(h->ndims, sizes, sub, start, MPI_ORDER_C, MPI_DATA_TYPE, &mem);
+    MPI_Type_create_subarray(h->ndims, dims, sub, at, MPI_ORDER_C, MPI_DATA_TYPE, &view);
+    MPI_Type_commit(&mem);
+    MPI_Type_commit(&view);
+    failed |= MPI_File_set_view(f, IO_HEADER_BYTES, MPI_DATA_TYPE, view, "native", MPI_INFO_NULL);
+    failed |= MPI_File_write_at_all(f, 0, buf, 1, mem, MPI_STATUS_IGNORE);
+    MPI_Type_free(&mem);
+    MPI_Type_free(&view);
+    failed |= MPI_File_close(&f);
+
+    failed = failed != MPI_SUCCESS;
+    MPI_Allreduce(&failed, &any, 1, MPI_INT, MPI_LOR, comm);
+    return any ? -1 : 0;
+}
+
+// Writes the n x n sheet whose blocks (with their one-cell frames, any
+// halo width) the ranks of dec hold; h gives the run's details
+static inline int io_write_sheet(const char *path, const decomp_t *dec, const grid_t *block, int n,
+                                 const io_header_t *h) {
+    int sizes[2] = { block->rows, block->ld }, sub[2], start[2], at[2];
+
+    decomp_share(dec, n, n, dec->rank, sub, start, at);
+    return io_write(path, dec->comm, h, block->data, sizes, sub, start, at);
+}
+
+// Writes a field that the ranks of comm hold compressed in c to path, as a
+// compressed section (collective, master thread). Returns 0 on success on
+// every rank, -1 on every rank otherwise.
+static inline int io_write_section(const char *path, MPI_Comm comm, const io_header_t *h, const compress_t *c) {
+    int rank, failed = 0, any;
+    uint64_t head_bytes, mine;
+    io_header_t header = *h;
+    MPI_File f;
+
+    MPI_Comm_rank(comm, &rank);
+    uint64_t *head = compress_table(comm, c, &head_bytes, &header.field_bytes, &mine);
+    header.compressed = 1;
+    header.error_bound = c->bound;
+    if (MPI_File_open(comm, path, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &f) != MPI_SUCCESS) {
+        free(head);
+        return -1;
+    }
+    failed |= MPI_File_set_size(f, IO_HEADER_BYTES + (MPI_Offset)header.field_bytes);
+    if (rank == 0) {
+        failed |= MPI_File_write_at(f, 0, &header, IO_HEADER_BYTES, MPI_BYTE, MPI_STATUS_IGNORE);
+        failed |= MPI_File_write_at(f, IO_HEADER_BYTES, head, (int)head_bytes, MPI_BYTE, MPI_STATUS_IGNORE);
+    }
+    failed |= MPI_File_write_at_all(f, IO_HEADER_BYTES + (MPI_Offset)mine, c->out, (int)c->bytes, MPI_BYTE,
+                                    MPI_STATUS_IGNORE);
+    failed |= MPI_File_close(&f);
+    free(head);
+
+    failed = failed != MPI_SUCCESS;
+    MPI_Allreduce(&failed, &any, 1, MPI_INT, MPI_LOR, comm);
+    return any ? -1 : 0;
+}
+
+// Serial from here on: reading
+
+// A field file mapped read-only into memory
+typedef struct {
+    const io_header_t *header;
+    const void *values;  // io_cells(header) values of header->value_bytes, or
+                         // the compressed section
+    size_t bytes;        // mapped, header included
+} io_map_t;
+
+// Maps the field file at path; returns 0 on success, -1 (after printing
+// why) if it cannot be read, is not a field file or is of another byte
+// order
+static inline int io_open(io_map_t *m, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Cannot read '%s'\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    m->bytes = (size_t)st.st_size;
+    void *p = m->bytes >= IO_HEADER_BYTES ? mmap(NULL, m->bytes, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "'%s' is not a field file\n", path);
+        return -1;
+    }
+    m->header = (const io_header_t *)p;
+    m->values = (const char *)p + IO_HEADER_BYTES;
+
+    const io_header_t *h = m->header;
+    const char *why = NULL;
+    if (memcmp(h->magic, IO_MAGIC, sizeof(IO_MAGIC)) != 0 || h->version != IO_VERSION) {
+        why = "is not a field file";
+    } else if (h->byte_order != IO_BYTE_ORDER) {
+        why = "was written with the other byte order";
+    } else if ((h->value_bytes != 4 && h->value_bytes != 8) || h->ndims < 2 || h->ndims > 3 ||
+               (h->compressed && (h->value_bytes != sizeof(data_type) || h->ndims != 2)) ||
+               m->bytes < IO_HEADER_BYTES + io_field_bytes(h)) {
+        why = "is damaged or cut short";
+    }
+    if (why != NULL) {
+        fprintf(stderr, "'%s' %s\n", path, why);
+        munmap(p, m->bytes);
+        return -1;
+    }
+    return 0;
+}
+
+// Value k of an uncompressed field in row-major order, whatever type it is
+// stored in
+static inline double io_value(const io_map_t *m, uint64_t k) {
+    return m->header->value_bytes == 4 ? ((const float *)m->values)[k] : ((const double *)m->values)[k];
+}
+
+static inline void io_close(io_map_t *m) {
+    munmap((void *)m->header, m->bytes);
+}
+
+#endif
@@ -0,0 +1,622 @@
+#ifndef HEAT_MG_H
+#define HEAT_MG_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+#include "heat_grid.h"
+#include "heat_halo.h"
+#include "heat_decomp.h"
+#include "heat_stencil.h"
+#include "heat_sor.h"
+
+// Geometric multigrid for the steady state (Laplace equation) of the sheet.
+// Level 0 is the sheet itself: the owned cells, the physical boundary in
+// the frame and no right-hand side. Coarser levels solve for the
+// correction, A_c e = R r, with a zero frame. Every rank coarsens its own
+// block by pairing rows and columns (an odd last one stays single), so the
+// coarse blocks of neighbouring ranks line up and the decomposition and
+// halo exchange carry over unchanged. Restriction sums the children and
+// prolongation is bilinear between the coarse cell centres. The coarse
+// operators are the 5-point Laplacian rediscretized on the actual cell
+// sizes, kept as five coefficients per cell: odd leftover rows and columns
+// need no special case, and the physical boundary stays half a fine cell
+// beyond the last cell instead of drifting outwards level by level, which
+// would make the coarse corrections overshoot. Once a block would get
+// thinner than MG_MIN_BLOCK, the next level is gathered onto rank 0, which
+// coarsens on alone down to MG_COARSEST cells a side.
+//
+// Set up without a sheet, the hierarchy instead solves A z = r for a given
+// r, with a zero frame on every level, so that one V-cycle can
+// precondition a Krylov solver.
+
+#define MG_MAX_LEVELS 32
+#define MG_MIN_BLOCK 4        // thinnest block before agglomerating
+#define MG_COARSEST 4         // thinnest coarsest level
+#define MG_COARSE_SWEEPS 30   // smoothing sweeps that solve the coarsest level
+#define MG_SWEEPS 2           // pre- and post-smoothing sweeps
+#define MG_JACOBI_WEIGHT 0.8f
+#define MG_TAG 40
+
+enum { MG_JACOBI, MG_RBGS };
+enum { MG_D, MG_N, MG_S, MG_W, MG_E, MG_COEFS };  // diagonal and couplings
+
+typedef struct {
+    int active;               // the level lives on this rank
+    int rows, cols;           // owned cells plus frame
+    int grows, gcols;         // owned cells of the whole level
+    int row0, col0;           // level index of local cell (1, 1)
+    MPI_Comm comm;
+    int up, down, left, right;
+    grid_t *u;                // solution (level 0) or correction
+    grid_t ubuf, f, r;
+    grid_t a[MG_COEFS];       // operator; level 0 is the plain 5-point one
+    grid_t size[2];           // cell heights and widths in sheet cells, the
+                              // physical boundary counting as 1; none on level 0
+    halo_t *h, halo;
+    // The next level is gathered onto rank 0: restriction goes through
+    // stage, this rank's block of it, and rank 0 has types per rank placing
+    // that block in the whole level, with ([1]) and without ([0]) the frame
+    // that prolongation reads
+    int gather;
+    grid_t stage;
+    MPI_Datatype stage_type[2];
+    MPI_Datatype *block[2];
+} mg_level_t;
+
+typedef struct {
+    int nlevels;              // levels on this rank
+    int smoother;             // MG_JACOBI or MG_RBGS
+    int fmg, started;         // start with a full multigrid cycle
+    const stencil_kernel_t *kernel;
+    sor_t gs;                 // red-black Gauss-Seidel on level 0
+    grid_t *tmp;              // level 0 Jacobi partner of u
+    grid_t prev;              // level 0 before the iteration
+    mg_level_t level[MG_MAX_LEVELS];
+} mg_t;
+
+static inline data_type mg_coef(const mg_level_t *L, int c, int i, int j) {
+    if (L->a[c].data != NULL) {
+        return GRID(&L->a[c], i, j);
+    }
+    return c == MG_D ? 4 : -1;
+}
+
+static inline data_type mg_size(const mg_level_t *L, int axis, int i, int j) {
+    return L->size[axis].data != NULL ? GRID(&L->size[axis], i, j) : 1;
+}
+
+// Team functions from here on, except where noted
+
+static inline void mg_exchange(mg_level_t *L) {
+    halo_start(L->h, L->u);
+    halo_finish(L->h, L->u);
+}
+
+// r = f - A u on the owned cells; u's halo must be current
+static inline void mg_residual(mg_level_t *L) {
+    grid_t *u = L->u;
+
+    OMP(for schedule(static))
+    for (int i = 1; i < L->rows - 1; i++) {
+        for (int j = 1; j < L->cols - 1; j++) {
+            data_type au;
+            if (L->a[MG_D].data == NULL) {
+                au = 4 * GRID(u, i, j) - GRID(u, i - 1, j) - GRID(u, i + 1, j)
+                   - GRID(u, i, j - 1) - GRID(u, i, j + 1);
+                GRID(&L->r, i, j) = -au;
+            } else {
+                au = GRID(&L->a[MG_D], i, j) * GRID(u, i, j)
+                   + GRID(&L->a[MG_N], i, j) * GRID(u, i - 1, j)
+                   + GRID(&L->a[MG_S], i, j) * GRID(u, i + 1, j)
+                   + GRID(&L->a[MG_W], i, j) * GRID(u, i, j - 1)
+                   + GRID(&L->a[MG_E], i, j) * GRID(u, i, j + 1);
+                GRID(&L->r, i, j) = GRID(&L->f, i, j) - au;
+            }
+        }
+    }
+}
+
+// Right-hand side of level 0 with the owned cells moved to it: the
+// physical boundary values next to them, into r
+static inline void mg_boundary_rhs(mg_level_t *L) {
+    grid_t *u = L->u;
+    int rows = L->rows, cols = L->cols;
+
+    OMP(for schedule(static))
+    for (int i = 1; i < rows - 1; i++) {
+        for (int j = 1; j < cols - 1; j++) {
+            data_type b = 0;
+            if (i == 1 && L->up == MPI_PROC_NULL) b += GRID(u, 0, j);
+            if (i == rows - 2 && L->down == MPI_PROC_NULL) b += GRID(u, rows - 1, j);
+            if (j == 1 && L->left == MPI_PROC_NULL) b += GRID(u, i, 0);
+            if (j == cols - 2 && L->right == MPI_PROC_NULL) b += GRID(u, i, cols - 1);
+            GRID(&L->r, i, j) = b;
+        }
+    }
+}
+
+// Gauss-Seidel on the cells of one colour of a coarse level
+static inline void mg_gs_sweep(mg_level_t *L, int color) {
+    grid_t *u = L->u;
+    int parity = (L->row0 + L->col0) & 1;
+
+    OMP(for schedule(static))
+    for (int i = 1; i < L->rows - 1; i++) {
+        for (int j = 1 + (((i + 1 + parity) & 1) ^ color); j < L->cols - 1; j += 2) {
+            GRID(u, i, j) = (GRID(&L->f, i, j)
+                             - GRID(&L->a[MG_N], i, j) * GRID(u, i - 1, j)
+                             - GRID(&L->a[MG_S], i, j) * GRID(u, i + 1, j)
+                             - GRID(&L->a[MG_W], i, j) * GRID(u, i, j - 1)
+                             - GRID(&L->a[MG_E], i, j) * GRID(u, i, j + 1)) / GRID(&L->a[MG_D], i, j);
+        }
+    }
+}
+
+// Weighted Jacobi on a coarse level, from the residual in r
+static inline void mg_jacobi_update(mg_level_t *L) {
+    OMP(for schedule(static))
+    for (int i = 1; i < L->rows - 1; i++) {
+        for (int j = 1; j < L->cols - 1; j++) {
+            GRID(L->u, i, j) += MG_JACOBI_WEIGHT * GRID(&L->r, i, j) / GRID(&L->a[MG_D], i, j);
+        }
+    }
+}
+
+// The sheet is smoothed with the solver kernels themselves: a damped Jacobi
+// step of the time-stepping stencil, or a red-black SOR sweep with omega 1
+static inline void mg_smooth(mg_t *mg, int k, int sweeps) {
+    mg_level_t *L = &mg->level[k];
+    int sheet = L->a[MG_D].data == NULL;
+
+    for (int s = 0; s < sweeps; s++) {
+        if (sheet && mg->smoother == MG_RBGS) {
+            sor_iteration(&mg->gs, L->h, L->u);
+        } else if (sheet) {
+            mg_exchange(L);
+            stencil_apply(mg->kernel, L->u, mg->tmp, 1, L->rows - 1, 1, L->cols - 1, MG_JACOBI_WEIGHT / 4);
+            OMP(master)
+            {
+                grid_t *t = L->u;
+                L->u = mg->tmp;
+                mg->tmp = t;
+            }
+            OMP(barrier)
+        } else if (mg->smoother == MG_RBGS) {
+            for (int color = 0; color < 2; color++) {
+                mg_exchange(L);
+                mg_gs_sweep(L, color);
+            }
+        } else {
+            mg_exchange(L);
+            mg_residual(L);
+            mg_jacobi_update(L);
+        }
+    }
+}
+
+// dst (next level's cells over this block) = sums of the children in src
+static inline void mg_restrict(const mg_level_t *L, const grid_t *src, grid_t *dst) {
+    int nr = L->rows - 2, nc = L->cols - 2;
+
+    OMP(for schedule(static))
+    for (int I = 1; I <= (nr + 1) / 2; I++) {
+        for (int J = 1; J <= (nc + 1) / 2; J++) {
+            data_type sum = 0;
+            for (int i = 2 * I - 1; i <= 2 * I && i <= nr; i++) {
+                for (int j = 2 * J - 1; j <= 2 * J && j <= nc; j++) {
+                    sum += GRID(src, i, j);
+                }
+            }
+            GRID(dst, I, J) = sum;
+        }
+    }
+}
+
+// u = P src (set) or u += P src (add). A child takes 3/4 of its coarse
+// cell and 1/4 of the next one on its side, in each direction; an odd
+// leftover child sits in the middle of its cell and takes it whole. src
+// must have a current frame.
+static inline void mg_prolong(mg_level_t *L, const grid_t *src, int add) {
+    int nr = L->rows - 2, nc = L->cols - 2;
+
+    OMP(for schedule(static))
+    for (int i = 1; i <= nr; i++) {
+        int I = (i + 1) / 2, di = i == nr && i % 2 ? 0 : i % 2 ? -1 : 1;
+        data_type wi = di ? 0.75f : 1.0f;
+        for (int j = 1; j <= nc; j++) {
+            int J = (j + 1) / 2, dj = j == nc && j % 2 ? 0 : j % 2 ? -1 : 1;
+            data_type wj = dj ? 0.75f : 1.0f;
+            data_type c = wi * wj * GRID(src, I, J)
+                        + (1 - wi) * wj * GRID(src, I + di, J)
+                        + wi * (1 - wj) * GRID(src, I, J + dj)
+                        + (1 - wi) * (1 - wj) * GRID(src, I + di, J + dj);
+            GRID(L->u, i, j) = add ? GRID(L->u, i, j) + c : c;
+        }
+    }
+}
+
+// Master thread: moves the owned cells of every rank's stage into the
+// whole next level on rank 0 (to_root), or back together with the frame
+static inline void mg_move(const mg_level_t *L, grid_t *stage, grid_t *whole, int to_root) {
+    int rank, size, n = 0;
+
+    MPI_Comm_rank(L->comm, &rank);
+    MPI_Comm_size(L->comm, &size);
+    MPI_Request req[size + 1];
+    if (rank == 0) {
+        for (int p = 0; p < size; p++) {
+            if (to_root) {
+                MPI_Irecv(whole->data, 1, L->block[0][p], p, MG_TAG, L->comm, &req[n++]);
+            } else {
+                MPI_Isend(whole->data, 1, L->block[1][p], p, MG_TAG, L->comm, &req[n++]);
+            }
+        }
+    }
+    if (to_root) {
+        MPI_Isend(&GRID(stage, 1, 1), 1, L->stage_type[0], 0, MG_TAG, L->comm, &req[n++]);
+    } else {
+        MPI_Irecv(&GRID(stage, 0, 0), 1, L->stage_type[1], 0, MG_TAG, L->comm, &req[n++]);
+    }
+    MPI_Waitall(n, req, MPI_STATUSES_IGNORE);
+}
+
+// Restricts src of level k into the right-hand side of level k + 1
+static inline void mg_restrict_to(mg_t *mg, int k, const grid_t *src) {
+    mg_level_t *L = &mg->level[k], *C = &mg->level[k + 1];
+
+    if (L->gather) {
+        mg_restrict(L, src, &L->stage);
+        OMP(master)
+        mg_move(L, &L->stage, &C->f, 1);
+        OMP(barrier)
+    } else {
+        mg_restrict(L, src, &C->f);
+    }
+}
+
+// Brings the solution of level k + 1 to level k, added to u or replacing it
+static inline void mg_prolong_from(mg_t *mg, int k, int add) {
+    mg_level_t *L = &mg->level[k], *C = &mg->level[k + 1];
+
+    if (L->gather) {
+        OMP(master)
+        mg_move(L, &L->stage, C->u, 0);
+        OMP(barrier)
+        mg_prolong(L, &L->stage, add);
+    } else {
+        mg_exchange(C);
+        mg_prolong(L, C->u, add);
+    }
+}
+
+static inline int mg_coarsest(const mg_t *mg, int k) {
+    return k == mg->nlevels - 1 && !mg->level[k].gather;
+}
+
+// V-cycle on level k
+static inline void mg_cycle(mg_t *mg, int k) {
+    mg_level_t *L = &mg->level[k];
+
+    if (mg_coarsest(mg, k)) {
+        mg_smooth(mg, k, MG_COARSE_SWEEPS);
+        return;
+    }
+    mg_smooth(mg, k, MG_SWEEPS);
+    mg_exchange(L);
+    mg_residual(L);
+    mg_restrict_to(mg, k, &L->r);
+    if (mg->level[k + 1].active) {
+        grid_fill(mg->level[k + 1].u, 0);
+        mg_cycle(mg, k + 1);
+    }
+    mg_prolong_from(mg, k, 1);
+    mg_smooth(mg, k, MG_SWEEPS);
+}
+
+// Full multigrid: the problem is restricted to every level, solved on the
+// coarsest, and each finer level starts from the interpolated solution of
+// the one below and gets one V-cycle
+static inline void mg_full(mg_t *mg) {
+    const grid_t *src = &mg->level[0].r;
+
+    mg_boundary_rhs(&mg->level[0]);
+    for (int k = 0; !mg_coarsest(mg, k) && mg->level[k + 1].active; k++) {
+        mg_restrict_to(mg, k, src);
+        src = &mg->level[k + 1].f;
+    }
+    if (mg->level[mg->nlevels - 1].gather) {
+        // Ranks other than 0 only send their part down
+        mg_restrict_to(mg, mg->nlevels - 1, src);
+    }
+    for (int k = mg->nlevels - 1; k >= 0; k--) {
+        if (mg_coarsest(mg, k)) {
+            grid_fill(mg->level[k].u, 0);
+            mg_smooth(mg, k, MG_COARSE_SWEEPS);
+            continue;
+        }
+        mg_prolong_from(mg, k, 0);
+        mg_cycle(mg, k);
+    }
+}
+
+// One multigrid iteration on the sheet, a full multigrid cycle first if
+// asked for and V-cycles after, and the largest relative change it made.
+// The result is in mg->level[0].u, which Jacobi smoothing may have swapped
+// with mg->tmp.
+static inline data_type mg_step(mg_t *mg) {
+    mg_level_t *L = &mg->level[0];
+    data_type max_eps = 0;
+
+    grid_copy(L->u, &mg->prev);
+    if (mg->fmg && !mg->started) {
+        mg_full(mg);
+    } else {
+        mg_cycle(mg, 0);
+    }
+    OMP(master)
+    mg->started = 1;
+
+    OMP(for schedule(static))
+    for (int i = 1; i < L->rows - 1; i++) {
+        for (int j = 1; j < L->cols - 1; j++) {
+            data_type value = GRID(L->u, i, j);
+            data_type eps = fabsf((value - GRID(&mg->prev, i, j)) / (value == 0 ? STENCIL_ZERO_GUARD : value));
+            if (eps > max_eps) {
+                max_eps = eps;
+            }
+        }
+    }
+    return team_max(max_eps);
+}
+
+// z = one V-cycle on A z = r from z = 0, for a hierarchy set up without a
+// sheet; r and z are shaped like its level 0
+static inline void mg_precondition(mg_t *mg, const grid_t *r, grid_t *z) {
+    mg_level_t *L = &mg->level[0];
+
+    grid_copy(r, &L->f);
+    grid_fill(L->u, 0);
+    mg_cycle(mg, 0);
+    grid_copy(L->u, z);
+}
+
+// Serial from here on
+
+static inline void mg_level_alloc(mg_level_t *L) {
+    grid_alloc(&L->ubuf, L->rows, L->cols, 1);
+    grid_alloc(&L->f, L->rows, L->cols, 1);
+    grid_alloc(&L->r, L->rows, L->cols, 1);
+    grid_fill(&L->ubuf, 0);
+    grid_fill(&L->f, 0);
+    grid_fill(&L->r, 0);
+    for (int c = 0; c < MG_COEFS; c++) {
+        grid_alloc(&L->a[c], L->rows, L->cols, 1);
+        grid_fill(&L->a[c], 0);
+    }
+    for (int axis = 0; axis < 2; axis++) {
+        grid_alloc(&L->size[axis], L->rows, L->cols, 1);
+        grid_fill(&L->size[axis], 1);
+    }
+    L->u = &L->ubuf;
+    halo_init(&L->halo, L->comm, L->up, L->down, L->left, L->right, L->u, 1);
+    L->h = &L->halo;
+}
+
+// Heights ([0]) and widths ([1]) of the next level's cells over this
+// block, into out[2]
+static inline void mg_sizes(const mg_level_t *L, grid_t *out) {
+    int nr = L->rows - 2, nc = L->cols - 2;
+
+    for (int I = 1; I <= (nr + 1) / 2; I++) {
+        for (int J = 1; J <= (nc + 1) / 2; J++) {
+            int i = 2 * I - 1, j = 2 * J - 1;
+            GRID(&out[0], I, J) = mg_size(L, 0, i, j) + (i < nr ? mg_size(L, 0, i + 1, j) : 0);
+            GRID(&out[1], I, J) = mg_size(L, 1, i, j) + (j < nc ? mg_size(L, 1, i, j + 1) : 0);
+        }
+    }
+}
+
+// 5-point operator of a coarse level from its cell sizes, frame included:
+// a coupling is the shared side over the distance between the centres
+static inline void mg_operator(mg_level_t *L) {
+    for (int i = 1; i < L->rows - 1; i++) {
+        for (int j = 1; j < L->cols - 1; j++) {
+            data_type h = GRID(&L->size[0], i, j), w = GRID(&L->size[1], i, j);
+            data_type c[MG_COEFS];
+            c[MG_N] = -2 * w / (h + GRID(&L->size[0], i - 1, j));
+            c[MG_S] = -2 * w / (h + GRID(&L->size[0], i + 1, j));
+            c[MG_W] = -2 * h / (w + GRID(&L->size[1], i, j - 1));
+            c[MG_E] = -2 * h / (w + GRID(&L->size[1], i, j + 1));
+            c[MG_D] = -(c[MG_N] + c[MG_S] + c[MG_W] + c[MG_E]);
+            for (int k = 0; k < MG_COEFS; k++) {
+                GRID(&L->a[k], i, j) = c[k];
+            }
+        }
+    }
+}
+
+static inline void mg_coords(const mg_level_t *L, int size, int rank, int *coords) {
+    if (size == 1) {
+        coords[0] = coords[1] = 0;
+    } else {
+        MPI_Cart_coords(L->comm, rank, 2, coords);
+    }
+}
+
+// Builds the hierarchy below the sheet u (collective over dec->comm). h is
+// the sheet's halo exchange and tmp a second buffer with the same frame,
+// used by Jacobi smoothing. With u NULL, level 0 is a correction level over
+// dec's blocks instead, and h, tmp and kernel are not used.
+static inline void mg_setup(mg_t *mg, const decomp_t *dec, int nrows, int ncols,
+                            halo_t *h, grid_t *u, grid_t *tmp,
+                            const stencil_kernel_t *kernel, int smoother, int fmg) {
+    mg_level_t *L = &mg->level[0];
+    int k;
+
+    memset(mg, 0, sizeof *mg);
+    mg->smoother = smoother;
+    mg->fmg = fmg;
+    mg->kernel = kernel;
+    mg->tmp = tmp;
+    sor_init(&mg->gs, 1, dec->row0, dec->col0);
+
+    L->active = 1;
+    L->rows = dec->rows + 2;
+    L->cols = dec->cols + 2;
+    L->grows = nrows;
+    L->gcols = ncols;
+    L->row0 = dec->row0;
+    L->col0 = dec->col0;
+    L->comm = dec->comm;
+    L->up = dec->up;
+    L->down = dec->down;
+    L->left = dec->left;
+    L->right = dec->right;
+    if (u == NULL) {
+        mg_level_alloc(L);
+        mg_operator(L);
+    } else {
+        L->u = u;
+        L->h = h;
+        grid_alloc(&L->r, L->rows, L->cols, 1);
+        grid_fill(&L->r, 0);
+        grid_alloc(&mg->prev, L->rows, L->cols, 1);
+        grid_fill(&mg->prev, 0);
+    }
+
+    for (k = 0; k + 1 < MG_MAX_LEVELS; k++) {
+        L = &mg->level[k];
+        mg_level_t *C = &mg->level[k + 1];
+        int rank, size, thinnest = MG_MIN_BLOCK;
+        int mine[2] = { (L->rows - 1) / 2, (L->cols - 1) / 2 };
+        int off[2] = { 0, 0 };
+
+        if (L->grows <= MG_COARSEST || L->gcols <= MG_COARSEST) {
+            break;
+        }
+        MPI_Comm_rank(L->comm, &rank);
+        MPI_Comm_size(L->comm, &size);
+        int all[2 * size], offs[2 * size];
+        MPI_Allgather(mine, 2, MPI_INT, all, 2, MPI_INT, L->comm);
+
+        // Size of the next level and where each rank's block lies in it:
+        // ranks of one process row share their row count and vice versa
+        C->grows = C->gcols = 0;
+        for (int p = 0; p < size; p++) {
+            int pc[2];
+            mg_coords(L, size, p, pc);
+            offs[2 * p] = offs[2 * p + 1] = 0;
+            for (int q = 0; q < size; q++) {
+                int qc[2];
+                mg_coords(L, size, q, qc);
+                if (qc[1] == 0 && qc[0] < pc[0]) offs[2 * p] += all[2 * q];
+                if (qc[0] == 0 && qc[1] < pc[1]) offs[2 * p + 1] += all[2 * q + 1];
+            }
+            if (pc[1] == 0) C->grows += all[2 * p];
+            if (pc[0] == 0) C->gcols += all[2 * p + 1];
+            thinnest = all[2 * p] < thinnest ? all[2 * p] : thinnest;
+            thinnest = all[2 * p + 1] < thinnest ? all[2 * p + 1] : thinnest;
+        }
+        off[0] = offs[2 * rank];
+        off[1] = offs[2 * rank + 1];
+
+        if (size == 1 || thinnest >= MG_MIN_BLOCK) {
+            // Same ranks, same neighbours, half the cells
+            C->active = 1;
+            C->rows = mine[0] + 2;
+            C->cols = mine[1] + 2;
+            C->row0 = 1 + off[0];
+            C->col0 = 1 + off[1];
+            C->comm = L->comm;
+            C->up = L->up;
+            C->down = L->down;
+            C->left = L->left;
+            C->right = L->right;
+            mg_level_alloc(C);
+            mg_sizes(L, C->size);
+            halo_exchange(C->h, &C->size[0]);
+            halo_exchange(C->h, &C->size[1]);
+            mg_operator(C);
+            continue;
+        }
+
+        // Agglomerate: the next level lives on rank 0 alone
+        grid_t part[2];
+        L->gather = 1;
+        grid_alloc(&L->stage, mine[0] + 2, mine[1] + 2, 1);
+        grid_fill(&L->stage, 0);
+        for (int frame = 0; frame < 2; frame++) {
+            MPI_Type_vector(mine[0] + 2 * frame, mine[1] + 2 * frame, L->stage.ld, MPI_DATA_TYPE,
+                            &L->stage_type[frame]);
+            MPI_Type_commit(&L->stage_type[frame]);
+        }
+        if (rank == 0) {
+            C->active = 1;
+            C->rows = C->grows + 2;
+            C->cols = C->gcols + 2;
+            C->row0 = C->col0 = 1;
+            C->comm = MPI_COMM_SELF;
+            C->up = C->down = C->left = C->right = MPI_PROC_NULL;
+            mg_level_alloc(C);
+            for (int frame = 0; frame < 2; frame++) {
+                L->block[frame] = (MPI_Datatype*)malloc(sizeof(MPI_Datatype) * size);
+                for (int p = 0; p < size; p++) {
+                    int sizes[2] = { C->rows, C->f.ld };
+                    int sub[2] = { all[2 * p] + 2 * frame, all[2 * p + 1] + 2 * frame };
+                    int starts[2] = { 1 + offs[2 * p] - frame, 1 + offs[2 * p + 1] - frame };
+                    MPI_Type_create_subarray(2, sizes, sub, starts, MPI_ORDER_C, MPI_DATA_TYPE,
+                                             &L->block[frame][p]);
+                    MPI_Type_commit(&L->block[frame][p]);
+                }
+            }
+        }
+        for (int axis = 0; axis < 2; axis++) {
+            grid_alloc(&part[axis], mine[0] + 2, mine[1] + 2, 1);
+        }
+        mg_sizes(L, part);
+        for (int axis = 0; axis < 2; axis++) {
+            mg_move(L, &part[axis], &C->size[axis], 1);
+            grid_free(&part[axis]);
+        }
+        if (rank != 0) {
+            break;
+        }
+        mg_operator(C);
+    }
+    mg->nlevels = k + 1;
+}
+
+static inline void mg_free(mg_t *mg) {
+    for (int k = 0; k < mg->nlevels; k++) {
+        mg_level_t *L = &mg->level[k];
+        grid_free(&L->r);
+        if (L->ubuf.data != NULL) {
+            grid_free(&L->ubuf);
+            grid_free(&L->f);
+            for (int c = 0; c < MG_COEFS; c++) {
+                grid_free(&L->a[c]);
+            }
+            grid_free(&L->size[0]);
+            grid_free(&L->size[1]);
+            halo_free(&L->halo);
+        }
+        if (L->gather) {
+            int size;
+            MPI_Comm_size(L->comm, &size);
+            grid_free(&L->stage);
+            for (int frame = 0; frame < 2; frame++) {
+                MPI_Type_free(&L->stage_type[frame]);
+                for (int p = 0; L->block[frame] != NULL && p < size; p++) {
+                    MPI_Type_free(&L->block[frame][p]);
+                }
+                free(L->block[frame]);
+            }
+        }
+    }
+    if (mg->prev.data != NULL) {
+        grid_free(&mg->prev);
+    }
+}
+
+#endif
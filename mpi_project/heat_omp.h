@@ -0,0 +1,105 @@
+#ifndef HEAT_OMP_H
+#define HEAT_OMP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Thin OpenMP layer so the solvers build with or without -fopenmp.
+//
+// The simulation loops run inside one parallel region per rank (a
+// persistent pool: the threads are created once, not per sweep). Helpers
+// marked "team function" use orphaned work-sharing and must be called by
+// every thread of that region, or from serial code, where they behave as a
+// team of one. MPI is only ever called by the master thread
+// (MPI_THREAD_FUNNELED).
+
+#define OMP_PRAGMA(x) _Pragma(#x)
+
+#ifdef _OPENMP
+#include <omp.h>
+#define OMP(...) OMP_PRAGMA(omp __VA_ARGS__)
+#else
+#define OMP(...)
+static inline int omp_get_thread_num(void) { return 0; }
+static inline int omp_get_num_threads(void) { return 1; }
+static inline int omp_get_max_threads(void) { return 1; }
+static inline void omp_set_num_threads(int n) { (void)n; }
+#endif
+
+// Team function: returns the largest v over all threads of the team
+static inline double team_max(double v) {
+#ifdef _OPENMP
+    static double result;
+
+    OMP(barrier)
+    OMP(single)
+    result = v;
+    OMP(critical(team_max))
+    if (v > result) {
+        result = v;
+    }
+    OMP(barrier)
+    return result;
+#else
+    return v;
+#endif
+}
+
+// Team function: replaces v[0..n-1] (n <= TEAM_SUM_MAX) by their sums over
+// all threads of the team, added up in thread order so the result does
+// not depend on timing. scratch comes from team_sum_alloc, called before
+// the parallel region.
+#define TEAM_SUM_MAX 4
+#define TEAM_LINE 64  // bytes of a cache line
+
+// One thread's partial sums, on a cache line of their own
+typedef struct {
+    double v[TEAM_LINE / sizeof(double)];
+} team_slot_t;
+
+// Scratch of team_sum for teams of up to omp_get_max_threads() threads;
+// NULL if out of memory
+static inline team_slot_t *team_sum_alloc(void) {
+    void *p = NULL;
+
+    if (posix_memalign(&p, TEAM_LINE, sizeof(team_slot_t) * omp_get_max_threads()) != 0) {
+        fprintf(stderr, "Failed to allocate the scratch of %d threads\n", omp_get_max_threads());
+        return NULL;
+    }
+    return (team_slot_t *)p;
+}
+
+static inline void team_sum(double *v, int n, team_slot_t *scratch) {
+#ifdef _OPENMP
+    int t = omp_get_thread_num(), nt = omp_get_num_threads();
+
+    OMP(barrier)
+    for (int k = 0; k < n; k++) {
+        scratch[t].v[k] = v[k];
+    }
+    OMP(barrier)
+    for (int k = 0; k < n; k++) {
+        v[k] = 0;
+        for (int p = 0; p < nt; p++) {
+            v[k] += scratch[p].v[k];
+        }
+    }
+#else
+    (void)v;
+    (void)n;
+    (void)scratch;
+#endif
+}
+
+// The calling thread's share [*a, *b) of [lo, hi), split on multiples of
+// align so threads never write to the same cache line
+static inline void team_split(int lo, int hi, int align, int *a, int *b) {
+    int nt = omp_get_num_threads(), t = omp_get_thread_num();
+    int chunks = (hi - lo + align - 1) / align;
+    int first = chunks * t / nt, last = chunks * (t + 1) / nt;
+
+    *a = lo + first * align < hi ? lo + first * align : hi;
+    *b = lo + last * align < hi ? lo + last * align : hi;
+}
+
+#endif
@@ -0,0 +1,307 @@
+#ifndef HEAT_OPTIONS_H
+#define HEAT_OPTIONS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Ways of reaching the steady state
+enum { SOLVER_JACOBI, SOLVER_SOR, SOLVER_MG, SOLVER_CG, SOLVER_PIPECG };
+static const char *const solver_names[] = { "jacobi", "sor", "mg", "cg", "pipecg" };
+
+// Time integrators of the time-stepping solver
+enum { INTEGRATOR_EXPLICIT, INTEGRATOR_ADI, INTEGRATOR_RKL2 };
+static const char *const integrator_names[] = { "explicit", "adi", "rkl2" };
+
+// Preconditioners of the CG solvers
+static const char *const precond_names[] = { "none", "bjacobi", "mg" };
+
+// Size of the problem and when to stop, shared by the 2D and 3D drivers
+typedef struct {
+    int n;           // cells along each side of the sheet or cube
+    double alpha;    // thermal diffusivity of the time steps
+    double epsilon;  // stop once no cell changes by more than this (relative)
+    int max_iter;    // stop after this many iterations even if not converged,
+                     // 0 for no limit
+} problem_t;
+
+static inline void problem_usage(const problem_t *defaults) {
+    fprintf(stderr,
+            "  --size N           N cells along each side (default %d)\n"
+            "  --alpha A          thermal diffusivity (default %g)\n"
+            "  --epsilon E        convergence threshold on the largest relative\n"
+            "                     change of a cell (default %g)\n"
+            "  --max-iter K       give up after K iterations (default: no limit)\n"
+            "  --config FILE      read options from FILE, one per line without the\n"
+            "                     dashes (\"size 200\" or \"solver = mg\"), '#' comments\n",
+            defaults->n, defaults->alpha, defaults->epsilon);
+}
+
+// Takes the problem option at argv[*i] and its argument; returns 0 if
+// argv[*i] is not one of them or the argument is missing or out of range
+static inline int problem_option(int argc, char **argv, int *i, problem_t *p) {
+    const char *arg = argv[*i], *val = *i + 1 < argc ? argv[*i + 1] : NULL;
+
+    if (val == NULL) {
+        return 0;
+    }
+    if (strcmp(arg, "--size") == 0 && atoi(val) > 0) {
+        p->n = atoi(val);
+    } else if (strcmp(arg, "--alpha") == 0 && atof(val) > 0) {
+        p->alpha = atof(val);
+    } else if (strcmp(arg, "--epsilon") == 0 && atof(val) > 0) {
+        p->epsilon = atof(val);
+    } else if (strcmp(arg, "--max-iter") == 0 && atoi(val) > 0) {
+        p->max_iter = atoi(val);
+    } else {
+        return 0;
+    }
+    (*i)++;
+    return 1;
+}
+
+static inline void options_push(char ***v, int *n, int *cap, char *arg) {
+    if (*n + 1 >= *cap) {
+        *cap *= 2;
+        *v = (char **)realloc(*v, *cap * sizeof(char *));
+    }
+    (*v)[(*n)++] = arg;
+    (*v)[*n] = NULL;
+}
+
+// Replaces every "--config FILE" of the command line by the options in
+// FILE. Options keep their order, so whatever follows --config on the
+// command line overrides the file. The new vector is never freed, because
+// the parsed options point into it. Returns -1 (after printing on rank 0)
+// if a file cannot be read.
+static inline int options_expand(int *argc, char ***argv, int rank) {
+    int n = 0, cap = *argc + 1;
+    char **out = (char **)malloc(cap * sizeof(char *));
+
+    for (int i = 0; i < *argc; i++) {
+        if (strcmp((*argv)[i], "--config") != 0 || i + 1 >= *argc) {
+            options_push(&out, &n, &cap, (*argv)[i]);
+            continue;
+        }
+        FILE *f = fopen((*argv)[++i], "r");
+        if (f == NULL) {
+            if (rank == 0) {
+                fprintf(stderr, "Cannot read config file '%s'\n", (*argv)[i]);
+            }
+            free(out);
+            return -1;
+        }
+        char line[256];
+        while (fgets(line, sizeof(line), f) != NULL) {
+            char *comment = strchr(line, '#');
+            if (comment != NULL) {
+                *comment = '\0';
+            }
+            char *key = strtok(line, " \t\r\n=");
+            char *value = strtok(NULL, " \t\r\n=");
+            if (key == NULL) {
+                continue;
+            }
+            char *opt = (char *)malloc(strlen(key) + 3);
+            sprintf(opt, "--%s", key);
+            options_push(&out, &n, &cap, opt);
+            if (value != NULL) {
+                options_push(&out, &n, &cap, strdup(value));
+            }
+        }
+        fclose(f);
+    }
+    *argc = n;
+    *argv = out;
+    return 0;
+}
+
+// Run-time settings of the 2D solvers
+typedef struct {
+    problem_t problem;   // size, diffusivity and stopping rule
+    int alpha_given;     // --alpha and --epsilon were on the command line
+    int epsilon_given;   // (a restart keeps the checkpoint's otherwise)
+    int visualize;       // open an OpenGL window per rank
+    const char *kernel;  // stencil kernel name, NULL picks the best one
+    const char *tile;    // "auto", "off" or ROWSxCOLS cache block
+    int halo_depth;      // steps advanced per halo exchange
+    int stats;           // print communication statistics at the end
+    int timers;          // print the per-phase timers at the end
+    int check_every;     // 0: blocking check every step, > 0: non-blocking
+                         // check every that many steps, < 0: adaptive
+    int solver;          // SOLVER_*
+    double omega;        // SOR relaxation factor, 0 estimates it
+    int smoother;        // multigrid smoother: 0 Jacobi, 1 red-black Gauss-Seidel
+    int fmg;             // start multigrid with a full multigrid cycle
+    int precond;         // CG preconditioner, index into precond_names
+    int integrator;      // INTEGRATOR_*
+    const char *output;  // binary field file written instead of printing, or NULL
+    int output_every;    // also write the field every that many iterations
+    const char *checkpoint;  // checkpoint file, or NULL
+    int checkpoint_every;    // checkpoint every that many iterations (and at the end)
+    const char *restart;     // checkpoint to continue from, or NULL
+    const char *series;      // snapshot series file, or NULL
+    int series_every;        // iterations between its frames
+    int compress;            // compress checkpoints and snapshots losslessly
+    double lossy;            // error bound of compressed fields and snapshots, 0 for none
+} options_t;
+
+static inline void options_usage(const char *prog, const problem_t *defaults) {
+    fprintf(stderr, "Usage: %s [options]\n", prog);
+    problem_usage(defaults);
+    fprintf(stderr,
+            "  --visualize        show the sheet while it is computed\n"
+            "  --kernel NAME      stencil kernel: auto, scalar, sse, avx2, avx512\n"
+            "  --tile SPEC        cache blocking: auto (from cache sizes), off, or ROWSxCOLS\n"
+            "  --halo-depth K     exchange K-wide halos and advance K steps per exchange\n"
+            "  --stats            report how much halo communication was hidden\n"
+            "  --timers           report where each rank spent its time (see heat_timer.h)\n"
+            "  --check-every K    test convergence every K steps without blocking\n"
+            "                     (auto adapts K); stops up to K steps late\n"
+            "  --solver NAME      jacobi (time steps, default), sor (red-black SOR)\n"
+            "                     mg (geometric multigrid V-cycles), cg (conjugate\n"
+            "                     gradients) or pipecg (pipelined conjugate gradients)\n"
+            "  --omega W          SOR relaxation factor in (0, 2), or auto (default)\n"
+            "  --smoother NAME    multigrid smoother: jacobi or rbgs (default)\n"
+            "  --cycle NAME       multigrid cycle: v (default) or fmg (full multigrid first)\n"
+            "  --precond NAME     CG preconditioner: none (default), bjacobi (block Jacobi)\n"
+            "                     or mg (one V-cycle)\n"
+            "  --integrator NAME  time steps: explicit (default), adi (implicit\n"
+            "                     Peaceman-Rachford ADI, any --alpha) or rkl2\n"
+            "                     (Runge-Kutta-Legendre super steps, --alpha up to 65599)\n"
+            "  --output FILE      write the final field to FILE in binary (see heat_io.h)\n"
+            "                     instead of printing it\n"
+            "  --output-every K   also write the field every K iterations, to FILE.<iteration>\n"
+            "  --checkpoint FILE  save the solver state to FILE at the end of the run\n"
+            "  --checkpoint-every K  and every K iterations, in the background\n"
+            "  --restart FILE     continue from checkpoint FILE, on any number of ranks\n"
+            "  --series FILE      record the evolution in snapshot series FILE (see heat_series.h)\n"
+            "  --series-every K   one frame every K iterations (default 100)\n"
+            "  --compress         compress checkpoints and snapshot frames losslessly\n"
+            "                     (see heat_compress.h)\n"
+            "  --lossy E          compress field files and snapshot frames with every\n"
+            "                     value within E of the exact one (checkpoints stay exact)\n");
+}
+
+static inline int options_bad(char **argv, int i, int rank, const problem_t *defaults) {
+    if (rank == 0) {
+        fprintf(stderr, "Unknown or incomplete option '%s'\n", argv[i]);
+        options_usage(argv[0], defaults);
+    }
+    return -1;
+}
+
+// Fills opt from the command line, starting from the driver's problem
+// defaults; returns -1 (after printing the usage on rank 0) if an option is
+// unknown or misses its argument
+static inline int parse_options(int argc, char **argv, int rank, const problem_t *defaults,
+                                options_t *opt) {
+    opt->problem = *defaults;
+    opt->alpha_given = 0;
+    opt->epsilon_given = 0;
+    opt->visualize = 0;
+    opt->kernel = NULL;
+    opt->tile = "auto";
+    opt->halo_depth = 1;
+    opt->stats = 0;
+    opt->timers = 0;
+    opt->check_every = 0;
+    opt->solver = SOLVER_JACOBI;
+    opt->omega = 0;
+    opt->smoother = 1;
+    opt->fmg = 0;
+    opt->precond = 0;
+    opt->integrator = INTEGRATOR_EXPLICIT;
+    opt->output = NULL;
+    opt->output_every = 0;
+    opt->checkpoint = NULL;
+    opt->checkpoint_every = 0;
+    opt->restart = NULL;
+    opt->series = NULL;
+    opt->series_every = 100;
+    opt->compress = 0;
+    opt->lossy = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--visualize") == 0) {
+            opt->visualize = 1;
+        } else if (strcmp(argv[i], "--kernel") == 0 && i + 1 < argc) {
+            opt->kernel = argv[++i];
+        } else if (strcmp(argv[i], "--tile") == 0 && i + 1 < argc) {
+            opt->tile = argv[++i];
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            opt->stats = 1;
+        } else if (strcmp(argv[i], "--timers") == 0) {
+            opt->timers = 1;
+        } else if (strcmp(argv[i], "--halo-depth") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            opt->halo_depth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--check-every") == 0 && i + 1 < argc &&
+                   (strcmp(argv[i + 1], "auto") == 0 || atoi(argv[i + 1]) > 0)) {
+            i++;
+            opt->check_every = strcmp(argv[i], "auto") == 0 ? -1 : atoi(argv[i]);
+        } else if (strcmp(argv[i], "--solver") == 0 && i + 1 < argc) {
+            int s = sizeof(solver_names) / sizeof(solver_names[0]);
+            while (--s >= 0 && strcmp(argv[i + 1], solver_names[s]) != 0) {
+            }
+            if (s < 0) {
+                return options_bad(argv, i, rank, defaults);
+            }
+            opt->solver = s;
+            i++;
+        } else if (strcmp(argv[i], "--precond") == 0 && i + 1 < argc) {
+            int s = sizeof(precond_names) / sizeof(precond_names[0]);
+            while (--s >= 0 && strcmp(argv[i + 1], precond_names[s]) != 0) {
+            }
+            if (s < 0) {
+                return options_bad(argv, i, rank, defaults);
+            }
+            opt->precond = s;
+            i++;
+        } else if (strcmp(argv[i], "--integrator") == 0 && i + 1 < argc) {
+            int s = sizeof(integrator_names) / sizeof(integrator_names[0]);
+            while (--s >= 0 && strcmp(argv[i + 1], integrator_names[s]) != 0) {
+            }
+            if (s < 0) {
+                return options_bad(argv, i, rank, defaults);
+            }
+            opt->integrator = s;
+            i++;
+        } else if (strcmp(argv[i], "--smoother") == 0 && i + 1 < argc &&
+                   (strcmp(argv[i + 1], "jacobi") == 0 || strcmp(argv[i + 1], "rbgs") == 0)) {
+            opt->smoother = strcmp(argv[++i], "rbgs") == 0;
+        } else if (strcmp(argv[i], "--cycle") == 0 && i + 1 < argc &&
+                   (strcmp(argv[i + 1], "v") == 0 || strcmp(argv[i + 1], "fmg") == 0)) {
+            opt->fmg = strcmp(argv[++i], "fmg") == 0;
+        } else if (strcmp(argv[i], "--omega") == 0 && i + 1 < argc &&
+                   (strcmp(argv[i + 1], "auto") == 0 || (atof(argv[i + 1]) > 0 && atof(argv[i + 1]) < 2))) {
+            i++;
+            opt->omega = strcmp(argv[i], "auto") == 0 ? 0 : atof(argv[i]);
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            opt->output = argv[++i];
+        } else if (strcmp(argv[i], "--output-every") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            opt->output_every = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            opt->checkpoint = argv[++i];
+        } else if (strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            opt->checkpoint_every = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--restart") == 0 && i + 1 < argc) {
+            opt->restart = argv[++i];
+        } else if (strcmp(argv[i], "--series") == 0 && i + 1 < argc) {
+            opt->series = argv[++i];
+        } else if (strcmp(argv[i], "--series-every") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            opt->series_every = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            opt->compress = 1;
+        } else if (strcmp(argv[i], "--lossy") == 0 && i + 1 < argc && atof(argv[i + 1]) > 0) {
+            opt->lossy = atof(argv[++i]);
+        } else if (!problem_option(argc, argv, &i, &opt->problem)) {
+            return options_bad(argv, i, rank, defaults);
+        } else {
+            opt->alpha_given |= strcmp(argv[i - 1], "--alpha") == 0;
+            opt->epsilon_given |= strcmp(argv[i - 1], "--epsilon") == 0;
+        }
+    }
+    return 0;
+}
+
+#endif
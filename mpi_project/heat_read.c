@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <math.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "heat_io.h"
+#include "heat_series.h"
+
+// Reader for the files the solvers write: binary fields and checkpoints
+// (--output, --checkpoint) and snapshot series (--series). It maps each
+// file and reads only what it is asked for. Compressed fields and frames
+// (--compress) are decoded whole, in parallel, before anything is shown.
+//
+// A field is summarized in one parallel pass: header, and the smallest,
+// largest and mean value of the cells inside the frame. For a series the
+// header and the index are listed, and a frame is only read when one is
+// picked with --iteration (the last one at or before that iteration), or
+// with --print or --box alone (the last frame).
+// --print prints every cell of the field or frame the way the solvers print
+// the final sheet (3D fields plane by plane), so text output of old runs
+// can be compared. --box prints only the cells of rows I0 to I1-1 and
+// columns J0 to J1-1, frame included, touching only their pages. In 3D the
+// ranges are of planes, rows and columns, slowest axis first as in the file.
+//
+// Usage: heat_read [--print] [--iteration K] [--box I0:I1,J0:J1[,K0:K1]] FILE ...
+
+// One field in memory, whatever file it came from
+typedef struct {
+    const void *values;
+    uint32_t value_bytes, ndims;
+    uint64_t dims[3];
+} field_t;
+
+static double value(const field_t *f, uint64_t i, uint64_t j, uint64_t k) {
+    uint64_t at = (i * f->dims[1] + j) * f->dims[2] + k;
+
+    return f->value_bytes == 4 ? ((const float *)f->values)[at] : ((const double *)f->values)[at];
+}
+
+static void print_dims(const field_t *f) {
+    for (uint32_t a = 0; a < f->ndims; a++) {
+        printf(a == 0 ? "%llu" : "x%llu", (unsigned long long)f->dims[a]);
+    }
+    printf(" %s values (frame included)", f->value_bytes == 4 ? "float" : "double");
+}
+
+static void summarize(const field_t *f) {
+    uint64_t d0 = f->dims[0], d1 = f->dims[1], d2 = f->dims[2];
+    uint64_t i0 = d0 > 2, j0 = d1 > 2, k0 = f->ndims == 3 && d2 > 2;
+    double lo = INFINITY, hi = -INFINITY, sum = 0;
+
+    OMP(parallel for reduction(min:lo) reduction(max:hi) reduction(+:sum) schedule(static))
+    for (uint64_t i = i0; i < d0 - i0; i++) {
+        for (uint64_t j = j0; j < d1 - j0; j++) {
+            for (uint64_t k = k0; k < d2 - k0; k++) {
+                double v = value(f, i, j, k);
+                lo = v < lo ? v : lo;
+                hi = v > hi ? v : hi;
+                sum += v;
+            }
+        }
+    }
+    uint64_t inner = (d0 - 2 * i0) * (d1 - 2 * j0) * (d2 - 2 * k0);
+    printf("  inside the frame: min %g, max %g, mean %g\n", lo, hi, inner ? sum / inner : 0.0);
+}
+
+// Cells [lo, hi) of every axis; 2D fields are printed as one plane
+static void print_box(const field_t *f, const uint64_t lo[3], const uint64_t hi[3], int text) {
+    uint64_t p0 = f->ndims == 3 ? lo[0] : 0, p1 = f->ndims == 3 ? hi[0] : 1;
+    uint64_t r0 = f->ndims == 3 ? lo[1] : lo[0], r1 = f->ndims == 3 ? hi[1] : hi[0];
+    uint64_t c0 = f->ndims == 3 ? lo[2] : lo[1], c1 = f->ndims == 3 ? hi[2] : hi[1];
+
+    for (uint64_t p = p0; p < p1; p++) {
+        if (p > p0) {
+            putchar('\n');
+        }
+        for (uint64_t i = r0; i < r1; i++) {
+            for (uint64_t j = c0; j < c1; j++) {
+                double v = f->ndims == 3 ? value(f, p, i, j) : value(f, i, j, 0);
+                if (text) {
+                    printf(" %d ", (int)v);
+                } else {
+                    printf(j > c0 ? " %g" : "%g", v);
+                }
+            }
+            putchar('\n');
+        }
+    }
+}
+
+// Parses I0:I1,J0:J1[,K0:K1] against the field's dimensions
+static int parse_box(const char *spec, const field_t *f, uint64_t lo[3], uint64_t hi[3]) {
+    const char *p = spec;
+
+    for (uint32_t a = 0; a < f->ndims; a++) {
+        char *end;
+        lo[a] = strtoull(p, &end, 10);
+        if (*end != ':') {
+            return -1;
+        }
+        hi[a] = strtoull(end + 1, &end, 10);
+        if (lo[a] >= hi[a] || hi[a] > f->dims[a] || *end != (a + 1 < f->ndims ? ',' : '\0')) {
+            return -1;
+        }
+        p = end + 1;
+    }
+    return 0;
+}
+
+// What to show of the one field a file holds or was picked from it: the
+// box alone, or the summary and, with print, every cell
+static int show(const char *path, const field_t *f, int print, const char *box) {
+    uint64_t lo[3] = { 0, 0, 0 }, hi[3];
+
+    if (box != NULL) {
+        if (parse_box(box, f, lo, hi) != 0) {
+            fprintf(stderr, "Box '%s' is not inside the %u-dimensional field of '%s'\n", box, f->ndims, path);
+            return -1;
+        }
+        print_box(f, lo, hi, 0);
+        return 0;
+    }
+    summarize(f);
+    if (print) {
+        memcpy(hi, f->dims, sizeof(hi));
+        print_box(f, lo, hi, 1);
+    }
+    return 0;
+}
+
+// Decodes a compressed section of the field f describes into a buffer of
+// its own and points f at it; returns the buffer, to be freed
+static void *decode(field_t *f, const void *section, uint64_t bytes) {
+    uint64_t cells = f->dims[0] * f->dims[1] * f->dims[2];
+    data_type *out = (data_type *)malloc(sizeof(data_type) * cells);
+
+    OMP(parallel)
+    compress_decode_section(section, out, f->dims[1]);
+    printf("  compressed to %llu bytes, %.2f times smaller", (unsigned long long)bytes,
+           (double)(sizeof(data_type) * cells) / (double)bytes);
+    double bound = compress_section_bound(section);
+    if (bound > 0) {
+        printf(", every value within %g", bound);
+    }
+    printf("\n");
+    f->values = out;
+    return out;
+}
+
+static int read_field(const char *path, int print, const char *box) {
+    io_map_t m;
+
+    if (io_open(&m, path) != 0) {
+        return -1;
+    }
+    const io_header_t *h = m.header;
+    field_t f = { m.values, h->value_bytes, h->ndims, { h->dims[0], h->dims[1], h->dims[2] } };
+    printf("%s: ", path);
+    print_dims(&f);
+    printf(", iteration %lld, alpha %g, epsilon %g, time %g\n", (long long)h->iteration, h->alpha,
+           h->epsilon, h->time);
+    void *buf = h->compressed ? decode(&f, m.values, h->field_bytes) : NULL;
+    int err = show(path, &f, print, box);
+    free(buf);
+    io_close(&m);
+    return err;
+}
+
+static int read_series(const char *path, int print, const char *box, long long iteration, int pick) {
+    series_map_t m;
+
+    if (series_open(&m, path) != 0) {
+        return -1;
+    }
+    const series_header_t *h = m.header;
+    field_t f = { NULL, h->value_bytes, h->ndims, { h->dims[0], h->dims[1], h->dims[2] } };
+    printf("%s: series of %llu frames of ", path, (unsigned long long)m.frames);
+    print_dims(&f);
+    printf(", alpha %g, epsilon %g", h->alpha, h->epsilon);
+    if (h->compressed) {
+        printf(h->error_bound > 0 ? ", compressed within %g" : ", compressed", h->error_bound);
+    }
+    printf("%s\n", m.rebuilt != NULL ? " (not closed, index rebuilt)" : "");
+
+    int err = 0;
+    if (!pick) {
+        for (uint64_t k = 0; k < m.frames; k++) {
+            printf("  frame %llu: iteration %lld, time %g\n", (unsigned long long)k,
+                   (long long)m.index[k].iteration, m.index[k].time);
+        }
+    } else if (m.frames > 0) {
+        int64_t k = series_find(&m, iteration);
+        printf("  frame %lld: iteration %lld, time %g\n", (long long)k, (long long)m.index[k].iteration,
+               m.index[k].time);
+        f.values = series_values(&m, k);
+        const series_frame_t *frame = (const series_frame_t *)(m.base + m.index[k].offset);
+        void *buf = h->compressed ? decode(&f, f.values, frame->bytes) : NULL;
+        err = show(path, &f, print, box);
+        free(buf);
+    }
+    series_unmap(&m);
+    return err;
+}
+
+int main(int argc, char **argv) {
+    int print = 0, pick = 0, status = 0, files = 0;
+    long long iteration = LLONG_MAX;
+    const char *box = NULL;
+
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "--print") == 0) {
+            print = 1;
+            continue;
+        }
+        if (strcmp(argv[a], "--iteration") == 0 && a + 1 < argc) {
+            iteration = atoll(argv[++a]);
+            pick = 1;
+            continue;
+        }
+        if (strcmp(argv[a], "--box") == 0 && a + 1 < argc) {
+            box = argv[++a];
+            continue;
+        }
+
+        // The magic tells a series from a field
+        char magic[8] = { 0 };
+        FILE *in = fopen(argv[a], "rb");
+        if (in != NULL) {
+            if (fread(magic, 1, sizeof(magic), in) != sizeof(magic)) {
+                magic[0] = '\0';
+            }
+            fclose(in);
+        }
+        files++;
+        int err = memcmp(magic, SERIES_MAGIC, sizeof(SERIES_MAGIC)) == 0
+                  ? read_series(argv[a], print, box, iteration, pick || print || box != NULL)
+                  : read_field(argv[a], print, box);
+        status |= err != 0;
+    }
+    if (files == 0) {
+        fprintf(stderr, "Usage: %s [--print] [--iteration K] [--box I0:I1,J0:J1[,K0:K1]] FILE ...\n",
+                argv[0]);
+        return 1;
+    }
+    return status;
+}
@@ -0,0 +1,164 @@
+#ifndef HEAT_RKL_H
+#define HEAT_RKL_H
+
+#include <math.h>
+#include <stdlib.h>
+#include "heat_grid.h"
+#include "heat_halo.h"
+#include "heat_stencil.h"
+
+// Second-order Runge-Kutta-Legendre super time steps (RKL2, Meyer, Balsara
+// and Aslam 2014). One step of size tau (in the units of alpha) is s
+// stages, each one application of the explicit stencil kernel after one
+// halo exchange. The stages are combined with the recurrence of the
+// shifted Legendre polynomials, which keeps the step stable up to
+//
+//   tau <= 0.25 (s^2 + s - 2) / 4
+//
+// so s stages cover about s^2 / 4 explicit steps. The number of stages is
+// the smallest s >= 2 that makes the requested tau stable.
+//
+// With K(Y, c) = Y + c * laplacian(Y), what the kernel computes, and
+// dY0 = Y1 - Y0 = mu~1 tau L(Y0), stage j >= 2 is
+//
+//   Yj = mu_j K(Yj-1, mu~j tau / mu_j) + nu_j Yj-2 + (1 - mu_j - nu_j) Y0
+//        + (gamma~j / mu~1) dY0
+
+#define RKL_MAX_STAGES 1024
+#define RKL_MAX_TAU (0.25 * ((double)RKL_MAX_STAGES * RKL_MAX_STAGES + RKL_MAX_STAGES - 2) / 4)
+
+typedef struct {
+    const stencil_kernel_t *kernel;
+    halo_t *h;
+    int stages;
+    double tau;
+    double mu[RKL_MAX_STAGES + 1], nu[RKL_MAX_STAGES + 1];
+    double c[RKL_MAX_STAGES + 1];   // kernel factor mu~j tau / mu_j
+    double g[RKL_MAX_STAGES + 1];   // gamma~j / mu~1
+    grid_t y0, dy0;                 // start of the step and its first change
+    grid_t slot[3];                 // Yj in slot j % 3
+} rkl_t;
+
+// Smallest number of stages that is stable for a step of tau, which must
+// be at most RKL_MAX_TAU
+static inline int rkl_stages(double tau) {
+    int s = 2;
+
+    while (s < RKL_MAX_STAGES && 0.25 * (s * s + s - 2) / 4 < tau) {
+        s++;
+    }
+    return s;
+}
+
+// Applies the kernel to y (whose halo it exchanges first) into out,
+// overlapping the exchange with the cells away from the halo. Team function.
+static inline void rkl_apply(rkl_t *r, grid_t *y, grid_t *out, data_type c) {
+    int rows = y->rows, cols = y->cols;
+
+    halo_start(r->h, y);
+    stencil_apply(r->kernel, y, out, 2, rows - 2, 2, cols - 2, c);
+    halo_finish(r->h, y);
+    stencil_ring(r->kernel, y, out, 1, rows - 1, 1, cols - 1, c);
+}
+
+// One super step of u, in place. Team function; returns the largest
+// relative change of the step over the team.
+static inline data_type rkl_step(rkl_t *r, grid_t *u) {
+    grid_t *y0 = &r->y0, *dy0 = &r->dy0;
+    grid_t *prev2 = y0, *prev1 = &r->slot[1], *next;
+    int rows = u->rows, cols = u->cols;
+    data_type max_eps = 0;
+
+    grid_copy(u, y0);
+    rkl_apply(r, y0, prev1, (data_type)r->c[1]);
+    OMP(for schedule(static))
+    for (int i = 1; i < rows - 1; i++) {
+        for (int j = 1; j < cols - 1; j++) {
+            GRID(dy0, i, j) = GRID(prev1, i, j) - GRID(y0, i, j);
+        }
+    }
+
+    for (int s = 2; s <= r->stages; s++) {
+        // Yj lives in slot j % 3, clear of Yj-1 and Yj-2
+        next = &r->slot[s % 3];
+        rkl_apply(r, prev1, next, (data_type)r->c[s]);
+        const data_type mu = (data_type)r->mu[s], nu = (data_type)r->nu[s];
+        const data_type rest = (data_type)(1 - r->mu[s] - r->nu[s]), g = (data_type)r->g[s];
+        OMP(for schedule(static))
+        for (int i = 1; i < rows - 1; i++) {
+            data_type *y = GRID_ROW(next, i);
+            const data_type *y2 = GRID_ROW(prev2, i), *a = GRID_ROW(y0, i), *d = GRID_ROW(dy0, i);
+            for (int j = 1; j < cols - 1; j++) {
+                y[j] = mu * y[j] + nu * y2[j] + rest * a[j] + g * d[j];
+            }
+        }
+        prev2 = prev1;
+        prev1 = next;
+    }
+
+    OMP(for schedule(static))
+    for (int i = 1; i < rows - 1; i++) {
+        const data_type *y = GRID_ROW(prev1, i);
+        data_type *out = GRID_ROW(u, i);
+        for (int j = 1; j < cols - 1; j++) {
+            data_type delta = y[j] - out[j];
+            data_type eps = fabsf(delta / (y[j] == 0 ? STENCIL_ZERO_GUARD : y[j]));
+            out[j] = y[j];
+            if (eps > max_eps) {
+                max_eps = eps;
+            } else if (isnan(eps)) {
+                // Kept as infinity, which the maxima over threads and ranks keep
+                max_eps = INFINITY;
+            }
+        }
+    }
+    return team_max(max_eps);
+}
+
+// Serial from here on
+
+// u is the sheet's block with its one-cell frame, h its halo exchange and
+// tau the step, in the units of alpha
+static inline void rkl_init(rkl_t *r, const stencil_kernel_t *kernel, halo_t *h, const grid_t *u,
+                            double tau) {
+    int s = rkl_stages(tau);
+    double w1 = 4.0 / (s * s + s - 2);
+    double b[RKL_MAX_STAGES + 1];
+
+    r->kernel = kernel;
+    r->h = h;
+    r->stages = s;
+    r->tau = tau;
+    for (int j = 0; j <= s; j++) {
+        b[j] = j <= 2 ? 1.0 / 3 : (j * j + j - 2) / (2.0 * j * (j + 1));
+    }
+    double mut1 = b[1] * w1;
+    r->c[1] = mut1 * tau;
+    for (int j = 2; j <= s; j++) {
+        r->mu[j] = (2.0 * j - 1) / j * b[j] / b[j - 1];
+        r->nu[j] = -(j - 1.0) / j * b[j] / b[j - 2];
+        double mut = r->mu[j] * w1;
+        r->c[j] = mut * tau / r->mu[j];
+        r->g[j] = -(1 - b[j - 1]) * mut / mut1;
+    }
+
+    // The physical frames of all stages hold the boundary values
+    grid_alloc(&r->y0, u->rows, u->cols, 1);
+    grid_alloc(&r->dy0, u->rows, u->cols, 1);
+    grid_copy(u, &r->y0);
+    grid_fill(&r->dy0, 0);
+    for (int k = 0; k < 3; k++) {
+        grid_alloc(&r->slot[k], u->rows, u->cols, 1);
+        grid_copy(u, &r->slot[k]);
+    }
+}
+
+static inline void rkl_free(rkl_t *r) {
+    grid_free(&r->y0);
+    grid_free(&r->dy0);
+    for (int k = 0; k < 3; k++) {
+        grid_free(&r->slot[k]);
+    }
+}
+
+#endif
@@ -0,0 +1,426 @@
+#ifndef HEAT_SERIES_H
+#define HEAT_SERIES_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <mpi.h>
+#include "heat_grid.h"
+#include "heat_decomp.h"
+#include "heat_compress.h"
+
+// Snapshot series: the evolution of a 2D or 3D field in one file, to be
+// read back through mmap.
+//
+//   header | frame 0 | frame 1 | ... | index
+//
+// The header takes the first SERIES_ALIGN bytes. Every frame is a
+// SERIES_FRAME_HEADER header (iteration, time) followed by the whole field,
+// frame included, as row-major values. Frames are padded to a multiple of
+// SERIES_ALIGN, so each one starts on a page and frame k is at
+// SERIES_ALIGN + k * frame_bytes. The index, one entry per frame with its
+// iteration and offset, is appended when the series is closed and the
+// header then points at it. A series whose run died before that has no
+// index; readers rebuild it from the frame headers, which sit at that fixed
+// stride (see below for compressed series), without touching the values.
+//
+// The ranks append frames together: each one writes its share of the
+// field through a subarray file view, straight from its block.
+//
+// A compressed series of a sheet stores every frame's field as a
+// compressed section (heat_compress.h) instead, lossless or error-bounded,
+// which the whole team packs before the frame is written. Its frames vary
+// in size, frame_bytes is 0, and each frame header gives the bytes of its
+// section; frames still start on a page.
+
+#define SERIES_MAGIC "HEATSER"
+#define SERIES_FRAME_MAGIC "HEATFRM"
+#define SERIES_VERSION 1
+#define SERIES_ALIGN 4096
+#define SERIES_FRAME_HEADER 64
+#define SERIES_BYTE_ORDER 0x01020304u
+
+typedef struct {
+    char magic[8];          // SERIES_MAGIC
+    uint32_t version;       // SERIES_VERSION
+    uint32_t byte_order;    // SERIES_BYTE_ORDER as the writer stores it
+    uint32_t value_bytes;   // 4 for float values, 8 for double
+    uint32_t ndims;         // 2 for a sheet, 3 for a cube
+    uint64_t dims[3];       // cells along each axis, frame included, slowest
+                            // first; 1 past ndims
+    double alpha;           // diffusivity
+    double epsilon;         // convergence threshold
+    uint64_t frame_bytes;   // stride of the frames, 0 if compressed
+    uint64_t frames;        // in the index; 0 until the series is closed
+    uint64_t index_offset;  // of the index; 0 until the series is closed
+    uint32_t compressed;    // 1 if the fields are compressed sections
+    uint32_t reserved0;     // zero
+    double error_bound;     // largest error of a value, 0 if lossless
+    char reserved[24];      // zero
+} series_header_t;
+
+typedef struct {
+    char magic[8];          // SERIES_FRAME_MAGIC
+    int64_t iteration;      // iterations done
+    double time;            // simulated time in h^2 / D, 0 for steady solvers
+    uint64_t bytes;         // of the field as stored
+    char reserved[32];
+} series_frame_t;
+
+typedef struct {
+    int64_t iteration;
+    double time;
+    uint64_t offset;        // of the frame's header
+} series_entry_t;
+
+typedef char series_header_size_check[sizeof(series_header_t) == 128 ? 1 : -1];
+typedef char series_frame_size_check[sizeof(series_frame_t) == SERIES_FRAME_HEADER ? 1 : -1];
+
+static inline uint64_t series_cells(const series_header_t *h) {
+    return h->dims[0] * h->dims[1] * h->dims[2];
+}
+
+// Bytes from a frame of stored bytes to the next one
+static inline uint64_t series_stride(uint64_t bytes) {
+    return (SERIES_FRAME_HEADER + bytes + SERIES_ALIGN - 1) / SERIES_ALIGN * SERIES_ALIGN;
+}
+
+// Writing (collective unless noted)
+
+typedef struct {
+    MPI_Comm comm;
+    int rank;
+    MPI_File f;
+    MPI_Datatype view;      // this rank's share of the field
+    series_header_t header;
+    uint64_t next;          // offset of the next frame
+    uint64_t stored;        // bytes of the fields as stored so far
+    compress_t pack;        // this rank's share compressed, if compressed
+    series_entry_t *index;  // rank 0 only
+    uint64_t capacity;
+} series_t;
+
+// Creates the series at path for a field of ndims axes of dims cells,
+// frame included; each rank will write the sub cells from at on, a sheet
+// with compressed set as compressed sections, with error_bound if that is
+// not 0. Returns 0 on success on every rank, -1 on every rank otherwise.
+static inline int series_create(series_t *s, const char *path, MPI_Comm comm, int ndims, const int *dims,
+                                const int *sub, const int *at, double alpha, double epsilon, int compressed,
+                                double error_bound) {
+    series_header_t *h = &s->header;
+    int failed = 0, any;
+
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, SERIES_MAGIC, sizeof(SERIES_MAGIC));
+    h->version = SERIES_VERSION;
+    h->byte_order = SERIES_BYTE_ORDER;
+    h->value_bytes = sizeof(data_type);
+    h->ndims = ndims;
+    for (int k = 0; k < 3; k++) {
+        h->dims[k] = k < ndims ? (uint64_t)dims[k] : 1;
+    }
+    h->alpha = alpha;
+    h->epsilon = epsilon;
+    h->compressed = compressed;
+    h->error_bound = error_bound;
+    h->frame_bytes = compressed ? 0 : series_stride(series_cells(h) * h->value_bytes);
+
+    s->comm = comm;
+    s->next = SERIES_ALIGN;
+    s->stored = 0;
+    MPI_Comm_rank(comm, &s->rank);
+    s->index = NULL;
+    s->capacity = 0;
+    if (MPI_File_open(comm, path, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &s->f) != MPI_SUCCESS) {
+        return -1;
+    }
+    failed |= MPI_File_set_size(s->f, SERIES_ALIGN);
+    if (s->rank == 0) {
+        failed |= MPI_File_write_at(s->f, 0, h, sizeof(*h), MPI_BYTE, MPI_STATUS_IGNORE);
+    }
+    MPI_Type_create_subarray(ndims, dims, sub, at, MPI_ORDER_C, MPI_DATA_TYPE, &s->view);
+    MPI_Type_commit(&s->view);
+
+    failed = failed != MPI_SUCCESS;
+    MPI_Allreduce(&failed, &any, 1, MPI_INT, MPI_LOR, comm);
+    if (any) {
+        MPI_Type_free(&s->view);
+        MPI_File_close(&s->f);
+    }
+    return any ? -1 : 0;
+}
+
+// Rank 0: completes the frame at offset of stored bytes, and indexes it
+static inline int series_frame(series_t *s, MPI_Offset offset, uint64_t bytes, int64_t iteration,
+                               double time) {
+    series_header_t *h = &s->header;
+    series_frame_t frame;
+    int failed;
+
+    memset(&frame, 0, sizeof(frame));
+    memcpy(frame.magic, SERIES_FRAME_MAGIC, sizeof(SERIES_FRAME_MAGIC));
+    frame.iteration = iteration;
+    frame.time = time;
+    frame.bytes = bytes;
+    failed = MPI_File_write_at(s->f, offset, &frame, sizeof(frame), MPI_BYTE, MPI_STATUS_IGNORE);
+
+    if (h->frames == s->capacity) {
+        s->capacity = s->capacity ? 2 * s->capacity : 64;
+        s->index = (series_entry_t *)realloc(s->index, s->capacity * sizeof(series_entry_t));
+    }
+    s->index[h->frames].iteration = iteration;
+    s->index[h->frames].time = time;
+    s->index[h->frames].offset = offset;
+    return failed;
+}
+
+// Appends a frame: every rank writes its share, one mem element of buf,
+// after iteration iterations and at the given simulated time. The frame
+// header goes last, so a run that dies part-way through a frame leaves it
+// without one. Returns 0 on success on this rank.
+static inline int series_append(series_t *s, const void *buf, MPI_Datatype mem, int64_t iteration,
+                                double time) {
+    series_header_t *h = &s->header;
+    MPI_Offset offset = (MPI_Offset)s->next;
+    int failed = 0;
+
+    failed |= MPI_File_set_view(s->f, offset + SERIES_FRAME_HEADER, MPI_DATA_TYPE, s->view, "native",
+                                MPI_INFO_NULL);
+    failed |= MPI_File_write_at_all(s->f, 0, buf, 1, mem, MPI_STATUS_IGNORE);
+    failed |= MPI_File_set_view(s->f, 0, MPI_BYTE, MPI_BYTE, "native", MPI_INFO_NULL);
+    if (s->rank == 0) {
+        failed |= series_frame(s, offset, series_cells(h) * h->value_bytes, iteration, time);
+    }
+    h->frames++;
+    s->next += h->frame_bytes;
+    s->stored += series_cells(h) * h->value_bytes;
+    return failed != MPI_SUCCESS ? -1 : 0;
+}
+
+// Appends a frame of the shares the ranks packed into s->pack: rank 0
+// writes the head of the section and every rank its stream
+static inline int series_append_packed(series_t *s, int64_t iteration, double time) {
+    series_header_t *h = &s->header;
+    MPI_Offset offset = (MPI_Offset)s->next, at = offset + SERIES_FRAME_HEADER;
+    uint64_t head_bytes, bytes, mine;
+    uint64_t *head = compress_table(s->comm, &s->pack, &head_bytes, &bytes, &mine);
+    int failed = 0;
+
+    failed |= MPI_File_write_at_all(s->f, at + (MPI_Offset)mine, s->pack.out, (int)s->pack.bytes, MPI_BYTE,
+                                    MPI_STATUS_IGNORE);
+    if (s->rank == 0) {
+        failed |= MPI_File_write_at(s->f, at, head, (int)head_bytes, MPI_BYTE, MPI_STATUS_IGNORE);
+        failed |= series_frame(s, offset, bytes, iteration, time);
+    }
+    free(head);
+    h->frames++;
+    s->next += series_stride(bytes);
+    s->stored += bytes;
+    return failed != MPI_SUCCESS ? -1 : 0;
+}
+
+// Appends the index, completes the header and closes the series
+static inline int series_close(series_t *s) {
+    series_header_t *h = &s->header;
+    int failed = 0;
+
+    // The last frame is padded out too, so the index is where the next
+    // frame would go
+    h->index_offset = s->next;
+    if (s->rank == 0) {
+        failed |= MPI_File_write_at(s->f, h->index_offset, s->index, h->frames * sizeof(series_entry_t),
+                                    MPI_BYTE, MPI_STATUS_IGNORE);
+        failed |= MPI_File_write_at(s->f, 0, h, sizeof(*h), MPI_BYTE, MPI_STATUS_IGNORE);
+    }
+    failed |= MPI_File_close(&s->f);
+    MPI_Type_free(&s->view);
+    if (h->compressed) {
+        compress_free(&s->pack);
+    }
+    free(s->index);
+    return failed != MPI_SUCCESS ? -1 : 0;
+}
+
+// Team function: packs block, any halo width, for the next frame of a
+// compressed series of a sheet; nothing to do for others
+static inline void series_pack_sheet(series_t *s, const grid_t *block) {
+    if (s->header.compressed) {
+        compress_share(&s->pack, block);
+    }
+}
+
+// Appends the sheet whose blocks (any halo width) the ranks of dec hold,
+// to a series made by series_create_sheet, packed by series_pack_sheet
+static inline int series_append_sheet(series_t *s, const decomp_t *dec, int n, const grid_t *block,
+                                      int64_t iteration, double time) {
+    int sub[2], start[2], at[2];
+
+    if (s->header.compressed) {
+        return series_append_packed(s, iteration, time);
+    }
+    decomp_share(dec, n, n, dec->rank, sub, start, at);
+    MPI_Datatype mem = grid_subarray_type(block, sub, start);
+    int err = series_append(s, block->data, mem, iteration, time);
+    MPI_Type_free(&mem);
+    return err;
+}
+
+// Creates the series of the n x n sheet held in blocks by the ranks of dec,
+// uncompressed, compressed losslessly, or with every value within
+// error_bound if that is not 0
+static inline int series_create_sheet(series_t *s, const char *path, const decomp_t *dec, int n,
+                                      double alpha, double epsilon, int compressed, double error_bound) {
+    int sub[2], start[2], at[2], dims[2] = { n + 2, n + 2 };
+    int err, any;
+
+    decomp_share(dec, n, n, dec->rank, sub, start, at);
+    err = compressed && compress_init(&s->pack, sub, start, at, error_bound) != 0;
+    MPI_Allreduce(&err, &any, 1, MPI_INT, MPI_LOR, dec->comm);
+    if (!any && series_create(s, path, dec->comm, 2, dims, sub, at, alpha, epsilon, compressed,
+                              compressed ? error_bound : 0) == 0) {
+        return 0;
+    }
+    if (compressed) {
+        compress_free(&s->pack);
+    }
+    return -1;
+}
+
+// Reading, serial
+
+// A series mapped read-only into memory
+typedef struct {
+    const series_header_t *header;
+    const unsigned char *base;
+    size_t bytes;
+    uint64_t frames;
+    const series_entry_t *index;  // frames entries, by iteration
+    series_entry_t *rebuilt;      // the index when the file has none
+} series_map_t;
+
+// Maps the series at path; returns 0 on success, -1 (after printing why)
+// if it cannot be read, is not a series or is of another byte order
+static inline int series_open(series_map_t *m, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Cannot read '%s'\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    m->bytes = (size_t)st.st_size;
+    void *p = m->bytes >= SERIES_ALIGN ? mmap(NULL, m->bytes, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "'%s' is not a snapshot series\n", path);
+        return -1;
+    }
+    m->base = (const unsigned char *)p;
+    m->header = (const series_header_t *)p;
+    m->rebuilt = NULL;
+
+    const series_header_t *h = m->header;
+    const char *why = NULL;
+    if (memcmp(h->magic, SERIES_MAGIC, sizeof(SERIES_MAGIC)) != 0 || h->version != SERIES_VERSION) {
+        why = "is not a snapshot series";
+    } else if (h->byte_order != SERIES_BYTE_ORDER) {
+        why = "was written with the other byte order";
+    } else if ((h->value_bytes != 4 && h->value_bytes != 8) || h->ndims < 2 || h->ndims > 3 ||
+               (h->compressed ? h->value_bytes != sizeof(data_type) || h->ndims != 2
+                              : h->frame_bytes < SERIES_FRAME_HEADER + series_cells(h) * h->value_bytes) ||
+               (h->index_offset != 0 && h->index_offset + h->frames * sizeof(series_entry_t) > m->bytes)) {
+        why = "is damaged or cut short";
+    }
+    if (why != NULL) {
+        fprintf(stderr, "'%s' %s\n", path, why);
+        munmap(p, m->bytes);
+        return -1;
+    }
+
+    if (h->index_offset != 0) {
+        m->frames = h->frames;
+        m->index = (const series_entry_t *)(m->base + h->index_offset);
+        return 0;
+    }
+    // No index: the run stopped before closing the series. Every frame
+    // within the file that has its header counts, found by walking from
+    // header to header; the last one need not be padded out yet.
+    uint64_t capacity = 64, offset = SERIES_ALIGN;
+    m->rebuilt = (series_entry_t *)malloc(capacity * sizeof(series_entry_t));
+    m->frames = 0;
+    while (offset + SERIES_FRAME_HEADER <= m->bytes) {
+        const series_frame_t *f = (const series_frame_t *)(m->base + offset);
+        uint64_t bytes = h->compressed ? f->bytes : series_cells(h) * h->value_bytes;
+        if (memcmp(f->magic, SERIES_FRAME_MAGIC, sizeof(SERIES_FRAME_MAGIC)) != 0 ||
+            bytes > m->bytes - offset - SERIES_FRAME_HEADER) {
+            break;
+        }
+        if (m->frames == capacity) {
+            capacity *= 2;
+            m->rebuilt = (series_entry_t *)realloc(m->rebuilt, capacity * sizeof(series_entry_t));
+        }
+        m->rebuilt[m->frames].iteration = f->iteration;
+        m->rebuilt[m->frames].time = f->time;
+        m->rebuilt[m->frames].offset = offset;
+        m->frames++;
+        offset += h->compressed ? series_stride(bytes) : h->frame_bytes;
+    }
+    m->index = m->rebuilt;
+    return 0;
+}
+
+// The last frame at or before iteration (the first if there is none),
+// found by bisection of the index; -1 if the series has no frames
+static inline int64_t series_find(const series_map_t *m, int64_t iteration) {
+    int64_t lo = 0, hi = (int64_t)m->frames - 1;
+
+    if (hi < 0) {
+        return -1;
+    }
+    while (lo < hi) {
+        int64_t mid = (lo + hi + 1) / 2;
+        if (m->index[mid].iteration <= iteration) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+// The values of frame k in place in the mapping, or its compressed section
+static inline const void *series_values(const series_map_t *m, uint64_t k) {
+    return m->base + m->index[k].offset + SERIES_FRAME_HEADER;
+}
+
+// Team function: decodes frame k of a compressed series into out, the
+// whole field in row-major order
+static inline void series_decode(const series_map_t *m, uint64_t k, data_type *out) {
+    compress_decode_section(series_values(m, k), out, m->header->dims[1]);
+}
+
+// Cell (i, j, l) of frame k (l = 0 in 2D) of an uncompressed series,
+// whatever type it is stored in; only the pages of the cells read are
+// touched, so any sub-rectangle of any frame costs what it covers
+static inline double series_value(const series_map_t *m, uint64_t k, uint64_t i, uint64_t j, uint64_t l) {
+    const series_header_t *h = m->header;
+    uint64_t at = (i * h->dims[1] + j) * h->dims[2] + l;
+    const void *v = series_values(m, k);
+
+    return h->value_bytes == 4 ? ((const float *)v)[at] : ((const double *)v)[at];
+}
+
+static inline void series_unmap(series_map_t *m) {
+    free(m->rebuilt);
+    munmap((void *)m->base, m->bytes);
+}
+
+#endif
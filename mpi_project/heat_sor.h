@@ -0,0 +1,126 @@
+#ifndef HEAT_SOR_H
+#define HEAT_SOR_H
+
+#include <math.h>
+#include "heat_grid.h"
+#include "heat_halo.h"
+#include "heat_stencil.h"
+
+// Red-black successive over-relaxation for the steady state (Laplace
+// equation) of the sheet. Cells are coloured by the parity of their global
+// row + column, so every red cell only reads black neighbours and the other
+// way round: each colour is updated in place, in parallel, after one halo
+// exchange. The result does not depend on the decomposition or the thread
+// count.
+//
+// The update is computed in double and only the new value is rounded. Even
+// so, an over-relaxed iteration in single precision ends in a cycle of
+// changes of a few units in the last place, which a tight --epsilon on the
+// small cells far from the hot edge never gets under. sor_watch notices
+// that and finishes with plain Gauss-Seidel, which does reach a fixed point.
+
+#define SOR_STALL 100  // iterations without a new lowest change that count as a stall
+
+typedef struct {
+    data_type omega;  // relaxation factor, 1 is plain Gauss-Seidel
+    int parity;       // colour of local cell (0, 0)
+    int plain;        // stalled: relax with a factor of 1 from now on
+    int stalled_at;   // iteration of the stall, -1 if none
+    data_type best;   // lowest global change so far
+    int since;        // iterations since it was reached
+} sor_t;
+
+// Optimal factor for the 5-point Laplacian on an nrows x ncols interior:
+// 2 / (1 + sqrt(1 - rho^2)), with rho the spectral radius of Jacobi
+static inline data_type sor_omega_auto(int nrows, int ncols) {
+    double rho = (cos(M_PI / (nrows + 1)) + cos(M_PI / (ncols + 1))) / 2;
+
+    return (data_type)(2 / (1 + sqrt(1 - rho * rho)));
+}
+
+// row0 and col0 are the sheet indices of local cell (1, 1)
+static inline void sor_init(sor_t *s, data_type omega, int row0, int col0) {
+    s->omega = omega;
+    s->parity = (row0 + col0) & 1;
+    s->plain = 0;
+    s->stalled_at = -1;
+    s->best = INFINITY;
+    s->since = 0;
+}
+
+// Relaxes the cells of one colour in [i0, i1) x [j0, j1) of g and returns
+// the largest relative change. Inside a parallel region every thread takes
+// its static share of the rows and gets the maximum over that share only;
+// there is no barrier at the end.
+static inline data_type sor_sweep(const sor_t *s, grid_t *g, int color,
+                                  int i0, int i1, int j0, int j1) {
+    double omega = s->plain ? 1 : s->omega;
+    data_type max_eps = 0;
+
+    OMP(for schedule(static) nowait)
+    for (int i = i0; i < i1; i++) {
+        const data_type *up = GRID_ROW(g, i - 1), *down = GRID_ROW(g, i + 1);
+        data_type *mid = GRID_ROW(g, i);
+        for (int j = j0 + (((i + j0 + s->parity) & 1) ^ color); j < j1; j += 2) {
+            double gs = 0.25 * ((double)up[j] + down[j] + mid[j - 1] + mid[j + 1]);
+            data_type value = (data_type)(mid[j] + omega * (gs - mid[j]));
+            data_type eps = fabsf((value - mid[j]) / (value == 0 ? STENCIL_ZERO_GUARD : value));
+
+            mid[j] = value;
+            if (eps > max_eps) {
+                max_eps = eps;
+            }
+        }
+    }
+    return max_eps;
+}
+
+// One red and one black half-sweep over the owned cells of g. Each colour
+// first starts its halo exchange, relaxes the cells that do not read the
+// halo while it is in flight, then finishes the one-cell ring. Team
+// function; returns the largest relative change of both colours.
+static inline data_type sor_iteration(const sor_t *s, halo_t *h, grid_t *g) {
+    int rows = g->rows, cols = g->cols;
+    data_type max_eps = 0, eps;
+
+    for (int color = 0; color < 2; color++) {
+        halo_start(h, g);
+        eps = sor_sweep(s, g, color, 2, rows - 2, 2, cols - 2);
+        max_eps = eps > max_eps ? eps : max_eps;
+        halo_finish(h, g);
+
+        eps = sor_sweep(s, g, color, 1, 2, 1, cols - 1);
+        max_eps = eps > max_eps ? eps : max_eps;
+        if (rows - 2 > 1) {
+            eps = sor_sweep(s, g, color, rows - 2, rows - 1, 1, cols - 1);
+            max_eps = eps > max_eps ? eps : max_eps;
+        }
+        eps = sor_sweep(s, g, color, 2, rows - 2, 1, 2);
+        max_eps = eps > max_eps ? eps : max_eps;
+        if (cols - 2 > 1) {
+            eps = sor_sweep(s, g, color, 2, rows - 2, cols - 2, cols - 1);
+            max_eps = eps > max_eps ? eps : max_eps;
+        }
+        // The other colour reads these cells next
+        OMP(barrier)
+    }
+    return team_max(max_eps);
+}
+
+// Master only, after every iteration with the global change eps (the same
+// on all ranks, so they all switch together): drops the factor to 1 once
+// the change has not reached a new low for SOR_STALL iterations
+static inline void sor_watch(sor_t *s, data_type eps, int iteration) {
+    if (s->plain) {
+        return;
+    }
+    if (eps < s->best) {
+        s->best = eps;
+        s->since = 0;
+    } else if (++s->since >= SOR_STALL && s->omega != 1) {
+        s->plain = 1;
+        s->stalled_at = iteration;
+    }
+}
+
+#endif
@@ -0,0 +1,477 @@
+#ifndef HEAT_STENCIL_H
+#define HEAT_STENCIL_H
+
+#include <string.h>
+#include <unistd.h>
+#include "heat_grid.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STENCIL_X86 1
+#endif
+
+// Denominator used for the relative change of a cell that is exactly zero
+#define STENCIL_ZERO_GUARD 0.001f
+
+// All kernels evaluate exactly the same float expression in the same order,
+// so the SIMD paths are bitwise identical to the scalar reference. The
+// compiler must not fuse the multiply/add pairs into FMAs behind our back.
+#if defined(__GNUC__) && !defined(__clang__)
+#define STENCIL_EXACT __attribute__((optimize("fp-contract=off")))
+#else
+#define STENCIL_EXACT
+#endif
+
+#ifdef __clang__
+#pragma STDC FP_CONTRACT OFF
+#endif
+
+// Updates one row: out[j] = mid[j] + alpha*laplacian for j in [j0, j1) and
+// returns the largest relative change |delta/out[j]| over the row
+typedef data_type (*stencil_row_fn)(const data_type *up, const data_type *mid,
+                                    const data_type *down, data_type *out,
+                                    int j0, int j1, data_type alpha);
+
+// Scalar reference kernel
+static inline STENCIL_EXACT data_type stencil_row_scalar(const data_type *up, const data_type *mid,
+                                                         const data_type *down, data_type *out,
+                                                         int j0, int j1, data_type alpha) {
+    data_type max_eps = 0;
+
+    for (int j = j0; j < j1; j++) {
+        data_type delta = alpha * (down[j] + up[j] + mid[j + 1] + mid[j - 1] - 4 * mid[j]);
+        data_type value = mid[j] + delta;
+        data_type eps = delta / (value == 0 ? STENCIL_ZERO_GUARD : value);
+
+        out[j] = value;
+        if (eps < 0) {
+            eps = -eps;
+        }
+        if (eps > max_eps) {
+            max_eps = eps;
+        }
+    }
+    return max_eps;
+}
+
+#ifdef STENCIL_X86
+
+// Note on the reductions below: max_ps returns its second operand when the
+// first is NaN, which matches the scalar 'if (eps > max_eps)' skipping NaNs.
+
+__attribute__((target("sse2")))
+static inline STENCIL_EXACT data_type stencil_row_sse(const data_type *up, const data_type *mid,
+                                                      const data_type *down, data_type *out,
+                                                      int j0, int j1, data_type alpha) {
+    const __m128 va = _mm_set1_ps(alpha);
+    const __m128 four = _mm_set1_ps(4.0f);
+    const __m128 guard = _mm_set1_ps(STENCIL_ZERO_GUARD);
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 vmax = _mm_setzero_ps();
+    int j = j0;
+
+    for (; j + 4 <= j1; j += 4) {
+        __m128 c = _mm_loadu_ps(mid + j);
+        __m128 s = _mm_add_ps(_mm_loadu_ps(down + j), _mm_loadu_ps(up + j));
+        s = _mm_add_ps(s, _mm_loadu_ps(mid + j + 1));
+        s = _mm_add_ps(s, _mm_loadu_ps(mid + j - 1));
+        s = _mm_sub_ps(s, _mm_mul_ps(four, c));
+
+        __m128 delta = _mm_mul_ps(va, s);
+        __m128 value = _mm_add_ps(c, delta);
+        _mm_storeu_ps(out + j, value);
+
+        __m128 zero = _mm_cmpeq_ps(value, _mm_setzero_ps());
+        __m128 den = _mm_or_ps(_mm_and_ps(zero, guard), _mm_andnot_ps(zero, value));
+        __m128 eps = _mm_andnot_ps(sign, _mm_div_ps(delta, den));
+        vmax = _mm_max_ps(eps, vmax);
+    }
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, vmax);
+    data_type max_eps = stencil_row_scalar(up, mid, down, out, j, j1, alpha);
+    for (int l = 0; l < 4; l++) {
+        if (lanes[l] > max_eps) max_eps = lanes[l];
+    }
+    return max_eps;
+}
+
+__attribute__((target("avx2")))
+static inline STENCIL_EXACT data_type stencil_row_avx2(const data_type *up, const data_type *mid,
+                                                       const data_type *down, data_type *out,
+                                                       int j0, int j1, data_type alpha) {
+    const __m256 va = _mm256_set1_ps(alpha);
+    const __m256 four = _mm256_set1_ps(4.0f);
+    const __m256 guard = _mm256_set1_ps(STENCIL_ZERO_GUARD);
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 vmax = _mm256_setzero_ps();
+    int j = j0;
+
+    for (; j + 8 <= j1; j += 8) {
+        __m256 c = _mm256_loadu_ps(mid + j);
+        __m256 s = _mm256_add_ps(_mm256_loadu_ps(down + j), _mm256_loadu_ps(up + j));
+        s = _mm256_add_ps(s, _mm256_loadu_ps(mid + j + 1));
+        s = _mm256_add_ps(s, _mm256_loadu_ps(mid + j - 1));
+        s = _mm256_sub_ps(s, _mm256_mul_ps(four, c));
+
+        __m256 delta = _mm256_mul_ps(va, s);
+        __m256 value = _mm256_add_ps(c, delta);
+        _mm256_storeu_ps(out + j, value);
+
+        __m256 zero = _mm256_cmp_ps(value, _mm256_setzero_ps(), _CMP_EQ_OQ);
+        __m256 den = _mm256_blendv_ps(value, guard, zero);
+        __m256 eps = _mm256_andnot_ps(sign, _mm256_div_ps(delta, den));
+        vmax = _mm256_max_ps(eps, vmax);
+    }
+
+    float lanes[8];
+    _mm256_storeu_ps(lanes, vmax);
+    data_type max_eps = stencil_row_scalar(up, mid, down, out, j, j1, alpha);
+    for (int l = 0; l < 8; l++) {
+        if (lanes[l] > max_eps) max_eps = lanes[l];
+    }
+    return max_eps;
+}
+
+// AVX-512 handles the ragged end of the row with masked loads and stores
+// instead of falling back to the scalar loop
+__attribute__((target("avx512f")))
+static inline STENCIL_EXACT data_type stencil_row_avx512(const data_type *up, const data_type *mid,
+                                                         const data_type *down, data_type *out,
+                                                         int j0, int j1, data_type alpha) {
+    const __m512 va = _mm512_set1_ps(alpha);
+    const __m512 four = _mm512_set1_ps(4.0f);
+    const __m512 guard = _mm512_set1_ps(STENCIL_ZERO_GUARD);
+    __m512 vmax = _mm512_setzero_ps();
+
+    for (int j = j0; j < j1; j += 16) {
+        __mmask16 m = (j1 - j >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (j1 - j)) - 1);
+
+        __m512 c = _mm512_maskz_loadu_ps(m, mid + j);
+        __m512 s = _mm512_add_ps(_mm512_maskz_loadu_ps(m, down + j), _mm512_maskz_loadu_ps(m, up + j));
+        s = _mm512_add_ps(s, _mm512_maskz_loadu_ps(m, mid + j + 1));
+        s = _mm512_add_ps(s, _mm512_maskz_loadu_ps(m, mid + j - 1));
+        s = _mm512_sub_ps(s, _mm512_mul_ps(four, c));
+
+        __m512 delta = _mm512_mul_ps(va, s);
+        __m512 value = _mm512_add_ps(c, delta);
+        _mm512_mask_storeu_ps(out + j, m, value);
+
+        __mmask16 zero = _mm512_cmp_ps_mask(value, _mm512_setzero_ps(), _CMP_EQ_OQ);
+        __m512 den = _mm512_mask_blend_ps(zero, value, guard);
+        __m512 eps = _mm512_abs_ps(_mm512_div_ps(delta, den));
+        vmax = _mm512_mask_max_ps(vmax, m, eps, vmax);
+    }
+
+    float lanes[16];
+    _mm512_storeu_ps(lanes, vmax);
+    data_type max_eps = 0;
+    for (int l = 0; l < 16; l++) {
+        if (lanes[l] > max_eps) max_eps = lanes[l];
+    }
+    return max_eps;
+}
+
+#endif // STENCIL_X86
+
+// Kernels for narrow rows. The row width is only known at run time, so the
+// loops above cannot be unrolled for small blocks the way they could be when
+// the sheet size was a constant. Instead every kernel is instantiated here
+// for each width up to STENCIL_FIXED_MAX, with the width a constant the
+// compiler unrolls, and the sweeps look the width up in a table. The
+// instances evaluate the same expression, so they stay bitwise identical.
+#define STENCIL_FIXED_MAX 16
+
+#define STENCIL_WIDTHS(X, base, attr) \
+    X(base, attr, 1) X(base, attr, 2) X(base, attr, 3) X(base, attr, 4) \
+    X(base, attr, 5) X(base, attr, 6) X(base, attr, 7) X(base, attr, 8) \
+    X(base, attr, 9) X(base, attr, 10) X(base, attr, 11) X(base, attr, 12) \
+    X(base, attr, 13) X(base, attr, 14) X(base, attr, 15) X(base, attr, 16)
+
+#define STENCIL_FIXED_FN(base, attr, w) \
+    attr __attribute__((flatten)) \
+    static STENCIL_EXACT data_type base##_##w(const data_type *up, const data_type *mid, \
+                                              const data_type *down, data_type *out, \
+                                              int j0, int j1, data_type alpha) { \
+        (void)j1; \
+        return base(up, mid, down, out, j0, j0 + w, alpha); \
+    }
+
+#define STENCIL_FIXED_ENTRY(base, attr, w) base##_##w,
+
+// Defines the instances of kernel base and its table base_fixed, indexed by
+// the row width (entry 0 is unused)
+#define STENCIL_FIXED_TABLE(base, attr) \
+    STENCIL_WIDTHS(STENCIL_FIXED_FN, base, attr) \
+    static const stencil_row_fn base##_fixed[STENCIL_FIXED_MAX + 1] = { \
+        NULL, STENCIL_WIDTHS(STENCIL_FIXED_ENTRY, base, attr) \
+    };
+
+STENCIL_FIXED_TABLE(stencil_row_scalar, )
+#ifdef STENCIL_X86
+STENCIL_FIXED_TABLE(stencil_row_sse, __attribute__((target("sse2"))))
+STENCIL_FIXED_TABLE(stencil_row_avx2, __attribute__((target("avx2"))))
+STENCIL_FIXED_TABLE(stencil_row_avx512, __attribute__((target("avx512f"))))
+#endif
+
+// Cache block used by stencil_apply; cols <= 0 sweeps whole rows and
+// rows <= 0 sweeps whole columns of a block
+typedef struct {
+    int rows, cols;
+} stencil_tile_t;
+
+typedef struct {
+    const char *name;
+    stencil_row_fn row;
+    const stencil_row_fn *fixed;  // instances of row by width, NULL for none
+    stencil_tile_t tile;
+} stencil_kernel_t;
+
+// The kernel for rows [j0, j1): a fixed-width instance if there is one
+static inline stencil_row_fn stencil_row_for(const stencil_kernel_t *k, int j0, int j1) {
+    int width = j1 - j0;
+
+    if (k->fixed != NULL && width > 0 && width <= STENCIL_FIXED_MAX) {
+        return k->fixed[width];
+    }
+    return k->row;
+}
+
+// Tile size derived from the cache size. The column block is as wide as
+// possible while the four rows it touches (three inputs, one output) still
+// fit in half of L2, so neighbour rows are reused instead of re-streamed
+// from memory. Narrower blocks only cost prefetch streams, which is why
+// rows narrower than that are not split at all.
+static inline stencil_tile_t stencil_tile_auto(void) {
+    long l2 = 0;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+    if (l2 <= 0) l2 = 256 * 1024;
+
+    stencil_tile_t tile;
+    tile.rows = 0;
+    tile.cols = (int)(l2 / 2 / (4 * sizeof(data_type)));
+    tile.cols = tile.cols / GRID_ALIGN_ELEMS * GRID_ALIGN_ELEMS;
+    if (tile.cols < 4 * GRID_ALIGN_ELEMS) tile.cols = 4 * GRID_ALIGN_ELEMS;
+    return tile;
+}
+
+// Parses a tile spec: "auto", "off" or ROWSxCOLS (ROWS may be 0 for whole
+// columns); returns -1 if malformed
+static inline int stencil_parse_tile(const char *spec, stencil_tile_t *tile) {
+    if (spec == NULL || strcmp(spec, "auto") == 0) {
+        *tile = stencil_tile_auto();
+        return 0;
+    }
+    if (strcmp(spec, "off") == 0) {
+        tile->rows = tile->cols = 0;
+        return 0;
+    }
+    if (sscanf(spec, "%dx%d", &tile->rows, &tile->cols) != 2 || tile->rows < 0 || tile->cols < 1) {
+        return -1;
+    }
+    return 0;
+}
+
+// Picks a row kernel by name ("scalar", "sse", "avx2", "avx512"), or the
+// widest one the CPU supports when name is NULL or "auto". Returns a kernel
+// with row == NULL if the requested one is unknown or unsupported here.
+static inline stencil_kernel_t stencil_select(const char *name) {
+    stencil_kernel_t k = { "scalar", stencil_row_scalar, stencil_row_scalar_fixed, stencil_tile_auto() };
+    int any = (name == NULL || strcmp(name, "auto") == 0);
+
+    if (!any && strcmp(name, "scalar") == 0) {
+        return k;
+    }
+#ifdef STENCIL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && (any || strcmp(name, "avx512") == 0)) {
+        k.name = "avx512";
+        k.row = stencil_row_avx512;
+        k.fixed = stencil_row_avx512_fixed;
+        return k;
+    }
+    if (__builtin_cpu_supports("avx2") && (any || strcmp(name, "avx2") == 0)) {
+        k.name = "avx2";
+        k.row = stencil_row_avx2;
+        k.fixed = stencil_row_avx2_fixed;
+        return k;
+    }
+    if (__builtin_cpu_supports("sse2") && (any || strcmp(name, "sse") == 0)) {
+        k.name = "sse";
+        k.row = stencil_row_sse;
+        k.fixed = stencil_row_sse_fixed;
+        return k;
+    }
+#endif
+    if (!any) {
+        k.name = name;
+        k.row = NULL;
+        k.fixed = NULL;
+    }
+    return k;
+}
+
+// Runs the row kernel over rows [i0, i1) and columns [j0, j1) of cur,
+// writing next, and returns the largest relative change. Inside a parallel
+// region every thread sweeps its static share of the rows and gets the
+// maximum over that share only; there is no barrier at the end.
+static inline data_type stencil_sweep(stencil_row_fn row, const grid_t *cur, grid_t *next,
+                                      int i0, int i1, int j0, int j1, data_type alpha) {
+    data_type max_eps = 0;
+
+    OMP(for schedule(static) nowait)
+    for (int i = i0; i < i1; i++) {
+        data_type eps = row(GRID_ROW(cur, i - 1), GRID_ROW(cur, i), GRID_ROW(cur, i + 1),
+                            GRID_ROW(next, i), j0, j1, alpha);
+        if (eps > max_eps) {
+            max_eps = eps;
+        }
+    }
+    return max_eps;
+}
+
+// Tiled version of stencil_sweep: column blocks are swept top to bottom so
+// the neighbour rows of a block are reused from cache, not memory. Team
+// function; every thread gets the maximum over the whole region.
+static inline data_type stencil_apply(const stencil_kernel_t *k, const grid_t *cur, grid_t *next,
+                                      int i0, int i1, int j0, int j1, data_type alpha) {
+    int tile_cols = k->tile.cols > 0 ? k->tile.cols : j1 - j0;
+    int tile_rows = k->tile.rows > 0 ? k->tile.rows : i1 - i0;
+    data_type max_eps = 0;
+
+    if (i0 >= i1 || j0 >= j1) {
+        return team_max(0);
+    }
+    if (tile_cols >= j1 - j0 && tile_rows >= i1 - i0) {
+        return team_max(stencil_sweep(stencil_row_for(k, j0, j1), cur, next, i0, i1, j0, j1, alpha));
+    }
+    for (int jb = j0; jb < j1; jb += tile_cols) {
+        int je = jb + tile_cols < j1 ? jb + tile_cols : j1;
+        for (int ib = i0; ib < i1; ib += tile_rows) {
+            int ie = ib + tile_rows < i1 ? ib + tile_rows : i1;
+            data_type eps = stencil_sweep(stencil_row_for(k, jb, je), cur, next, ib, ie, jb, je, alpha);
+            if (eps > max_eps) {
+                max_eps = eps;
+            }
+        }
+    }
+    return team_max(max_eps);
+}
+
+// Updates only the one-cell ring along the edges of [i0, i1) x [j0, j1),
+// i.e. the cells that read the halo; together with stencil_apply on
+// [i0+1, i1-1) x [j0+1, j1-1) it covers the region once. Team function.
+static inline data_type stencil_ring(const stencil_kernel_t *k, const grid_t *cur, grid_t *next,
+                                     int i0, int i1, int j0, int j1, data_type alpha) {
+    stencil_row_fn row = stencil_row_for(k, j0, j1), col = stencil_row_for(k, 0, 1);
+    data_type max_eps = 0, eps;
+
+    if (i0 >= i1 || j0 >= j1) {
+        return team_max(0);
+    }
+    max_eps = stencil_sweep(row, cur, next, i0, i0 + 1, j0, j1, alpha);
+    if (i1 - 1 > i0) {
+        eps = stencil_sweep(row, cur, next, i1 - 1, i1, j0, j1, alpha);
+        if (eps > max_eps) {
+            max_eps = eps;
+        }
+    }
+    if (i1 - i0 > 2) {
+        eps = stencil_sweep(col, cur, next, i0 + 1, i1 - 1, j0, j0 + 1, alpha);
+        if (eps > max_eps) {
+            max_eps = eps;
+        }
+        if (j1 - 1 > j0) {
+            eps = stencil_sweep(col, cur, next, i0 + 1, i1 - 1, j1 - 1, j1, alpha);
+            if (eps > max_eps) {
+                max_eps = eps;
+            }
+        }
+    }
+    return team_max(max_eps);
+}
+
+// Owned part of a block and whether it may grow into the halo on each side
+// (0 where the side is a physical boundary)
+typedef struct {
+    int i0, i1, j0, j1;
+    int grow_up, grow_down, grow_left, grow_right;
+} stencil_region_t;
+
+// Advances nsteps Jacobi steps without communication, given a halo of
+// width depth >= nsteps around the region. Step s (1-based) is computed on
+// the region grown by depth-s cells into the halo, so it only reads cells
+// step s-1 produced. The rows are visited as a wavefront: step s trails
+// step s-1 by two rows, which is exactly what the two ping-pong buffers
+// allow, and keeps the rows of all steps in flight in cache.
+// buf[0] holds the input; the result ends up in buf[nsteps % 2]. eps[s-1]
+// receives the largest relative change of step s over the owned cells only.
+// Team function: the rows of one wave do not depend on each other, so each
+// thread takes a slice of columns of every row and the team meets once per
+// wave.
+static inline void stencil_wavefront(const stencil_kernel_t *k, grid_t *buf[2],
+                                     const stencil_region_t *r, int depth, int nsteps,
+                                     data_type alpha, data_type *eps) {
+    int first = r->i0 - (depth - 1) * r->grow_up;
+    int last = r->i1 + (depth - nsteps) * r->grow_down + 2 * (nsteps - 1);
+    data_type local[nsteps];
+
+    for (int s = 0; s < nsteps; s++) {
+        local[s] = 0;
+    }
+    for (int w = first; w < last; w++) {
+        for (int s = 1; s <= nsteps; s++) {
+            int ext = depth - s;
+            int i = w - 2 * (s - 1);
+            if (i < r->i0 - ext * r->grow_up || i >= r->i1 + ext * r->grow_down) {
+                continue;
+            }
+
+            const grid_t *in = buf[(s - 1) % 2];
+            grid_t *out = buf[s % 2];
+            const data_type *up = GRID_ROW(in, i - 1);
+            const data_type *mid = GRID_ROW(in, i);
+            const data_type *down = GRID_ROW(in, i + 1);
+            data_type *dst = GRID_ROW(out, i);
+            int j0, j1;
+            team_split(r->j0 - ext * r->grow_left, r->j1 + ext * r->grow_right,
+                       GRID_ALIGN_ELEMS, &j0, &j1);
+            if (j0 >= j1) {
+                continue;
+            }
+
+            if (i < r->i0 || i >= r->i1) {
+                stencil_row_for(k, j0, j1)(up, mid, down, dst, j0, j1, alpha);
+                continue;
+            }
+            // Owned row: the change only counts inside the owned columns
+            int o0 = j0 > r->j0 ? j0 : r->j0;
+            int o1 = j1 < r->j1 ? j1 : r->j1;
+            if (o0 < o1) {
+                data_type e = stencil_row_for(k, o0, o1)(up, mid, down, dst, o0, o1, alpha);
+                if (e > local[s - 1]) {
+                    local[s - 1] = e;
+                }
+            }
+            if (j0 < r->j0) {
+                int e1 = j1 < r->j0 ? j1 : r->j0;
+                stencil_row_for(k, j0, e1)(up, mid, down, dst, j0, e1, alpha);
+            }
+            if (j1 > r->j1) {
+                int e0 = j0 > r->j1 ? j0 : r->j1;
+                stencil_row_for(k, e0, j1)(up, mid, down, dst, e0, j1, alpha);
+            }
+        }
+        OMP(barrier)
+    }
+    for (int s = 0; s < nsteps; s++) {
+        data_type e = team_max(local[s]);
+        OMP(master)
+        eps[s] = e;
+    }
+    OMP(barrier)
+}
+
+#endif
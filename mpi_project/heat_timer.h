@@ -0,0 +1,130 @@
+#ifndef HEAT_TIMER_H
+#define HEAT_TIMER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <mpi.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TIMER_TSC 1
+#endif
+
+// Per-phase timers of the simulation loop, kept by the master thread of
+// each rank. Time is charged by laps: TIMER_LAP(t, phase) adds everything
+// since the previous lap to phase, so the phases of a step cover it without
+// gaps and a lap costs one time stamp read. On x86 that is the time stamp
+// counter, whose rate is measured against MPI_Wtime over the run when the
+// report is made; elsewhere it is MPI_Wtime itself.
+//
+// Building with -DHEAT_NO_TIMERS turns every lap into nothing; the report
+// then only says so.
+
+enum {
+    TIMER_PACK,     // copying and compressing: frames, output buffers
+    TIMER_SEND,     // posting halo messages
+    TIMER_WAIT,     // blocked on halo messages
+    TIMER_COMPUTE,  // stencil sweeps and solver steps
+    TIMER_REDUCE,   // convergence reductions
+    TIMER_BARRIER,  // waiting for the rest of the team
+    TIMER_VIS,      // drawing
+    TIMER_IO,       // writing fields, checkpoints and snapshots
+    TIMER_PHASES
+};
+
+static const char *const timer_names[TIMER_PHASES] = {
+    "pack", "send", "wait", "compute", "reduce", "barrier", "vis", "io"
+};
+
+typedef struct {
+    uint64_t mark;                  // time stamp of the last lap
+    uint64_t ticks[TIMER_PHASES];   // time charged to each phase
+    uint64_t start;                 // time stamp and MPI_Wtime when started
+    double start_time;
+} timers_t;
+
+static inline uint64_t timer_now(void) {
+#ifdef TIMER_TSC
+    return __rdtsc();
+#else
+    return (uint64_t)(MPI_Wtime() * 1e9);
+#endif
+}
+
+#ifdef HEAT_NO_TIMERS
+#define TIMERS_START(t) ((void)(t))
+#define TIMER_LAP(t, phase) ((void)0)
+#else
+#define TIMERS_START(t) timers_start(t)
+#define TIMER_LAP(t, phase) timer_lap(t, phase)
+#endif
+
+static inline void timers_start(timers_t *t) {
+    for (int p = 0; p < TIMER_PHASES; p++) {
+        t->ticks[p] = 0;
+    }
+    t->start_time = MPI_Wtime();
+    t->start = t->mark = timer_now();
+}
+
+static inline void timer_lap(timers_t *t, int phase) {
+    uint64_t now = timer_now();
+
+    t->ticks[phase] += now - t->mark;
+    t->mark = now;
+}
+
+// Prints on rank 0 of comm, as seconds, each rank's total time from
+// TIMERS_START to the last lap and its split over the phases, then the
+// smallest, largest and average value of each over the ranks. Collective.
+static inline void timers_report(const timers_t *t, MPI_Comm comm) {
+    int rank, size;
+
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+#ifdef HEAT_NO_TIMERS
+    (void)t;
+    if (rank == 0) {
+        printf("Phase timers are not built in (compiled with -DHEAT_NO_TIMERS)\n");
+    }
+#else
+    uint64_t elapsed = timer_now() - t->start;
+    double per_tick = elapsed > 0 ? (MPI_Wtime() - t->start_time) / (double)elapsed : 0;
+    double mine[TIMER_PHASES + 1];
+
+    mine[0] = per_tick * (double)(t->mark - t->start);
+    for (int p = 0; p < TIMER_PHASES; p++) {
+        mine[p + 1] = per_tick * (double)t->ticks[p];
+    }
+    double *all = rank == 0 ? (double *)malloc(sizeof(mine) * size) : NULL;
+    MPI_Gather(mine, TIMER_PHASES + 1, MPI_DOUBLE, all, TIMER_PHASES + 1, MPI_DOUBLE, 0, comm);
+    if (rank != 0) {
+        return;
+    }
+
+    for (int r = 0; r < size; r++) {
+        const double *v = all + (size_t)r * (TIMER_PHASES + 1);
+        printf("RANK %d: total=%.6f", r, v[0]);
+        for (int p = 0; p < TIMER_PHASES; p++) {
+            printf("  %s=%.6f", timer_names[p], v[p + 1]);
+        }
+        printf("\n");
+    }
+    printf("\n===== GLOBAL PERFORMANCE =====\n");
+    printf("%-10s %12s %12s %12s\n", "phase (s)", "min", "max", "avg");
+    for (int p = 0; p <= TIMER_PHASES; p++) {
+        double lo = all[p], hi = all[p], sum = 0;
+        for (int r = 0; r < size; r++) {
+            double v = all[(size_t)r * (TIMER_PHASES + 1) + p];
+            lo = v < lo ? v : lo;
+            hi = v > hi ? v : hi;
+            sum += v;
+        }
+        printf("%-10s %12.6f %12.6f %12.6f\n", p == 0 ? "total" : timer_names[p - 1], lo, hi, sum / size);
+    }
+    free(all);
+#endif
+}
+
+#endif
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+#include "heat_grid.h"
+#include "heat_halo.h"
+#include "heat_decomp.h"
+
+// Stress test for the halo exchanges with messages far past the eager
+// limit of the MPI library, where a send-before-receive exchange would
+// hang. For every size C it runs a wide ROWS x C sheet (large row messages)
+// and a tall C x ROWS sheet (large column messages) through the split
+// depth-1 exchange (fresh and persistent requests) and the two-phase deep
+// exchange, checks every received halo cell and reports the time per
+// exchange.
+//
+// Usage: mpirun -np P stress_halo [--depth K] [--reps R] [C ...]
+
+#define ROWS 16
+
+static int nrows, ncols;
+
+// Value of a sheet cell, below 2^16 so it is exact in float at any sheet
+// size. Cells a row or a few columns apart never share it, so a halo
+// shifted by any amount up to the depth is caught.
+static data_type cell(int gi, int gj) {
+    return (data_type)(((long)gi * 7919 + gj) % 65521);
+}
+
+// Owned cells get their sheet value, everything else -1
+static void fill(grid_t *g, const decomp_t *d) {
+    grid_fill(g, -1.);
+    for (int i = 1; i < g->rows - 1; i++) {
+        for (int j = 1; j < g->cols - 1; j++) {
+            GRID(g, i, j) = cell(d->row0 - 1 + i, d->col0 - 1 + j);
+        }
+    }
+}
+
+// Counts halo cells within depth of the block that hold the wrong value.
+// Cells of neighbouring blocks must match the sheet, cells beyond the
+// sheet must be untouched; corners are only expected when corners != 0.
+static long check(const grid_t *g, const decomp_t *d, int depth, int corners) {
+    long bad = 0;
+
+    for (int i = 1 - depth; i < g->rows - 1 + depth; i++) {
+        for (int j = 1 - depth; j < g->cols - 1 + depth; j++) {
+            int out_i = i < 1 || i > g->rows - 2, out_j = j < 1 || j > g->cols - 2;
+            int gi = d->row0 - 1 + i, gj = d->col0 - 1 + j;
+            if (!out_i && !out_j) {
+                continue;
+            }
+            if (out_i && out_j && !corners) {
+                continue;
+            }
+            int inside = gi >= 1 && gi <= nrows && gj >= 1 && gj <= ncols;
+            data_type want = inside ? cell(gi, gj) : -1.f;
+            if (GRID(g, i, j) != want) {
+                bad++;
+            }
+        }
+    }
+    return bad;
+}
+
+enum { DEEP, SPLIT, PERSISTENT };
+
+// Runs reps exchanges of one kind and returns the slowest rank's seconds
+// per exchange; *bad gets the number of wrong halo cells over all ranks
+static double run(const decomp_t *d, int depth, int kind, int reps, long *bad) {
+    grid_t g;
+    halo_t h;
+    long my_bad;
+    double t;
+
+    grid_alloc(&g, d->rows + 2, d->cols + 2, depth);
+    halo_init(&h, d->comm, d->up, d->down, d->left, d->right, &g, depth);
+    fill(&g, d);
+    if (kind == PERSISTENT) {
+        halo_persist(&h, &g, NULL);
+    }
+
+    MPI_Barrier(d->comm);
+    t = MPI_Wtime();
+    OMP(parallel)
+    for (int r = 0; r < reps; r++) {
+        if (kind != DEEP) {
+            halo_start(&h, &g);
+            halo_finish(&h, &g);
+        } else {
+            halo_exchange(&h, &g);
+        }
+    }
+    t = (MPI_Wtime() - t) / reps;
+
+    my_bad = check(&g, d, depth, kind == DEEP);
+    MPI_Allreduce(MPI_IN_PLACE, &t, 1, MPI_DOUBLE, MPI_MAX, d->comm);
+    MPI_Allreduce(&my_bad, bad, 1, MPI_LONG, MPI_SUM, d->comm);
+    halo_free(&h);
+    grid_free(&g);
+    return t;
+}
+
+int main(int argc, char **argv) {
+    int provided, rank, depth = 4, reps = 20;
+    int default_sizes[] = { 10, 100, 1000, 10000, 100000 };
+    int sizes[64], nsizes = 0, failed = 0;
+
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    if (provided < MPI_THREAD_FUNNELED) {
+        omp_set_num_threads(1);
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            depth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            reps = atoi(argv[++i]);
+        } else if (nsizes < 64 && atoi(argv[i]) > 0) {
+            sizes[nsizes++] = atoi(argv[i]);
+        } else {
+            if (rank == 0) {
+                fprintf(stderr, "Usage: %s [--depth K] [--reps R] [C ...]\n", argv[0]);
+            }
+            MPI_Finalize();
+            return 1;
+        }
+    }
+    if (nsizes == 0) {
+        nsizes = sizeof(default_sizes) / sizeof(default_sizes[0]);
+        memcpy(sizes, default_sizes, sizeof(default_sizes));
+    }
+
+    if (rank == 0) {
+        printf("%8s %8s %8s %12s %12s %12s %4s\n",
+               "rows", "cols", "largest", "split [ms]", "persist [ms]", "deep [ms]", "ok");
+    }
+    for (int s = 0; s < nsizes; s++) {
+        for (int tall = 0; tall < 2; tall++) {
+            decomp_t d;
+            long bad_split, bad_persist, bad_deep;
+            nrows = tall ? sizes[s] : ROWS;
+            ncols = tall ? ROWS : sizes[s];
+            decomp_create(&d, MPI_COMM_WORLD, nrows, ncols);
+
+            // The deep exchange needs depth owned cells in every block
+            int k = depth;
+            if (k > nrows / d.dims[0]) k = nrows / d.dims[0];
+            if (k > ncols / d.dims[1]) k = ncols / d.dims[1];
+            if (k < 1 || nrows / d.dims[0] < 1 || ncols / d.dims[1] < 1) {
+                decomp_free(&d);
+                continue;
+            }
+
+            double t_split = run(&d, 1, SPLIT, reps, &bad_split);
+            double t_persist = run(&d, 1, PERSISTENT, reps, &bad_persist);
+            double t_deep = run(&d, k, DEEP, reps, &bad_deep);
+            int largest = (tall ? d.rows : d.cols) + 2 * k;
+            int bad = bad_split || bad_persist || bad_deep;
+            if (rank == 0) {
+                printf("%8d %8d %8d %12.4f %12.4f %12.4f %4s\n", nrows, ncols, largest,
+                       1e3 * t_split, 1e3 * t_persist, 1e3 * t_deep, bad ? "NO" : "yes");
+            }
+            failed |= bad;
+            decomp_free(&d);
+        }
+    }
+
+    MPI_Finalize();
+    return failed;
+}
@@ -6,12 +6,26 @@
 #include <GLFW/glfw3.h>
 #include <string.h>
 #include<unistd.h>
+#include "heat_grid.h"
+#include "heat_stencil.h"
+#include "heat_halo.h"
+#include "heat_decomp.h"
+#include "heat_options.h"
+#include "heat_converge.h"
+#include "heat_sor.h"
+#include "heat_mg.h"
+#include "heat_cg.h"
+#include "heat_adi.h"
+#include "heat_rkl.h"
+#include "heat_io.h"
+#include "heat_ckpt.h"
+#include "heat_series.h"
+#include "heat_timer.h"
 
-#define N 100          // size of sheet, will be considered that it is square
-#define ALPHA 0.125   // thermal diffusivity
-#define EPSILON 0.05  // stopping condition/criterion
-
-typedef float data_type;
+// Defaults of --size, --alpha and --epsilon
+#define DEFAULT_N 100         // size of sheet, will be considered that it is square
+#define DEFAULT_ALPHA 0.125   // thermal diffusivity
+#define DEFAULT_EPSILON 0.05  // stopping condition/criterion
 
 // Global variables for OpenGL
 GLFWwindow* window = NULL;
@@ -52,7 +66,7 @@ void processInput(GLFWwindow *window) {
         glfwSetWindowShouldClose(window, 1);
 }
 
-int initOpenGL(int rank) {
+int initOpenGL(int rank, int row, int col) {
     // Initialize GLFW
     if (!glfwInit()) {
         fprintf(stderr, "Failed to initialize GLFW\n");
@@ -72,9 +86,9 @@ int initOpenGL(int rank) {
     sprintf(title, "Heat Transfer - Rank %d", rank);
     window = glfwCreateWindow(window_width, window_height, title, NULL, NULL);
     
-    // Position windows based on rank (after window creation)
+    // Position windows like the blocks in the process grid (after window creation)
     if (window != NULL) {
-        glfwSetWindowPos(window, (rank % 2) * (window_width + 10), (rank / 2) * (window_height + 40));
+        glfwSetWindowPos(window, col * (window_width + 10), row * (window_height + 40));
     }
     
     if (window == NULL) {
@@ -136,7 +150,7 @@ int initOpenGL(int rank) {
     return 0;
 }
 
-void setupBuffers(int part) {
+void setupBuffers(int rows, int cols) {
     glGenVertexArrays(1, &VAO);
     glGenBuffers(1, &VBO);
     glGenBuffers(1, &EBO);
@@ -145,25 +159,25 @@ void setupBuffers(int part) {
     
     // We'll update the VBO data in updateVisualization
     glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, part * part * 4 * sizeof(float), NULL, GL_DYNAMIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, rows * cols * 4 * sizeof(float), NULL, GL_DYNAMIC_DRAW);
     
     // Generate indices for triangles
-    unsigned int *indices = (unsigned int*)malloc((part-1) * (part-1) * 6 * sizeof(unsigned int));
+    unsigned int *indices = (unsigned int*)malloc((rows-1) * (cols-1) * 6 * sizeof(unsigned int));
     int idx = 0;
-    for (int i = 0; i < part-1; i++) {
-        for (int j = 0; j < part-1; j++) {
-            indices[idx++] = i * part + j;
-            indices[idx++] = i * part + (j + 1);
-            indices[idx++] = (i + 1) * part + j;
+    for (int i = 0; i < rows-1; i++) {
+        for (int j = 0; j < cols-1; j++) {
+            indices[idx++] = i * cols + j;
+            indices[idx++] = i * cols + (j + 1);
+            indices[idx++] = (i + 1) * cols + j;
             
-            indices[idx++] = i * part + (j + 1);
-            indices[idx++] = (i + 1) * part + j;
-            indices[idx++] = (i + 1) * part + (j + 1);
+            indices[idx++] = i * cols + (j + 1);
+            indices[idx++] = (i + 1) * cols + j;
+            indices[idx++] = (i + 1) * cols + (j + 1);
         }
     }
     
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, (part-1) * (part-1) * 6 * sizeof(unsigned int), indices, GL_STATIC_DRAW);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, (rows-1) * (cols-1) * 6 * sizeof(unsigned int), indices, GL_STATIC_DRAW);
     
     free(indices);
     
@@ -178,27 +192,27 @@ void setupBuffers(int part) {
     glBindVertexArray(0);
 }
 
-void updateVisualization(data_type** mat, int part) {
+void updateVisualization(grid_t* mat, int rows, int cols) {
     // Create vertex data: [x, y, z, temperature]
-    float *vertices = (float*)malloc(part * part * 4 * sizeof(float));
+    float *vertices = (float*)malloc(rows * cols * 4 * sizeof(float));
     
-    for (int i = 0; i < part; i++) {
-        for (int j = 0; j < part; j++) {
-            int idx = (i * part + j) * 4;
-            vertices[idx + 0] = (float)j / part * 2.0f - 1.0f;  // x: -1 to 1
-            vertices[idx + 1] = (float)i / part * 2.0f - 1.0f;  // y: -1 to 1
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < cols; j++) {
+            int idx = (i * cols + j) * 4;
+            vertices[idx + 0] = (float)j / cols * 2.0f - 1.0f;  // x: -1 to 1
+            vertices[idx + 1] = (float)i / rows * 2.0f - 1.0f;  // y: -1 to 1
             vertices[idx + 2] = 0.0f;                           // z
-            vertices[idx + 3] = mat[i][j];                      // temperature
+            vertices[idx + 3] = GRID(mat, i, j);                // temperature
         }
     }
     
     glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, part * part * 4 * sizeof(float), vertices);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, rows * cols * 4 * sizeof(float), vertices);
     
     free(vertices);
 }
 
-void renderVisualization(int part) {
+void renderVisualization(int rows, int cols) {
     glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT);
     
@@ -216,133 +230,550 @@ void renderVisualization(int part) {
     glUniformMatrix4fv(projLoc, 1, GL_FALSE, projection);
     
     glBindVertexArray(VAO);
-    glDrawElements(GL_TRIANGLES, (part-1) * (part-1) * 6, GL_UNSIGNED_INT, 0);
+    glDrawElements(GL_TRIANGLES, (rows-1) * (cols-1) * 6, GL_UNSIGNED_INT, 0);
     
     glfwSwapBuffers(window);
     glfwPollEvents();
 }
 
-void initialize(data_type** mat, int rank, int size) {
-    int part = ((N+2)/2)+1;
-    
-    for (size_t i = 0; i < part; i++) {
-        for (size_t j = 0; j < part; j++) {
-            mat[i][j] = 0.;
-        }
-    }
+void initialize(grid_t* mat, const decomp_t* dec) {
+    // First touch by the threads that will later update each row
+    OMP(parallel)
+    grid_fill(mat, 0.);
     
-    // filling initial heat spots
-    if(rank == 0 || rank == 2){
-        for (size_t i = 0; i < part; i++) {
-            mat[i][0] = 1000.;
+    // filling initial heat spots along the left edge of the sheet
+    if (dec->left == MPI_PROC_NULL) {
+        for (int i = 0; i < mat->rows; i++) {
+            GRID(mat, i, 0) = 1000.;
         }
     }
-    MPI_Barrier(MPI_COMM_WORLD);
+    MPI_Barrier(dec->comm);
 }
 
-void copy(data_type** og, data_type** cpy, int size){
-    for(size_t i = 0; i < size; ++i){
-        for(size_t j = 0; j < size; ++j){
-            cpy[i][j] = og[i][j];
-        }
-    }
+// Whether any of the steps [first, first+steps) is a multiple of every
+static int hits_step(int first, int steps, int every) {
+    return first % every == 0 || first / every != (first + steps - 1) / every;
 }
 
-void simulation(data_type** mat, int rank, int size, int visualize) {
-    int part = ((N + 2)/2) + 1;
-    int row = rank/2;
-    int col = rank%2;
-    int neigh_h = row*2 + (col+1)%2;
-    int neigh_v = ((row+1)%2)*2 + col;
-    
-    data_type** old;
-    old = (data_type**)malloc(sizeof(data_type*)*part);
-    for (size_t i = 0; i < part; i++) {
-        old[i] = (data_type*)malloc(sizeof(data_type)*part);
-    }
-    MPI_Barrier(MPI_COMM_WORLD);
-    copy(mat, old, part);
-    MPI_Status status;
+// Simulated time after the given number of iterations, in h^2 / D; the
+// steady-state solvers have none
+double simulated_time(const options_t* opt, int iteration) {
+    return opt->solver == SOLVER_JACOBI ? iteration * opt->problem.alpha : 0;
+}
+
+// Header of the sheet's field files after the given number of iterations
+io_header_t field_header(const options_t* opt, int iteration) {
+    const problem_t *prob = &opt->problem;
+    int dims[2] = { prob->n + 2, prob->n + 2 };
+    io_header_t header = io_header(2, dims);
+    header.iteration = iteration;
+    header.alpha = prob->alpha;
+    header.epsilon = prob->epsilon;
+    header.time = simulated_time(opt, iteration);
+    return header;
+}
 
-    data_type adj_h[part], adj_v[part], edge_h[part], edge_v[part];
+// Writes the sheet, whose blocks the ranks hold, to path after the given
+// number of iterations (collective); with --lossy the blocks must have been
+// compressed into pack. Returns 0 on success.
+int write_field(const char* path, const decomp_t* dec, const grid_t* block, const compress_t* pack, int iteration,
+                const options_t* opt) {
+    io_header_t header = field_header(opt, iteration);
+    int err = opt->lossy > 0 ? io_write_section(path, dec->comm, &header, pack)
+                             : io_write_sheet(path, dec, block, opt->problem.n, &header);
+    if (err != 0 && dec->rank == 0) {
+        fprintf(stderr, "Cannot write '%s'\n", path);
+    }
+    return err;
+}
+
+// Runs the solver on mat until it stops; returns the number of iterations.
+// state holds the iterations done so far and the latest global changes;
+// the run continues from it and leaves its own in it.
+int simulation(grid_t* mat, const decomp_t* dec, int visualize, const stencil_kernel_t* kernel, const options_t* opt,
+               ckpt_state_t* state) {
+    int rank = dec->rank;
+    int rows = mat->rows;
+    int cols = mat->cols;
+    int depth = opt->halo_depth;
+    
+    // Ping-pong buffers: each iteration reads cur and writes next, then the
+    // two are swapped. Both start as full copies so the physical boundary
+    // columns never need refreshing; halos are received into cur before use.
+    // With deeper halos than mat has, mat is copied into a wider buffer.
+    grid_t buf[2];
+    grid_t* cur = mat;
+    grid_t* next = &buf[1];
+    if (depth > mat->halo) {
+        cur = &buf[0];
+        grid_alloc(cur, rows, cols, depth);
+    }
+    grid_alloc(next, rows, cols, depth);
+    
+    // Both buffers share one layout, so one set of halo datatypes serves them
+    halo_t halo;
+    halo_init(&halo, dec->comm, dec->up, dec->down, dec->left, dec->right, next, depth);
+    
+    // The split exchange sends the same messages every step, so its
+    // requests are set up once per buffer and only restarted
+    if (depth == 1) {
+        halo_persist(&halo, cur, next);
+    }
     
-    data_type global_eps = EPSILON + 1;
-    data_type max_eps = EPSILON + 1;
-    data_type eps = 0.0;
-    data_type delta_T = 0.0;
+    // Temporal blocking: k = depth steps per exchange over a shrinking
+    // region. The state at the start of each block is kept so that, should
+    // the run converge part-way through a block, it can be replayed to the
+    // exact step where the per-step exchange would have stopped.
+    grid_t save = {0};
+    stencil_region_t region = { 1, rows-1, 1, cols-1,
+                                halo.up != MPI_PROC_NULL, halo.down != MPI_PROC_NULL,
+                                halo.left != MPI_PROC_NULL, halo.right != MPI_PROC_NULL };
+    data_type step_eps[depth], global_step_eps[depth];
+    if (depth > 1) {
+        grid_alloc(&save, rows, cols, depth);
+    }
     
-    int iteration = 0;
-    int simulation_done = 0;
-    MPI_Barrier(MPI_COMM_WORLD);
+    const problem_t *prob = &opt->problem;
+    const data_type alpha = (data_type)prob->alpha;
+    data_type global_eps = prob->epsilon + 1;
+    int steps = 1;
+    halo_stats_t comm = { 0, 0, 0 };
+    double stamp = 0;
+    timers_t timers;
     
-    while(!simulation_done && (!visualize || !glfwWindowShouldClose(window))){
-        //sleep(1);
-        // Prepare edge data
-        for (size_t i = 0; i < part; i++) {   
-            edge_h[i] = mat[i][(1-col)*(part-2)+col];
-            edge_v[i] = mat[(1-row)*(part-2)+row][i];
+    // With --check-every the per-step global reduction is replaced by a
+    // non-blocking one every few steps, overlapped with the next step
+    int async = opt->check_every != 0;
+    converge_t conv;
+    if (async) {
+        converge_init(&conv, dec->comm, prob->epsilon, opt->check_every, depth);
+        if (state->count > 0) {
+            // Restarted: the adaptive interval goes on from the last change
+            conv.eps = (data_type)state->eps[state->count - 1];
+            conv.last_step = (int)state->step[state->count - 1] - 1;
+            // and a converged run reports the first recorded change below
+            for (int k = 0; k < state->count && conv.converged_at < 0; k++) {
+                if (state->eps[k] <= prob->epsilon) {
+                    conv.converged_at = (int)state->step[k] - 1;
+                }
+            }
         }
-        
-        // Send/receive edge values
-        MPI_Send(edge_h, part, MPI_FLOAT, neigh_h, 0, MPI_COMM_WORLD);
-        MPI_Send(edge_v, part, MPI_FLOAT, neigh_v, 0, MPI_COMM_WORLD);
-        MPI_Recv(adj_h, part, MPI_FLOAT, neigh_h, 0, MPI_COMM_WORLD, &status);
-        MPI_Recv(adj_v, part, MPI_FLOAT, neigh_v, 0, MPI_COMM_WORLD, &status);
-
-        // Update received data
-        for (size_t i = 0; i < part; i++) {
-            mat[i][(1-col)*(part-1)] = adj_h[i];
-            mat[(1-row)*(part-1)][i] = adj_v[i];
+    }
+    
+    // Red-black SOR relaxes cur in place instead of stepping into next
+    int sor_mode = opt->solver == SOLVER_SOR;
+    sor_t sor;
+    sor_init(&sor, (data_type)opt->omega, dec->row0, dec->col0);
+    
+    // Multigrid smooths cur in place too, except that Jacobi smoothing
+    // ping-pongs between cur and next; its hierarchy is built once here
+    int mg_mode = opt->solver == SOLVER_MG;
+    mg_t mg;
+    if (mg_mode) {
+        mg_setup(&mg, dec, prob->n, prob->n, &halo, cur, next, kernel, opt->smoother, opt->fmg);
+    }
+    
+    // Conjugate gradients update cur in place and reduce the change together
+    // with their dot products
+    int cg_mode = opt->solver == SOLVER_CG || opt->solver == SOLVER_PIPECG;
+    cg_t cg;
+    if (cg_mode) {
+        cg_init(&cg, dec, prob->n, prob->n, &halo, opt->solver == SOLVER_PIPECG ? CG_PIPELINED : CG_PLAIN,
+                opt->precond, opt->smoother);
+    }
+    
+    // ADI time steps are solved in place too, line by line across the ranks
+    int adi_mode = opt->integrator == INTEGRATOR_ADI;
+    adi_t adi;
+    if (adi_mode) {
+        adi_init(&adi, dec, &halo, cur, prob->alpha);
+    }
+    
+    // RKL2 super steps run their stages in buffers of their own
+    int rkl_mode = opt->integrator == INTEGRATOR_RKL2;
+    rkl_t rkl;
+    if (rkl_mode) {
+        rkl_init(&rkl, kernel, &halo, cur, prob->alpha);
+    }
+    int in_place = sor_mode || mg_mode || cg_mode || adi_mode || rkl_mode;
+    
+    // Checkpoints are written in the background while the run goes on
+    ckpt_t ckpt;
+    if (opt->checkpoint != NULL) {
+        ckpt_init(&ckpt, opt->checkpoint, dec, prob->n, rows, cols, opt->compress);
+    }
+    
+    int iteration = (int)state->iteration;
+    int last_checkpoint = iteration;
+    
+    // The evolution goes to one series file, starting with the initial field
+    series_t series;
+    int snapshots = opt->series != NULL;
+    int last_frame = iteration;
+    if (snapshots && series_create_sheet(&series, opt->series, dec, prob->n, prob->alpha, prob->epsilon,
+                                         opt->compress || opt->lossy > 0, opt->lossy) != 0) {
+        if (dec->rank == 0) {
+            fprintf(stderr, "Cannot write snapshot series '%s'\n", opt->series);
+        }
+        snapshots = 0;
+    }
+    if (snapshots) {
+        OMP(parallel)
+        series_pack_sheet(&series, mat);
+        series_append_sheet(&series, dec, prob->n, mat, iteration, simulated_time(opt, iteration));
+    }
+    
+    // With --lossy the intermediate fields are compressed by the team too
+    compress_t field_pack;
+    int fields = opt->output_every > 0;
+    if (fields && opt->lossy > 0) {
+        int sub[2], start[2], at[2];
+        decomp_share(dec, prob->n, prob->n, dec->rank, sub, start, at);
+        compress_init(&field_pack, sub, start, at, opt->lossy);
+    }
+    int field_due = 0, ckpt_due = 0, frame_due = 0;
+    // A restart from a converged checkpoint has no step left to make
+    int simulation_done = state->count > 0 && state->eps[state->count - 1] <= prob->epsilon;
+    int capped = 0;
+    int diverged = 0;
+    int running = !simulation_done && (!visualize || !glfwWindowShouldClose(window));
+    MPI_Barrier(dec->comm);
+    double start = MPI_Wtime();
+    TIMERS_START(&timers);
+    
+    // One parallel region for the whole run. The threads share the sweeps
+    // and copies; the master thread makes every MPI and OpenGL call. cur,
+    // next, steps and the loop flag are only changed by the master, between
+    // barriers.
+    OMP(parallel)
+    {
+        // The buffers are first touched here, by the threads that sweep them
+        if (cur != mat) {
+            grid_fill(cur, 0.);
+            grid_copy(mat, cur);
+        }
+        grid_copy(cur, next);
+        if (depth > 1) {
+            grid_fill(&save, 0.);
         }
         
-        global_eps = 0.0;
-        max_eps = 0.0;
-        
-        // Simulation on part of sheet
-        for (size_t i = 1; i < part-1; i++) {
-            for (size_t j = 1; j < part-1; j++) {
-                delta_T = ALPHA*(old[i + 1][j] + old[i - 1][j] + old[i][j + 1] + old[i][j - 1] - (4*old[i][j]));
-                
-                mat[i][j] += delta_T;
-                if(mat[i][j]==0){
-                    eps = delta_T/(mat[i][j]+0.001);
-                }else{
-                    eps = delta_T/mat[i][j];
+        while (running) {
+            // Simulation on part of sheet; the kernel also returns the largest
+            // relative change so no second pass is needed for the reduction
+            if (in_place) {
+                data_type max_eps = sor_mode ? sor_iteration(&sor, &halo, cur)
+                                  : mg_mode ? mg_step(&mg)
+                                  : cg_mode ? cg_iteration(&cg, cur)
+                                  : adi_mode ? adi_step(&adi, cur) : rkl_step(&rkl, cur);
+                OMP(master)
+                {
+                    TIMER_LAP(&timers, TIMER_COMPUTE);
+                    if (mg_mode) {
+                        cur = mg.level[0].u;
+                        next = mg.tmp;
+                    }
+                    step_eps[0] = max_eps;
+                    if (cg_mode) {
+                        global_eps = max_eps;
+                    } else if (!async) {
+                        MPI_Allreduce(&max_eps, &global_eps, 1, MPI_DATA_TYPE, MPI_MAX, dec->comm);
+                    }
+                    TIMER_LAP(&timers, TIMER_REDUCE);
+                }
+            } else if (depth == 1) {
+                // The halo messages travel while the cells that do not read
+                // the halo are updated; the ring next to it comes last
+                OMP(master)
+                stamp = MPI_Wtime();
+                halo_start(&halo, cur);
+                OMP(master)
+                {
+                    comm.post += halo_lap(&stamp);
+                    TIMER_LAP(&timers, TIMER_SEND);
+                }
+                data_type max_eps = stencil_apply(kernel, cur, next, 2, rows-2, 2, cols-2, alpha);
+                OMP(master)
+                {
+                    comm.overlap += halo_lap(&stamp);
+                    TIMER_LAP(&timers, TIMER_COMPUTE);
+                }
+                halo_finish(&halo, cur);
+                OMP(master)
+                {
+                    comm.wait += halo_lap(&stamp);
+                    TIMER_LAP(&timers, TIMER_WAIT);
+                }
+                data_type ring_eps = stencil_ring(kernel, cur, next, 1, rows-1, 1, cols-1, alpha);
+                if (ring_eps > max_eps) {
+                    max_eps = ring_eps;
+                }
+                OMP(master)
+                {
+                    TIMER_LAP(&timers, TIMER_COMPUTE);
+                    step_eps[0] = max_eps;
+                    if (!async) {
+                        MPI_Allreduce(&max_eps, &global_eps, 1, MPI_DATA_TYPE, MPI_MAX, dec->comm);
+                    }
+                    TIMER_LAP(&timers, TIMER_REDUCE);
+                }
+            } else {
+                // Temporal blocking needs the corners, so this exchange is
+                // the blocking two-phase one and fully exposed
+                OMP(master)
+                stamp = MPI_Wtime();
+                halo_exchange(&halo, cur);
+                OMP(master)
+                {
+                    comm.wait += halo_lap(&stamp);
+                    TIMER_LAP(&timers, TIMER_WAIT);
                 }
                 
-                if(eps<0.0){
-                    eps = -eps;
+                grid_t* bufs[2] = { cur, next };
+                halo_copy_frame(&halo, cur, next, depth);
+                grid_copy(cur, &save);
+                OMP(master)
+                TIMER_LAP(&timers, TIMER_PACK);
+                stencil_wavefront(kernel, bufs, &region, depth, depth, alpha, step_eps);
+                OMP(master)
+                {
+                    TIMER_LAP(&timers, TIMER_COMPUTE);
+                    if (async) {
+                        steps = depth;
+                    } else {
+                        MPI_Allreduce(step_eps, global_step_eps, depth, MPI_DATA_TYPE, MPI_MAX, dec->comm);
+                        steps = depth;
+                        for (int s = 0; s < depth; s++) {
+                            if (global_step_eps[s] <= prob->epsilon) {
+                                steps = s + 1;
+                                break;
+                            }
+                        }
+                        if (prob->max_iter > 0 && iteration + steps > prob->max_iter) {
+                            steps = prob->max_iter - iteration;
+                        }
+                        global_eps = global_step_eps[steps - 1];
+                    }
+                    TIMER_LAP(&timers, TIMER_REDUCE);
                 }
-                if(eps > max_eps){
-                    max_eps = eps;
+                OMP(barrier)
+                OMP(master)
+                TIMER_LAP(&timers, TIMER_BARRIER);
+                if (steps < depth) {
+                    grid_copy(&save, cur);
+                    stencil_wavefront(kernel, bufs, &region, depth, steps, alpha, step_eps);
+                    OMP(master)
+                    TIMER_LAP(&timers, TIMER_COMPUTE);
                 }
             }
-        }
-        
-        copy(mat, old, part);
-        MPI_Allreduce(&max_eps, &global_eps, 1, MPI_FLOAT, MPI_MAX, MPI_COMM_WORLD);
-        
-        // Check if simulation is done
-        if (global_eps <= EPSILON) {
-            simulation_done = 1;
-        }
-        
-        // Visualization update (every iteration when done, every 5 during simulation)
-        if (visualize) {
-            if (simulation_done || iteration % 5 == 0) {
-                processInput(window);
-                updateVisualization(mat, part);
-                renderVisualization(part);
+            
+            OMP(master)
+            {
+                if (steps % 2 && !in_place) {
+                    grid_t* tmp = cur;
+                    cur = next;
+                    next = tmp;
+                }
+                
+                // Check if simulation is done
+                if (async) {
+                    simulation_done = converge_push(&conv, iteration, step_eps, steps);
+                    if (conv.last_step >= 0) {
+                        ckpt_record(state, conv.last_step + 1, conv.eps);
+                    }
+                    global_eps = conv.eps;
+                } else {
+                    ckpt_record(state, iteration + steps, global_eps);
+                    if (global_eps <= prob->epsilon) {
+                        simulation_done = 1;
+                    }
+                }
+                // An unstable step shows as a change that is not finite
+                diverged = !isfinite(async ? conv.eps : global_eps);
+                if (sor_mode && !simulation_done) {
+                    sor_watch(&sor, async ? conv.eps : global_eps, iteration + steps);
+                }
+                TIMER_LAP(&timers, TIMER_REDUCE);
                 
-                // Print status on rank 0
-                if (rank == 0 && iteration % 50 == 0) {
-                    printf("Iteration %d, epsilon: %.6f\n", iteration, global_eps);
+                // Visualization update (every iteration when done, every 5 during simulation)
+                if (visualize) {
+                    if (simulation_done || hits_step(iteration, steps, 5)) {
+                        processInput(window);
+                        updateVisualization(cur, rows, cols);
+                        renderVisualization(rows, cols);
+                    
+                        // Print status on rank 0
+                        if (rank == 0 && hits_step(iteration, steps, 50)) {
+                            printf("Iteration %d, epsilon: %.6f\n", iteration, global_eps);
+                        }
+                    }
                 }
+                TIMER_LAP(&timers, TIMER_VIS);
+                
+                // Intermediate fields, checkpoints and snapshots, at most
+                // one of each per block of steps; they are packed and
+                // written below. The previous checkpoint must be out before
+                // its buffer is refilled.
+                field_due = fields && hits_step(iteration + 1, steps, opt->output_every);
+                ckpt_due = opt->checkpoint != NULL && opt->checkpoint_every > 0 &&
+                           hits_step(iteration + 1, steps, opt->checkpoint_every);
+                frame_due = snapshots && hits_step(iteration + 1, steps, opt->series_every);
+                if (ckpt_due) {
+                    ckpt_finish(&ckpt);
+                } else if (opt->checkpoint != NULL) {
+                    ckpt_poll(&ckpt);
+                }
+                TIMER_LAP(&timers, TIMER_IO);
+                
+                iteration += steps;
+                capped = prob->max_iter > 0 && iteration >= prob->max_iter;
+                running = !simulation_done && !capped && !diverged && (!visualize || !glfwWindowShouldClose(window));
+            }
+            OMP(barrier)
+            OMP(master)
+            TIMER_LAP(&timers, TIMER_BARRIER);
+            
+            // The team sets the field aside (compressing it, with
+            // --compress or --lossy), then the master writes it out; cur is
+            // left alone until it has
+            if (field_due) {
+                if (opt->lossy > 0) {
+                    compress_share(&field_pack, cur);
+                }
+                OMP(master)
+                {
+                    char path[4096];
+                    TIMER_LAP(&timers, TIMER_PACK);
+                    snprintf(path, sizeof(path), "%s.%d", opt->output, iteration);
+                    write_field(path, dec, cur, &field_pack, iteration, opt);
+                    TIMER_LAP(&timers, TIMER_IO);
+                }
+            }
+            if (ckpt_due) {
+                ckpt_pack(&ckpt, cur);
+                OMP(master)
+                {
+                    io_header_t header = field_header(opt, iteration);
+                    TIMER_LAP(&timers, TIMER_PACK);
+                    state->iteration = iteration;
+                    ckpt_start(&ckpt, &header, state);
+                    last_checkpoint = iteration;
+                    TIMER_LAP(&timers, TIMER_IO);
+                }
+            }
+            if (frame_due) {
+                series_pack_sheet(&series, cur);
+                OMP(master)
+                {
+                    TIMER_LAP(&timers, TIMER_PACK);
+                    series_append_sheet(&series, dec, prob->n, cur, iteration, simulated_time(opt, iteration));
+                    last_frame = iteration;
+                    TIMER_LAP(&timers, TIMER_IO);
+                }
+            }
+            if (field_due || ckpt_due || frame_due) {
+                OMP(barrier)
+                OMP(master)
+                TIMER_LAP(&timers, TIMER_BARRIER);
             }
         }
-        
-        iteration++;
-        MPI_Barrier(MPI_COMM_WORLD);
+    }
+    
+    double elapsed = MPI_Wtime() - start;
+    
+    // Hand the latest field back to the caller
+    if (cur != mat) {
+        grid_copy(cur, mat);
+    }
+    state->iteration = iteration;
+    if (opt->checkpoint != NULL) {
+        if (last_checkpoint != iteration) {
+            io_header_t header = field_header(opt, iteration);
+            ckpt_finish(&ckpt);
+            OMP(parallel)
+            ckpt_pack(&ckpt, mat);
+            ckpt_start(&ckpt, &header, state);
+        }
+        ckpt_free(&ckpt);
+        TIMER_LAP(&timers, TIMER_IO);
+    }
+    if (snapshots) {
+        if (last_frame != iteration) {
+            OMP(parallel)
+            series_pack_sheet(&series, mat);
+            series_append_sheet(&series, dec, prob->n, mat, iteration, simulated_time(opt, iteration));
+        }
+        series_close(&series);
+        TIMER_LAP(&timers, TIMER_IO);
+        if (series.header.compressed && dec->rank == 0) {
+            printf("Snapshot series written to %s: %llu frames, %.1f times smaller\n", opt->series,
+                   (unsigned long long)series.header.frames,
+                   (double)series.header.frames * series_cells(&series.header) * sizeof(data_type) / series.stored);
+        }
+    }
+    if (fields && opt->lossy > 0) {
+        compress_free(&field_pack);
+    }
+    
+    if (opt->stats) {
+        halo_stats_print(&comm, dec->comm);
+    }
+    if (opt->timers) {
+        timers_report(&timers, dec->comm);
+    }
+    if (async) {
+        converge_report(&conv, iteration);
+        converge_free(&conv);
+    }
+    if (sor_mode && dec->rank == 0) {
+        printf("Red-black SOR (omega %.4f): %d iterations\n", sor.omega, iteration);
+        if (sor.stalled_at >= 0) {
+            printf("SOR stalled at a change of %g after %d iterations; finished with Gauss-Seidel\n",
+                   sor.best, sor.stalled_at);
+        }
+    }
+    if (mg_mode) {
+        if (dec->rank == 0) {
+            printf("Multigrid (%s, %s smoother, %d levels): %d iterations\n",
+                   opt->fmg ? "FMG then V-cycles" : "V-cycles",
+                   opt->smoother ? "red-black Gauss-Seidel" : "Jacobi", mg.nlevels, iteration);
+        }
+        mg_free(&mg);
+    }
+    if (cg_mode) {
+        if (dec->rank == 0) {
+            printf("%s (preconditioner: %s): %d iterations\n",
+                   cg.variant == CG_PIPELINED ? "Pipelined CG" : "CG",
+                   precond_names[opt->precond], iteration);
+        }
+        cg_free(&cg);
+    }
+    if (adi_mode) {
+        if (dec->rank == 0) {
+            printf("ADI (Peaceman-Rachford, alpha %g): %d steps\n", prob->alpha, iteration);
+        }
+        adi_free(&adi);
+    }
+    if (rkl_mode) {
+        if (dec->rank == 0) {
+            printf("RKL2 (%d stages per step, alpha %g): %d steps\n", rkl.stages, prob->alpha, iteration);
+        }
+        rkl_free(&rkl);
+    }
+    if (capped && !simulation_done && dec->rank == 0) {
+        printf("Stopped at the limit of %d iterations before converging\n", prob->max_iter);
+    }
+    if (diverged && dec->rank == 0) {
+        printf("Diverged after %d iterations: the largest change is not finite\n", iteration);
+    }
+    if (dec->rank == 0) {
+        printf("Time to solution (%s): %d iterations in %.3f s\n", solver_names[opt->solver],
+               iteration, elapsed);
+    }
+    if (opt->solver == SOLVER_JACOBI && iteration > 0 && dec->rank == 0) {
+        // Time steps advance alpha = diffusivity * dt / h^2 each
+        double simulated = iteration * prob->alpha;
+        printf("Simulated time (%s): %g h^2/D, %.3g s of wall time per unit\n",
+               integrator_names[opt->integrator], simulated, elapsed / simulated);
     }
     
     // Keep windows open after simulation completes
@@ -355,13 +786,13 @@ void simulation(data_type** mat, int rank, int size, int visualize) {
     if (visualize) {
         while (!glfwWindowShouldClose(window)) {
             processInput(window);
-            updateVisualization(mat, part);
-            renderVisualization(part);
+            updateVisualization(mat, rows, cols);
+            renderVisualization(rows, cols);
             
             // Check if any other rank wants to close
             int should_close = glfwWindowShouldClose(window);
             int global_should_close = 0;
-            MPI_Allreduce(&should_close, &global_should_close, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+            MPI_Allreduce(&should_close, &global_should_close, 1, MPI_INT, MPI_MAX, dec->comm);
             
             if (global_should_close) {
                 break;
@@ -370,144 +801,283 @@ void simulation(data_type** mat, int rank, int size, int visualize) {
     }
     
     // Cleanup
-    for (size_t i = 0; i < part; i++) {
-        free(old[i]);
+    if (depth > mat->halo) {
+        grid_free(&buf[0]);
     }
-    free(old);
-}
-
-void flatten(data_type **mat, data_type *vec, int n){
-    for (size_t i = 0; i < n; i++) {
-        for (size_t j = 0; j < n; j++) {
-            vec[i*n+j] = mat[i][j];
-        }
-    }
-}
-
-void unflatten(data_type **mat, data_type *vec, int n){
-    for (size_t i = 0; i < n; i++) {
-        for (size_t j = 0; j < n; j++) {
-            mat[i][j] = vec[i*n+j];
-        }
+    grid_free(&buf[1]);
+    if (depth > 1) {
+        grid_free(&save);
     }
+    halo_free(&halo);
+    return iteration;
 }
 
-void collect(data_type **mat, data_type **part_1, data_type **part_2, data_type **part_3, data_type **part_4){
-    int part = ((N + 2)/2) + 1;
-
-    for(size_t i = 0; i < part-1; ++i){
-        for(size_t j = 0; j < part-1; ++j){
-            mat[i][j] = part_1[i][j];
-        }
-    }
+// Gathers every block straight from its grid into its place in the sheet
+// on rank 0 (sheet is not used elsewhere), with no staging buffers. The
+// blocks may differ in size, so rank 0 needs a subarray type per rank,
+// which MPI_Gatherv cannot take; MPI_Alltoallw can, and with every other
+// count zero it is a gather with one type per rank.
+void gather(grid_t *sheet, const grid_t *block, const decomp_t *dec, int n) {
+    int p = dec->size;
+    int *counts = (int*)calloc(4 * p, sizeof(int));
+    int *sendcounts = counts, *recvcounts = counts + p, *displs = counts + 2 * p;
+    MPI_Datatype *types = (MPI_Datatype*)malloc(2 * p * sizeof(MPI_Datatype));
+    MPI_Datatype *sendtypes = types, *recvtypes = types + p;
+    int sub[2], start[2], at[2];
     
-    for(size_t i = 0; i < part-1; ++i){
-        for(size_t j = 1; j < part; ++j){
-            mat[i][j+part-2] = part_2[i][j];
-        }
+    for (int r = 0; r < p; r++) {
+        sendtypes[r] = recvtypes[r] = MPI_DATA_TYPE;
     }
-    
-    for(size_t i = 1; i < part; ++i){
-        for(size_t j = 0; j < part-1; ++j){
-            mat[i+part-2][j] = part_3[i][j];
+    decomp_share(dec, n, n, dec->rank, sub, start, at);
+    sendcounts[0] = 1;
+    sendtypes[0] = grid_subarray_type(block, sub, start);
+    if (dec->rank == 0) {
+        for (int r = 0; r < p; r++) {
+            decomp_share(dec, n, n, r, sub, start, at);
+            recvcounts[r] = 1;
+            recvtypes[r] = grid_subarray_type(sheet, sub, at);
         }
     }
+    MPI_Alltoallw(block->data, sendcounts, displs, sendtypes,
+                  dec->rank == 0 ? sheet->data : NULL, recvcounts, displs, recvtypes, dec->comm);
     
-    for(size_t i = 1; i < part; ++i){
-        for(size_t j = 1; j < part; ++j){
-            mat[i+part-2][j+part-2] = part_4[i][j];
-        }
+    MPI_Type_free(&sendtypes[0]);
+    for (int r = 0; r < p && dec->rank == 0; r++) {
+        MPI_Type_free(&recvtypes[r]);
     }
+    free(types);
+    free(counts);
 }
 
-void print(data_type** mat, int n) {
-    for (size_t i = 0; i < n; i++) {
-        for (size_t j = 0; j < n; j++) {
-            printf(" %d ", (int)mat[i][j]);
+void print(grid_t* mat, int n) {
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            printf(" %d ", (int)GRID(mat, i, j));
         }
         putchar('\n');
     }
 }
 
 int main(int argc, char** argv) {
-    MPI_Init(&argc, &argv);
-    MPI_Status stat;
+    // Only the master thread of each rank talks to MPI
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
 
     int world_rank, world_size;
     MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
     MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+    if (provided < MPI_THREAD_FUNNELED) {
+        if (world_rank == 0 && omp_get_max_threads() > 1) {
+            fprintf(stderr, "MPI library lacks MPI_THREAD_FUNNELED, running one thread per rank\n");
+        }
+        omp_set_num_threads(1);
+    }
 
-    // Check if visualization is requested (pass --visualize flag)
-    int visualize = 0;
-    if (argc > 1 && strcmp(argv[1], "--visualize") == 0) {
-        visualize = 1;
+    options_t opt;
+    const problem_t defaults = { DEFAULT_N, DEFAULT_ALPHA, DEFAULT_EPSILON, 0 };
+    if (options_expand(&argc, &argv, world_rank) != 0 ||
+        parse_options(argc, argv, world_rank, &defaults, &opt) != 0) {
+        MPI_Finalize();
+        return 1;
+    }
+    int visualize = opt.visualize;
+    if ((opt.output_every > 0 && opt.output == NULL) || (opt.checkpoint_every > 0 && opt.checkpoint == NULL)) {
+        if (world_rank == 0) {
+            fprintf(stderr, "--output-every and --checkpoint-every need --output and --checkpoint\n");
+        }
+        MPI_Finalize();
+        return 1;
+    }
+    
+    // A restart takes the sheet size, the iteration and the latest global
+    // changes from the checkpoint, and its diffusivity and threshold unless
+    // they are given again; the field is read once the blocks are known
+    ckpt_state_t state;
+    ckpt_state_init(&state);
+    io_header_t header;
+    memset(&header, 0, sizeof header);
+    if (opt.restart != NULL) {
+        if (ckpt_read_state(opt.restart, MPI_COMM_WORLD, &header, &state) != 0) {
+            MPI_Finalize();
+            return 1;
+        }
+        opt.problem.n = (int)header.dims[0] - 2;
+        if (!opt.alpha_given) {
+            opt.problem.alpha = header.alpha;
+        }
+        if (!opt.epsilon_given) {
+            opt.problem.epsilon = header.epsilon;
+        }
+        if (opt.problem.max_iter > 0 && state.iteration >= opt.problem.max_iter) {
+            if (world_rank == 0) {
+                fprintf(stderr, "Checkpoint '%s' is already at iteration %lld, the --max-iter limit\n",
+                        opt.restart, (long long)state.iteration);
+            }
+            MPI_Finalize();
+            return 1;
+        }
     }
+    int n = opt.problem.n;
 
-    data_type **sheet, **sheet_part, **part_1, **part_2, **part_3, **part_4, *vec_part, *vec_1, *vec_2, *vec_3, *vec_4;
-    int part = ((N + 2)/2) + 1;
+    // Process grid chosen by MPI; blocks may differ by one row or column
+    decomp_t dec;
+    decomp_create(&dec, MPI_COMM_WORLD, n, n);
+    int min_rows = n / dec.dims[0];
+    int min_cols = n / dec.dims[1];
+    if (min_rows < 1 || min_cols < 1) {
+        if (world_rank == 0) {
+            fprintf(stderr, "Cannot split a %dx%d sheet over %dx%d ranks\n", n, n, dec.dims[0], dec.dims[1]);
+        }
+        MPI_Finalize();
+        return 1;
+    }
 
-    // Allocate memory for whole sheet on rank 0
+    stencil_kernel_t kernel = stencil_select(opt.kernel);
+    if (kernel.row == NULL) {
+        if (world_rank == 0) {
+            fprintf(stderr, "Stencil kernel '%s' is not available on this machine\n", kernel.name);
+        }
+        MPI_Finalize();
+        return 1;
+    }
+    if (opt.halo_depth > min_rows || opt.halo_depth > min_cols) {
+        if (world_rank == 0) {
+            fprintf(stderr, "Halo depth %d exceeds the %dx%d cells of the smallest block\n",
+                    opt.halo_depth, min_rows, min_cols);
+        }
+        MPI_Finalize();
+        return 1;
+    }
+    if (opt.integrator != INTEGRATOR_EXPLICIT && opt.solver != SOLVER_JACOBI) {
+        if (world_rank == 0) {
+            fprintf(stderr, "The %s integrator makes time steps and needs --solver jacobi\n",
+                    integrator_names[opt.integrator]);
+        }
+        MPI_Finalize();
+        return 1;
+    }
+    if (opt.integrator != INTEGRATOR_EXPLICIT && opt.halo_depth > 1) {
+        if (world_rank == 0) {
+            fprintf(stderr, "The %s integrator exchanges one-cell halos and needs --halo-depth 1\n",
+                    integrator_names[opt.integrator]);
+        }
+        MPI_Finalize();
+        return 1;
+    }
+    if (opt.solver != SOLVER_JACOBI && opt.halo_depth > 1) {
+        if (world_rank == 0) {
+            fprintf(stderr, "The %s solver exchanges one-cell halos and needs --halo-depth 1\n",
+                    solver_names[opt.solver]);
+        }
+        MPI_Finalize();
+        return 1;
+    }
+    if (opt.solver == SOLVER_JACOBI && opt.integrator == INTEGRATOR_EXPLICIT && opt.problem.alpha > 0.25) {
+        if (world_rank == 0) {
+            fprintf(stderr, "Explicit time steps are unstable for a diffusivity above 0.25 (got %g)\n",
+                    opt.problem.alpha);
+        }
+        MPI_Finalize();
+        return 1;
+    }
+    if (opt.integrator == INTEGRATOR_RKL2 && opt.problem.alpha > RKL_MAX_TAU) {
+        if (world_rank == 0) {
+            fprintf(stderr, "RKL2 super steps of %d stages are stable up to a diffusivity of %g (got %g)\n",
+                    RKL_MAX_STAGES, RKL_MAX_TAU, opt.problem.alpha);
+        }
+        MPI_Finalize();
+        return 1;
+    }
+    if (opt.solver == SOLVER_SOR && opt.omega == 0) {
+        opt.omega = sor_omega_auto(n, n);
+    }
+    if (stencil_parse_tile(opt.tile, &kernel.tile) != 0) {
+        if (world_rank == 0) {
+            fprintf(stderr, "Invalid tile size '%s'\n", opt.tile);
+        }
+        MPI_Finalize();
+        return 1;
+    }
     if (world_rank == 0) {
-        sheet = (data_type**)malloc(sizeof(data_type*)*(N + 2));
-        for (size_t i = 0; i < N + 2; i++) {
-            sheet[i] = (data_type*)malloc(sizeof(data_type)*(N + 2));
+        printf("%dx%d sheet, %dx%d ranks, ", n, n, dec.dims[0], dec.dims[1]);
+        if (kernel.tile.cols > 0) {
+            printf("%s stencil kernel, %d-column tiles, %d threads per rank\n",
+                   kernel.name, kernel.tile.cols, omp_get_max_threads());
+        } else {
+            printf("%s stencil kernel, untiled, %d threads per rank\n",
+                   kernel.name, omp_get_max_threads());
         }
-
-        part_2 = (data_type**)malloc(sizeof(data_type*)*part);
-        part_3 = (data_type**)malloc(sizeof(data_type*)*part);
-        part_4 = (data_type**)malloc(sizeof(data_type*)*part);
-        for (size_t i = 0; i < part; i++) {
-            part_2[i] = (data_type*)malloc(sizeof(data_type)*part);
-            part_3[i] = (data_type*)malloc(sizeof(data_type)*part);
-            part_4[i] = (data_type*)malloc(sizeof(data_type)*part);
+        if (opt.restart != NULL) {
+            printf("Restarting from %s at iteration %lld\n", opt.restart, (long long)state.iteration);
         }
-
-        vec_2 = (data_type*)malloc(sizeof(data_type)*part*part);
-        vec_3 = (data_type*)malloc(sizeof(data_type)*part*part);
-        vec_4 = (data_type*)malloc(sizeof(data_type)*part*part);
-    } else {
-        vec_part = (data_type*)malloc(sizeof(data_type)*part*part);
     }
 
-    sheet_part = (data_type**)malloc(sizeof(data_type*)*part);
-    for (size_t i = 0; i < part; i++) {
-        sheet_part[i] = (data_type*)malloc(sizeof(data_type)*part);
-    }
+    // Each rank's block with its 1-cell frame
+    grid_t sheet_part;
+    grid_alloc(&sheet_part, dec.rows + 2, dec.cols + 2, 1);
     
-    MPI_Barrier(MPI_COMM_WORLD);
-    initialize(sheet_part, world_rank, world_size);
-    MPI_Barrier(MPI_COMM_WORLD);
+    initialize(&sheet_part, &dec);
+    if (opt.restart != NULL && ckpt_read_block(opt.restart, &header, &dec, &sheet_part) != 0) {
+        if (dec.rank == 0) {
+            fprintf(stderr, "Cannot read the sheet from checkpoint '%s'\n", opt.restart);
+        }
+        MPI_Finalize();
+        return 1;
+    }
 
     // Initialize OpenGL for visualization
     if (visualize) {
-        if (initOpenGL(world_rank) == 0) {
-            setupBuffers(part);
+        if (initOpenGL(dec.rank, dec.coords[0], dec.coords[1]) == 0) {
+            setupBuffers(sheet_part.rows, sheet_part.cols);
         } else {
             visualize = 0;  // Disable visualization if initialization failed
         }
     }
 
     // Run simulation
-    simulation(sheet_part, world_rank, world_size, visualize);
+    int iterations = simulation(&sheet_part, &dec, visualize, &kernel, &opt, &state);
 
-    // Collect results on rank 0
-    if(world_rank == 0){
-        MPI_Recv(vec_2, part*part, MPI_FLOAT, 1, 0, MPI_COMM_WORLD, &stat);
-        MPI_Recv(vec_3, part*part, MPI_FLOAT, 2, 0, MPI_COMM_WORLD, &stat);
-        MPI_Recv(vec_4, part*part, MPI_FLOAT, 3, 0, MPI_COMM_WORLD, &stat);
-
-        unflatten(part_2, vec_2, part);
-        unflatten(part_3, vec_3, part);
-        unflatten(part_4, vec_4, part);
-
-        collect(sheet, sheet_part, part_2, part_3, part_4);
-
-        printf("\nFinal heat distribution:\n");
-        print(sheet, N+2);
+    // Write the field, or collect it on rank 0 and print it
+    int status = 0;
+    if (opt.output != NULL) {
+        // With --lossy it is compressed first, in parallel, and the
+        // compression ratio reported
+        compress_t pack;
+        uint64_t bytes = 0, total = 0;
+        if (opt.lossy > 0) {
+            int sub[2], start[2], at[2];
+            decomp_share(&dec, n, n, dec.rank, sub, start, at);
+            compress_init(&pack, sub, start, at, opt.lossy);
+            OMP(parallel)
+            compress_share(&pack, &sheet_part);
+            bytes = pack.bytes;
+            MPI_Reduce(&bytes, &total, 1, MPI_UINT64_T, MPI_SUM, 0, dec.comm);
+        }
+        status = write_field(opt.output, &dec, &sheet_part, &pack, iterations, &opt) != 0;
+        if (status == 0 && dec.rank == 0) {
+            printf("Final heat distribution written to %s\n", opt.output);
+            if (opt.lossy > 0) {
+                printf("Compressed %.1f times, every value within %g\n",
+                       (double)(n + 2) * (n + 2) * sizeof(data_type) / total, opt.lossy);
+            }
+        }
+        if (opt.lossy > 0) {
+            compress_free(&pack);
+        }
     } else {
-        flatten(sheet_part, vec_part, part);
-        MPI_Send(vec_part, part*part, MPI_FLOAT, 0, 0, MPI_COMM_WORLD);
+        grid_t sheet = { 0 };
+        if (dec.rank == 0) {
+            grid_alloc(&sheet, n + 2, n + 2, 1);
+        }
+        gather(&sheet, &sheet_part, &dec, n);
+        if (dec.rank == 0) {
+            printf("\nFinal heat distribution:\n");
+            print(&sheet, n+2);
+            grid_free(&sheet);
+        }
     }
+    grid_free(&sheet_part);
+    decomp_free(&dec);
 
     // Cleanup OpenGL
     if (visualize) {
@@ -518,5 +1088,5 @@ int main(int argc, char** argv) {
     }
 
     MPI_Finalize();
-    return 0;
+    return status;
 }
\ No newline at end of file